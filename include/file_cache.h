@@ -0,0 +1,130 @@
+/*!
+ * \file file_cache.h
+ * \brief Cache de descritores de arquivos abertos, indexado pelo caminho
+ * resolvido, compartilhado pelos GETs de um reactor. Arquivos pequenos tem
+ * tambem o conteudo em memoria, dentro de um limite de bytes, e arquivos
+ * grandes podem ser mapeados com mmap. Guarda tambem a resolucao dos
+ * recursos requisitados em caminhos, inclusive dos inexistentes
+ */
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#undef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+#define FILE_CACHE_BITS 8
+#define FILE_CACHE_BUCKETS (1 << FILE_CACHE_BITS)
+#define FILE_CACHE_MAX 256
+#define FILE_CACHE_CONTENT 65536
+#define FILE_CACHE_MEM (16 * 1024 * 1024)
+#define FILE_CACHE_MAP_MEM ((off_t) 1024 * 1024 * 1024)
+#define FILE_CACHE_READAHEAD (1024 * 1024)
+#define FILE_CACHE_LOG 64
+#define PATH_CACHE_BITS 10
+#define PATH_CACHE_BUCKETS (1 << PATH_CACHE_BITS)
+#define PATH_CACHE_MAX 1024
+
+/*! \brief Arquivo aberto. Enquanto referenciado fica fora da lista LRU; sem
+ * referencias, fica nela aguardando reuso ou remocao */
+typedef struct file_entry_
+{
+  char *path; /*!< Caminho resolvido */
+  unsigned int hash; /*!< Posicao na tabela */
+  int fd; /*!< Descritor, usado com pread / sendfile / io_uring */
+  off_t size; /*!< Tamanho na abertura */
+  dev_t dev; /*!< Dispositivo na abertura */
+  ino_t ino; /*!< Inode na abertura */
+  struct timespec mtime; /*!< Ultima modificacao na abertura */
+  char *data; /*!< Conteudo em memoria (copia ou mapeamento), ou NULL */
+  int mapped; /*!< O conteudo e' um mapeamento do arquivo */
+  int refs; /*!< GETs usando o arquivo */
+  int cached; /*!< Presente na tabela; 0 se invalidado ou sem espaco */
+  struct file_entry_ *next; /*!< Proximo na mesma posicao da tabela */
+  struct file_entry_ *lru_next; /*!< Proximo na LRU (menos recente) */
+  struct file_entry_ *lru_prev; /*!< Anterior na LRU (mais recente) */
+} file_entry;
+
+/*! \brief Resolucao de um recurso requisitado, indexada pelo recurso e
+ * pelo caminho resolvido. Todas as entradas ficam na lista LRU */
+typedef struct path_entry_
+{
+  char *name; /*!< Recurso, como na requisicao */
+  char *path; /*!< Caminho resolvido (parcial, se inexistente) */
+  int exists; /*!< 0 se a resolucao falhou (recurso inexistente) */
+  int direct; /*!< O caminho resolvido e' o proprio recurso, sem links */
+  unsigned int hash; /*!< Posicao na tabela por recurso */
+  unsigned int path_hash; /*!< Posicao na tabela por caminho resolvido */
+  struct path_entry_ *next; /*!< Proximo na mesma posicao da tabela */
+  struct path_entry_ *path_next; /*!< Proximo na mesma posicao por caminho */
+  struct path_entry_ *lru_next; /*!< Proximo na LRU (menos recente) */
+  struct path_entry_ *lru_prev; /*!< Anterior na LRU (mais recente) */
+} path_entry;
+
+/*! \brief Cache de um reactor, limitado a FILE_CACHE_MAX descritores, a
+ * FILE_CACHE_MEM bytes de conteudo, a FILE_CACHE_MAP_MEM bytes mapeados e a
+ * PATH_CACHE_MAX recursos resolvidos */
+typedef struct file_cache_
+{
+  file_entry *table[FILE_CACHE_BUCKETS]; /*!< Tabela hash por caminho */
+  file_entry *lru_head; /*!< Sem referencias, usado mais recentemente */
+  file_entry *lru_tail; /*!< Sem referencias, primeiro a ser removido */
+  int count; /*!< Arquivos na tabela */
+  unsigned long gen; /*!< Geracao de invalidacoes vista por este cache */
+  int validate; /*!< Confere o arquivo no disco a cada uso, enquanto nao
+                     ha outra fonte de invalidacao */
+  off_t content_max; /*!< Maior arquivo com conteudo em memoria, 0 = sem */
+  size_t mem_used; /*!< Bytes de conteudo em memoria */
+  off_t map_min; /*!< Menor arquivo mapeado, 0 = sem mapeamentos */
+  off_t map_used; /*!< Bytes mapeados */
+  unsigned long hits; /*!< GETs servidos do conteudo em memoria */
+  unsigned long misses; /*!< GETs que carregaram o conteudo do disco */
+  unsigned long evictions; /*!< Arquivos fechados por falta de espaco */
+  path_entry *paths[PATH_CACHE_BUCKETS]; /*!< Tabela hash por recurso */
+  path_entry *resolved[PATH_CACHE_BUCKETS]; /*!< Tabela por caminho */
+  path_entry *path_head; /*!< Recurso resolvido mais recentemente */
+  path_entry *path_tail; /*!< Primeiro recurso a ser removido */
+  int path_count; /*!< Recursos na tabela */
+  int path_indirect; /*!< Recursos resolvidos por links, '..' etc. */
+  unsigned long path_hits; /*!< Recursos resolvidos pelo cache */
+  unsigned long path_misses; /*!< Recursos resolvidos com realpath */
+} file_cache;
+
+void file_cache_init(off_t content_max, off_t map_min, file_cache *cache);
+
+file_entry *file_cache_get(const char *path, file_cache *cache);
+
+void file_cache_put(file_entry *entry, file_cache *cache);
+
+void file_entry_advise(const file_entry *entry, off_t from, off_t to);
+
+void file_cache_invalidate(const char *path, file_cache *cache);
+
+const path_entry *file_cache_path_get(const char *name, file_cache *cache);
+
+void file_cache_path_add(const char *name, const char *path, int exists,
+                         int direct, file_cache *cache);
+
+void file_cache_drop(const char *path, int tree, file_cache *cache);
+
+void file_cache_drop_file(const char *path, file_cache *cache);
+
+void file_cache_path_flush(file_cache *cache);
+
+void file_cache_flush(file_cache *cache);
+
+void file_cache_destroy(file_cache *cache);
+
+#endif
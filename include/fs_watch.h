@@ -0,0 +1,52 @@
+/*!
+ * \file fs_watch.h
+ * \brief Observador de alteracoes em uma arvore de diretorios, com inotify,
+ * monitoravel pelo reactor
+ */
+
+#ifndef FS_WATCH_H
+#define FS_WATCH_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FS_WATCH_TREE (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                       IN_DELETE_SELF | IN_MOVE_SELF)
+#define FS_WATCH_MASK (FS_WATCH_TREE | IN_CLOSE_WRITE | IN_ATTRIB)
+#define FS_WATCH_BUF 4096
+#define FS_WATCH_GROW 64
+
+#undef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+/*! \brief Funcao chamada a cada evento. dir e' o diretorio observado (NULL
+ * se eventos foram perdidos) e name a entrada alterada (NULL se o proprio
+ * diretorio) */
+typedef void (*fs_watch_cb)(const char *dir, const char *name,
+                            unsigned int mask, void *arg);
+
+/*! \brief Observador de uma arvore, um watch por diretorio */
+typedef struct fs_watch_
+{
+  int fd; /*!< Descritor do inotify, -1 se inativo */
+  char **dirs; /*!< Caminho de cada diretorio, indexado pelo watch */
+  int num_dirs; /*!< Tamanho do vetor dirs */
+} fs_watch;
+
+int fs_watch_init(const char *root, fs_watch *watch);
+
+int fs_watch_join(const char *dir, const char *name, char *path,
+                  size_t size);
+
+int fs_watch_process(fs_watch_cb callback, void *arg, fs_watch *watch);
+
+void fs_watch_destroy(fs_watch *watch);
+
+#endif
@@ -0,0 +1,85 @@
+/*!
+ * \file http_parser.h
+ * \brief Analisador incremental de requisicoes HTTP. A cada recv, analisa
+ * somente os bytes novos e guarda posicoes no buffer, sem copias
+ */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_PARSER_PAD 32 /*!< Leitura maxima apos os bytes validos */
+#define HTTP_VERSION_PREFIX "HTTP/1."
+#define HTTP_CONTENT_LENGTH "Content-Length"
+#define HTTP_CONNECTION "Connection"
+#define HTTP_RANGE "Range"
+#define HTTP_IF_NONE_MATCH "If-None-Match"
+
+extern const char *supported_methods[];
+typedef enum http_methods_
+{
+  GET,
+  PUT,
+  NUM_METHOD
+} http_methods;
+
+extern const char *supported_protocols[];
+typedef enum http_protocols_
+{
+  HTTP10,
+  HTTP11,
+  NUM_PROTOCOL
+} http_protocols;
+
+typedef enum http_parse_state_
+{
+  HTTP_PARSE_REQUEST_LINE, /*!< Aguardando a linha de requisicao */
+  HTTP_PARSE_HEADERS, /*!< Aguardando headers ou a linha vazia final */
+  HTTP_PARSE_DONE /*!< Requisicao completa */
+} http_parse_state;
+
+/*! \brief Varredura dos fins de linha da requisicao */
+typedef enum http_scan_mode_
+{
+  HTTP_SCAN_AUTO, /*!< A melhor suportada (padrao) */
+  HTTP_SCAN_MEMCHR, /*!< Um memchr por linha */
+  HTTP_SCAN_SSE2, /*!< Blocos de 16 bytes */
+  HTTP_SCAN_AVX2, /*!< Blocos de 32 bytes */
+  NUM_HTTP_SCAN
+} http_scan_mode;
+
+/*! \brief Trecho do buffer da requisicao */
+typedef struct http_span_
+{
+  int start; /*!< Posicao no buffer */
+  int len; /*!< Tamanho, 0 se ausente */
+} http_span;
+
+/*! \brief Estado do analisador e resultado da analise */
+typedef struct http_parser_
+{
+  http_parse_state state; /*!< Estado atual */
+  int pos; /*!< Proximo byte a analisar */
+  int line_start; /*!< Inicio da linha em analise */
+  int malformed; /*!< Linha de requisicao invalida */
+  int method; /*!< Metodo (http_methods), -1 se nao suportado */
+  int protocol; /*!< Protocolo (http_protocols), -1 se nao suportado */
+  http_span target; /*!< Recurso solicitado */
+  long long content_length; /*!< Content-Length, -1 se ausente/invalido */
+  http_span connection; /*!< Valor do header Connection */
+  http_span range; /*!< Valor do header Range */
+  http_span if_none_match; /*!< Valor do header If-None-Match */
+  int header_end; /*!< Fim dos headers, inicio do corpo */
+} http_parser;
+
+void http_parser_init(http_parser *parser);
+
+int http_parser_execute(const char *buffer, int len, http_parser *parser);
+
+int http_span_starts(const char *buffer, http_span span, const char *token);
+
+int http_scan_select(http_scan_mode mode);
+
+#endif
@@ -6,15 +6,30 @@
 #ifndef MULTITHREAD_H
 #define MULTITHREAD_H
 
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
 #define THREAD_NUM 4
-#define SIGNAL_LEN 65
+#define MAX_WORKERS 64
+#define TASK_RING_SIZE 4096
+#define CACHE_LINE 64
+#define DONE_RING_SIZE (THREAD_NUM * TASK_RING_SIZE)
+#define POOL_GROW_WAIT_NS 1000000LL
+#define POOL_SHRINK_WAIT_NS 100000LL
+
+typedef enum worker_state_
+{
+  WORKER_STOPPED, /*<! Nunca iniciada ou ja encerrada e aguardada */
+  WORKER_RUNNING, /*<! Em execucao */
+  WORKER_EXITED /*<! Retirada do pool, aguardando pthread_join */
+} worker_state;
 
 typedef enum task_status_
 {
@@ -24,41 +39,99 @@ typedef enum task_status_
   NUM_TASK_STATUS
 } task_status;
 
-typedef struct task_node_ 
+/*! \brief Posicao da fila de tarefas */
+typedef struct task_slot_
 {
+  unsigned long seq; /*<! Igual a posicao quando livre para insercao,
+                          posicao + 1 quando preenchida */
   void (*function)(void *); /*<! Ponteiro para a funcao da tarefa */
   void *argument; /*<! Argumento passado para a funcao */
-  struct task_node_ *next; /*<! Proximo elemento da lista */
-  struct task_node_ *prev; /*<! Elemento anterior */
-} task_node;
+  long long queued_ns; /*<! Instante da insercao */
+} task_slot;
+
+/*! \brief Fila circular de tarefas, limitada e sem locks, com multiplos
+ * produtores e consumidores. As posicoes sao alocadas uma vez, no inicio */
+typedef struct task_ring_
+{
+  task_slot *slots; /*<! Posicoes da fila */
+  unsigned long mask; /*<! Quantidade de posicoes - 1 */
+  unsigned long head; /*<! Proxima posicao a inserir */
+  char pad_head[CACHE_LINE]; /*<! Separa head e tail em linhas de cache */
+  unsigned long tail; /*<! Proxima posicao a retirar */
+  char pad_tail[CACHE_LINE]; /*<! Separa tail dos campos seguintes */
+} task_ring;
 
-typedef struct task_list_ {
-  task_node *head; /*<! Cabeca da lista */
-  int size; /*<! Tamanho da lista */
-} task_list;
+int task_ring_init(unsigned long size, task_ring *ring);
 
-task_node *task_node_alloc(void (*function)(void *), void *argument);
+void task_ring_destroy(task_ring *ring);
 
-int task_node_free(task_node *node);
+int task_ring_push(void (*function)(void *), void *argument,
+                   long long queued_ns, task_ring *ring);
 
-void task_node_append(task_node *new_node, task_list *queue);
+int task_ring_pop(task_slot *task, task_ring *ring);
 
-task_node *task_node_pop_first(task_list *queue);
+int task_ring_depth(const task_ring *ring);
+
+struct threadpool_;
+
+/*! \brief Thread do pool, com a propria fila de tarefas */
+typedef struct worker_
+{
+  task_ring queue; /*<! Tarefas destinadas a esta thread */
+  pthread_t thread; /*<! A thread */
+  pthread_cond_t notify; /*<! Acorda a thread estacionada */
+  int parked; /*<! Thread estacionada ou prestes a estacionar */
+  worker_state state; /*<! Estado da thread, alterado sob o lock do pool */
+  unsigned long stolen; /*<! Tarefas retiradas das filas de outras threads */
+  unsigned long tasks; /*<! Tarefas executadas */
+  unsigned long long wait_ns; /*<! Espera na fila das tarefas executadas */
+  int id; /*<! Posicao no pool */
+  struct threadpool_ *pool; /*<! O pool */
+} worker;
 
 typedef struct threadpool_ {
-  pthread_mutex_t lock; /*<! Variavel para mutex */
-  pthread_cond_t notify; /*<! Variavel para notificar threads */
-  pthread_t *threads; /*<! Array de threads */
-  task_list *queue; /*<! Array de queue */
+  pthread_mutex_t lock; /*<! Mutex para estacionar as threads */
+  worker *workers; /*<! Array de MAX_WORKERS threads */
+  int num_workers; /*<! Threads ativas, que recebem tarefas */
+  int num_slots; /*<! Posicoes ja usadas, ativas ou nao, alvo de roubos */
+  int min_workers; /*<! Minimo de threads no ajuste automatico */
+  int max_workers; /*<! Maximo de threads no ajuste automatico */
+  int depth_max; /*<! Maior profundidade da fila observada na insercao */
+  int depth_peak; /*<! Maior profundidade desde o ultimo ajuste */
+  unsigned long last_tasks; /*<! Tarefas executadas ate o ultimo ajuste */
+  unsigned long long last_wait_ns; /*<! Espera acumulada ate o ultimo
+                                        ajuste */
+  unsigned long full; /*<! Insercoes recusadas com as filas cheias */
   int shut_down; /*<! Flag para encerramento */
-  int l_socket; /*<! Socket local */
+  task_ring done; /*<! Argumentos das tarefas concluidas */
+  int pending; /*<! Tarefas inseridas e ainda nao recolhidas de done. So' o
+                    reactor altera */
+  int event_fd; /*<! Avisa o reactor de tarefas concluidas */
+  int notified; /*<! Aviso ja enviado e ainda nao consumido */
 } threadpool;
 
-int threadpool_init(const char *lsocket_name, threadpool *pool);
+int threadpool_init(int min_workers, int max_workers, threadpool *pool);
+
+int threadpool_resize(int num_workers, threadpool *pool);
+
+int threadpool_set_limits(int min_workers, int max_workers,
+                          threadpool *pool);
+
+int threadpool_scale(threadpool *pool);
 
 int threadpool_add(void (*function)(void *), void *argument, 
                    threadpool *pool);
 
+int threadpool_ack(threadpool *pool);
+
+int threadpool_done(void **argument, threadpool *pool);
+
+int threadpool_wakeup(threadpool *pool);
+
+int threadpool_depth(const threadpool *pool);
+
+unsigned long threadpool_stolen(const threadpool *pool);
+
 int threadpool_destroy(threadpool *pool);
 
 #endif
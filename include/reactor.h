@@ -0,0 +1,74 @@
+/*!
+ * \file reactor.h
+ * \brief Interface do laco de eventos do servidor, com backend epoll ou
+ * pselect
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#undef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define REACTOR_MAX_EVENTS 1024
+
+#define EV_READ 0x01
+#define EV_WRITE 0x02
+#define EV_ERROR 0x04
+
+extern const char *supported_backends[];
+typedef enum reactor_backend_
+{
+  SELECT_BACKEND,
+  EPOLL_BACKEND,
+  NUM_BACKEND
+} reactor_backend;
+
+/*! \brief Evento pronto entregue pelo reactor */
+typedef struct reactor_event_
+{
+  void *data; /*!< Dado associado ao descritor no registro */
+  unsigned int events; /*!< Eventos prontos (EV_READ, EV_WRITE, EV_ERROR) */
+} reactor_event;
+
+/*! \brief Estado do laco de eventos. No backend pselect os fd_sets mestres
+ * sao mantidos incrementalmente e copiados a cada espera */
+typedef struct reactor_
+{
+  reactor_backend backend; /*!< Backend em uso */
+  int epollfd; /*!< Descritor do epoll */
+  struct epoll_event *ep_events; /*!< Eventos retornados pelo epoll */
+  fd_set read_s; /*!< fd_set mestre de leitura */
+  fd_set write_s; /*!< fd_set mestre de escrita */
+  fd_set except_s; /*!< fd_set mestre de excecao */
+  int maxfd; /*!< Maior descritor registrado */
+  void *fd_data[FD_SETSIZE]; /*!< Dado de cada descritor no pselect */
+  reactor_event *events; /*!< Eventos prontos da ultima espera */
+} reactor;
+
+int reactor_init(reactor_backend backend, reactor *r);
+
+int reactor_parse_backend(const char *backend_str, reactor_backend *backend);
+
+int reactor_fd_allowed(int fd, reactor *r);
+
+int reactor_add(int fd, unsigned int events, void *data, reactor *r);
+int reactor_mod(int fd, unsigned int events, void *data, reactor *r);
+int reactor_del(int fd, reactor *r);
+
+int reactor_wait(const struct timespec *timeout, const sigset_t *sigmask,
+                 reactor *r);
+
+void reactor_destroy(reactor *r);
+
+#endif
@@ -10,10 +10,15 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <file_cache.h>
+#include <fs_watch.h>
+#include <http_parser.h>
 #include <limits.h>
 #include <multithread.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <reactor.h>
 #include <signal.h>
 #include <string.h>
 #include <stddef.h>
@@ -21,14 +26,17 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <time.h>
+#include <timer_wheel.h>
 #include <token_bucket.h>
 #include <unistd.h>
+#include <uring.h>
 
 #undef MAX
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
@@ -38,25 +46,43 @@
 #define STR(x) STR_(x)
 
 #define BUFFER_LEN BUFSIZ
+#define SENDFILE_CHUNK (16 * BUFFER_LEN)
+#define PIPE_LEN (8 * BUFFER_LEN)
 #define REQUEST_SIZE 1024
+#define PIPELINE_BUF(client) ((client)->buffer + BUFFER_LEN)
 #define LISTEN_BACKLOG 512
+#define ACCEPT_BATCH 64
+#define ACCEPT_HIST_LEN 7
 #define ROOT_LEN PATH_MAX
 #define NUMBER_BASE 10
 #define PORT_LEN 8
 #define VEL_LEN 12
-#define PROTOCOL_LEN 9
-#define METHOD_LEN 5 
 #define RESOURCE_LEN 200
-#define STR_PROTOCOL_LEN STR(PROTOCOL_LEN)
-#define STR_METHOD_LEN STR(METHOD_LEN)
-#define STR_RESOURCE_LEN STR(RESOURCE_LEN)
-#define LSOCK_NAME "/home/nilson.junior/Documentos/treinamento/treinamento.socket"
+#define PUT_TMP_NAME ".%s" PUT_TMP_SUFFIX "%d"
+#define PUT_TMP_SUFFIX ".put"
+#define PUT_TMP_LEN 16
+#define PUT_FD_PATH "/proc/self/fd/%d"
+#define PUT_FD_PATH_LEN 32
 #define CONFIG_PATH "/home/nilson.junior/Documentos/treinamento/serverConfig/"
 #define PID_FILE "servidorWeb.pid"
 #define CONFIG_FILE "servidorWebConfig.txt"
 #define LOG_FILE "log.txt"
+#define STATS_FILE "servidorWeb.stats"
 #define PID_LEN 10
 #define CONFIG_PARAM_NUM 3
+#define CONFIG_LINES 5
+#define MAX_WEIGHTS 16
+#define MAX_WEIGHT 64
+#define SERVER_OPTIONS "b:c:d:e:g:i:k:K:m:M:r:w:"
+#define MAX_REACTORS 64
+#define CLIENT_TIMEOUT 30
+#define KEEPALIVE_MAX 100
+#define KEEPALIVE_TIMEOUT 5
+#define POOL_SCALE_MS 1000
+#define BUCKET_DEPTH_DIV 10
+#define RATE_LEVELS 2
+#define IP_HASH_BITS 8
+#define IP_HASH_SIZE (1 << IP_HASH_BITS)
 
 #define READ_REQUEST 0x01
 #define REQUEST_RECEIVED 0x02
@@ -67,25 +93,27 @@
 #define PENDING_DATA 0x40
 #define FINISHED 0x80
 
+#define URING_READ 0x0
+#define URING_SEND 0x1
+#define URING_RECV 0x2
+#define URING_WRITE 0x3
+#define URING_OP_MASK 0x3
+#define URING_BIT(op) (1 << (op))
+
 #define ROOT_CONFIG 0
 #define PORT_CONFIG 1
 #define VEL_CONFIG 2
+#define WEIGHT_CONFIG 3
+#define WORKERS_CONFIG 4
 
-extern const char *supported_methods[];
-typedef enum http_methods_
-{
-  GET,
-  PUT,
-  NUM_METHOD
-} http_methods;
-
-extern const char *supported_protocols[];
-typedef enum http_protocols_
+extern const char *supported_engines[];
+typedef enum io_engine_
 {
-  HTTP10,
-  HTTP11,
-  NUM_PROTOCOL
-} http_protocols;
+  THREAD_ENGINE,
+  URING_ENGINE,
+  SENDFILE_ENGINE,
+  NUM_ENGINE
+} io_engine;
 
 typedef enum http_code_
 {
@@ -122,6 +150,10 @@ file_node *file_node_allocate(const char *file_name, http_methods method);
 int verify_file_status(const char *file_name, http_methods cli_method,
                        file_list *l_files, file_node *match_file);
 
+struct client_slab_;
+struct client_queue_;
+struct ip_node_;
+
 /*! \brief Um no' para a lista de clientes  */
 typedef struct client_node_ 
 {
@@ -129,6 +161,7 @@ typedef struct client_node_
   char *buffer; /*!< Buffer do cliente */
   int pos_buf; /*!< Posicao da escrita no buffer */
   int pos_header; /*!< Posicao do fim do header */
+  http_parser parser; /*!< Analise incremental da requisicao */
   int b_to_transfer; /*!< Bytes a transferir */
   task_status task_st; /*!< Status da tarefa do cliente */
   unsigned char status; /*!< Flags para o estado do cliente */
@@ -136,62 +169,216 @@ typedef struct client_node_
   http_protocols protocol; /*!< Protocolo usado na request */
   http_code resp_status; /*!< Codigo para a resposta ao cliente */
   FILE *file; /*!< Arquivo para o recurso solicitado */
+  int file_fd; /*!< Arquivo do GET ou do PUT com splice, -1 se nao usado */
+  off_t file_size; /*!< Tamanho do arquivo do GET */
+  file_entry *cached; /*!< Arquivo do GET, compartilhado no cache */
+  char *put_path; /*!< Recurso do PUT, substituido e invalidado ao fim */
+  int put_anon; /*!< Temporario do PUT sem nome (O_TMPFILE), ligado ao fim */
+  int pipe_fds[2]; /*!< Pipe do PUT com splice, -1 se nao usado */
+  long long content_len; /*!< Content-Length do PUT, -1 se ausente */
+  long long body_len; /*!< Bytes do corpo do PUT ja recebidos */
+  int keep_alive; /*!< A conexao continua apos a resposta atual */
+  int requests; /*!< Requisicoes recebidas na conexao */
+  int pipelined; /*!< Bytes recebidos da proxima requisicao, guardados em
+                      PIPELINE_BUF durante a resposta atual */
   token_bucket bucket; /*!< Bucket para controle de velocidade */
   file_node *used_file; /*!< Endereco do arquivo sendo usado */
+  unsigned int ev_mask; /*!< Eventos registrados no reactor */
+  off_t file_offset; /*!< Posicao do cliente no arquivo */
+  int uring_inflight; /*!< Operacoes pendentes no io_uring */
+  unsigned char uring_ops; /*!< Operacoes do lote atual (URING_BIT) */
+  struct client_slab_ *slab; /*!< Bloco em que o cliente foi alocado */
+  long long burst_start; /*!< Inicio da burst atual do cliente (ms) */
+  timer_entry refill_timer; /*!< Recarga do bucket quando sem tokens */
+  timer_entry idle_timer; /*!< Prazo de inatividade da conexao */
+  struct ip_node_ *ip; /*!< Endereco de origem, com limite por endereco */
+  int reserved; /*!< Tokens reservados nos niveis acima da conexao */
+  int paced; /*!< Envio cadenciado pelo kernel (SO_MAX_PACING_RATE) */
+  int weight; /*!< Peso no escalonador dos niveis */
+  int deficit; /*!< Deficit no escalonador dos niveis */
+  unsigned int ready_events; /*!< Eventos assumidos na fila de prontos */
+  struct client_queue_ *queue; /*!< Fila em que o cliente esta */
+  struct client_node_ *q_next; /*!< Proximo na fila */
+  struct client_node_ *q_prev; /*!< Anterior na fila */
   struct client_node_ *next; /*!< Proximo no' */
   struct client_node_ *prev; /*!< No' anterior */
 } client_node;
 
+/*! \brief Bloco de clientes alocados juntos em um lote de accept */
+typedef struct client_slab_
+{
+  int refs; /*!< Clientes do bloco ainda nao liberados */
+  client_node clients[]; /*!< Os clientes */
+} client_slab;
+
 /*! \brief Lista de clients  */
 typedef struct client_list_
 {
   client_node *head; /*!< Primeiro elemento da lista */
+  client_node *tail; /*!< Ultimo elemento da lista */
   int size; /*!< Tamanho da lista atual */
 } client_list; 
 
+/*! \brief Fila de clientes, encadeada por q_next / q_prev. Um cliente esta
+ * em no maximo uma fila */
+typedef struct client_queue_
+{
+  client_node *head; /*!< Primeiro da fila */
+  client_node *tail; /*!< Ultimo da fila */
+  int size; /*!< Tamanho da fila */
+} client_queue;
+
+/*! \brief Bucket de um nivel da hierarquia, comum a todos os reactors */
+typedef struct rate_bucket_
+{
+  pthread_mutex_t lock; /*!< Protege o bucket e burst_start */
+  unsigned int rate; /*!< Taxa em B/s, 0 para sem limite */
+  token_bucket bucket; /*!< Bucket do nivel */
+  long long burst_start; /*!< Inicio da burst atual (ms) */
+} rate_bucket;
+
+/*! \brief Nivel da hierarquia de limitacao de banda acima da conexao
+ * (endereco de origem ou servidor), como visto por um reactor: os tokens
+ * vem do bucket comum, e a espera e' local */
+typedef struct rate_level_
+{
+  rate_bucket *shared; /*!< Bucket do nivel, NULL para sem limite */
+  timer_entry refill_timer; /*!< Recarga do bucket quando sem tokens */
+  client_queue waiting; /*!< Clientes do reactor aguardando o nivel */
+} rate_level;
+
+/*! \brief Endereco de origem com conexoes abertas em algum reactor, na
+ * tabela comum aos reactors */
+typedef struct ip_bucket_
+{
+  in_addr_t addr; /*!< O endereco */
+  unsigned int hash; /*!< Posicao na tabela */
+  int refs; /*!< Reactors com conexoes do endereco */
+  rate_bucket limit; /*!< Limite do endereco */
+  struct ip_bucket_ *next; /*!< Proximo na mesma posicao */
+} ip_bucket;
+
+/*! \brief Endereco de origem com conexoes abertas no reactor, na tabela
+ * hash do reactor */
+typedef struct ip_node_
+{
+  in_addr_t addr; /*!< O endereco */
+  unsigned int hash; /*!< Posicao na tabela */
+  int refs; /*!< Conexoes do endereco */
+  ip_bucket *bucket; /*!< Limite do endereco, comum aos reactors */
+  rate_level level; /*!< Espera pelo limite do endereco */
+  struct ip_node_ *next; /*!< Proximo na mesma posicao */
+} ip_node;
+
+/*! \brief Peso no escalonador para recursos com um prefixo */
+typedef struct path_weight_
+{
+  char prefix[RESOURCE_LEN + 1]; /*!< Prefixo do recurso */
+  int weight; /*!< Peso */
+} path_weight;
+
+void client_queue_push(client_node *client, client_queue *queue);
+void client_queue_push_head(client_node *client, client_queue *queue);
+client_node *client_queue_pop(client_queue *queue);
+void client_queue_remove(client_node *client);
+
 void client_node_append(client_node *client, 
                         client_list *list_of_clients);
 int client_node_pop(client_node *client, 
                     client_list *list_of_clients);
 
+int client_node_allocate_batch(const int *sockfds, int num_clients,
+                               client_node **clients);
 client_node *client_node_allocate(int sockfd);
 void client_node_free(client_node *client);
 
-/*! \brief Guarda as variaveis do tipo fd_set vinculadas ao servidor
- */
-typedef struct server_fd_sets_ 
+/*! \brief Estatisticas do reactor, escritas em arquivo com SIGUSR1 */
+typedef struct server_stats_
 {
-  fd_set write_s; /*!< fd_set de escrita */
-  fd_set read_s; /*!< fd_set de leitura */
-  fd_set except_s; /*!< fd_set de excecao */
-} server_fd_sets;
+  unsigned long accept_wakeups; /*!< Acordadas com conexoes aceitas */
+  unsigned long accepted; /*!< Total de conexoes aceitas */
+  int accept_last; /*!< Conexoes aceitas na ultima acordada */
+  int accept_max; /*!< Maior lote aceito em uma acordada */
+  unsigned long accept_hist[ACCEPT_HIST_LEN]; /*!< Lotes por potencia de 2 */
+  unsigned long reused; /*!< Requisicoes em conexoes reaproveitadas */
+  unsigned long pipelined; /*!< Requisicoes recebidas junto a anterior */
+} server_stats;
 
 /*! \brief Informacoes a respeito do estado atual do servidor */
 typedef struct server_ 
 {
   client_list l_clients; /*!< Lista de clientes conectados */
-  server_fd_sets sets; /*!< Os fd_sets */
+  client_queue ready_q; /*!< Clientes com trabalho sem esperar o reactor */
+  timer_wheel timers; /*!< Temporizadores de recarga e inatividade */
+  long long now_ns; /*!< Instante atual, atualizado a cada iteracao */
+  long long now_ms; /*!< Instante atual em milissegundos */
+  reactor ev_loop; /*!< Laco de eventos (epoll ou pselect) */
+  reactor_backend backend; /*!< Backend escolhido para o laco de eventos */
   long listen_port; /*!< A porta de escuta do servidor */
   int listenfd; /*!< O socket de escuta */
-  int l_socket; /*!< Socket de escuta local */
-  int maxfd_number; /*!< O maior descritor a observar */
+  int reactor_id; /*!< Indice do reactor */
+  int num_reactors; /*!< Numero de reactors independentes */
   char serv_root[PATH_MAX]; /*!< O endereco do root do servidor */
   unsigned int velocity; /*!< Velocidade de conexao */
-  struct timespec last_burst; /*!< Ultimo inicio de burst */
+  unsigned int ip_rate; /*!< Limite por endereco de origem, 0 = sem */
+  unsigned int global_rate; /*!< Limite do servidor, 0 = sem */
+  rate_level global_level; /*!< Espera pelo limite do servidor */
+  ip_node *ip_table[IP_HASH_SIZE]; /*!< Enderecos com conexoes no reactor */
+  path_weight weights[MAX_WEIGHTS]; /*!< Pesos por prefixo de recurso */
+  int num_weights; /*!< Numero de pesos configurados */
+  bucket_mode b_mode; /*!< Modo de recarga dos buckets */
+  int bucket_depth; /*!< Capacidade do bucket continuo, 0 = automatica */
   threadpool thread_pool; /*!< Pool de threads */
-  file_list used_files; /*! Arquivos que estao sendo escritos */
-  client_node* cli_signaled[FD_SETSIZE]; /*!< Vetor de sinalizacao */
+  int min_workers; /*!< Minimo de threads do pool */
+  int max_workers; /*!< Maximo de threads do pool, acima de min_workers
+                        ativa o ajuste automatico */
+  timer_entry pool_timer; /*!< Ajuste automatico do pool */
+  io_engine engine; /*!< Motor de execucao das operacoes de I/O */
+  uring ring; /*!< io_uring, quando engine e' URING_ENGINE */
+  file_cache f_cache; /*!< Descritores abertos compartilhados pelos GETs */
+  fs_watch watch; /*!< Alteracoes na raiz, invalidam o cache de recursos */
+  off_t content_max; /*!< Maior arquivo com conteudo no cache, 0 = sem */
+  off_t map_min; /*!< Menor arquivo mapeado no cache, 0 = sem */
+  int keepalive_max; /*!< Requisicoes por conexao, 0 = sem keep-alive */
+  int keepalive_timeout; /*!< Inatividade maxima entre requisicoes (s) */
+  server_stats stats; /*!< Estatisticas do reactor */
 } server;
 
-int server_init(int argc, const char **argv, server *r_server);
+int server_parse_arguments(int argc, const char *argv[], server *r_server);
+
+int server_init(int reactor_id, const server *model, server *r_server);
+
+void server_wakeup(server *r_server);
 
 int server_select_analysis(server *r_server, struct timespec **timeout,
-                           struct timespec *burst_rem_time);
+                           struct timespec *rem_time);
+
+int server_update_clock(server *r_server);
 
 int server_make_connection(server *r_server);
 
 int server_client_remove(client_node **cur_client, server *r_server);
 
+int server_client_update_events(client_node *client, server *r_server);
+
+void server_client_sync_bucket(client_node *client, server *r_server);
+
+int server_client_transmission(const client_node *client, server *r_server);
+
+int server_client_tokens(const client_node *client, server *r_server);
+
+void server_client_reserve(int tokens, client_node *client, server *r_server);
+
+void server_client_withdraw(int bytes, client_node *client, server *r_server);
+
+void server_client_release(client_node *client, server *r_server);
+
+void server_client_set_ready(client_node *client, server *r_server);
+
+void server_client_touch(client_node *client, server *r_server);
+
+int server_client_finish(client_node *client, server *r_server);
+
 int server_recv_client_request(int bytes_to_receive,
                                client_node *cur_client);
 
@@ -203,12 +390,16 @@ int server_build_header(client_node *cur_client);
 void server_read_file(void *cur_client);
 void server_write_file(void *c_client);
 
-int server_recv_response(client_node *client);
-int server_send_response(client_node *cur_client);
+int server_recv_response(client_node *client, server *r_server);
+int server_send_response(client_node *cur_client, server *r_server);
+
+void server_uring_reap(server *r_server);
+int server_uring_flush(server *r_server);
 
-void server_recv_thread_signals(server *r_server);
 void server_process_thread_signals(server *r_server);
 
+void server_process_fs_events(server *r_server);
+
 int server_process_read_file(client_node *client, server *r_server);
 int server_process_write_file(client_node *client, server *r_server);
 
@@ -218,6 +409,10 @@ void clean_up_server(server *r_server);
 
 int server_write_pid_file();
 
+int server_write_stats_file(server *r_server);
+
 void alter_config(server *r_server);
 
+void server_load_config(server *r_server);
+
 #endif
@@ -0,0 +1,65 @@
+/*!
+ * \file timer_wheel.h
+ * \brief Roda de temporizadores hierarquica, com dois niveis, para prazos
+ * por cliente (recarga de tokens e inatividade)
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_L0_BITS 8
+#define TIMER_L1_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_L1_SIZE (1 << TIMER_L1_BITS)
+#define TIMER_L0_MASK (TIMER_L0_SIZE - 1)
+#define TIMER_L1_MASK (TIMER_L1_SIZE - 1)
+
+struct timer_entry_;
+
+/*! \brief Funcao chamada quando um temporizador expira */
+typedef void (*timer_cb)(struct timer_entry_ *entry, void *arg);
+
+/*! \brief Temporizador, embutido na estrutura de quem o usa */
+typedef struct timer_entry_
+{
+  struct timer_entry_ *next; /*!< Proximo no mesmo slot */
+  struct timer_entry_ *prev; /*!< Anterior no mesmo slot */
+  struct timer_entry_ **slot; /*!< Slot em que esta, NULL se inativo */
+  unsigned long long expire; /*!< Tick de expiracao */
+  timer_cb callback; /*!< Funcao chamada na expiracao */
+  void *data; /*!< Dado do dono do temporizador */
+} timer_entry;
+
+/*! \brief Roda de temporizadores. O nivel 0 tem resolucao de um tick e o
+ * nivel 1 de TIMER_L0_SIZE ticks, sendo redistribuido no nivel 0 a cada volta
+ * completa deste */
+typedef struct timer_wheel_
+{
+  long long base_ms; /*!< Instante correspondente ao tick 0 */
+  unsigned long long cur_tick; /*!< Ultimo tick processado */
+  int count; /*!< Numero de temporizadores ativos */
+  timer_entry *l0[TIMER_L0_SIZE]; /*!< Nivel 0 */
+  timer_entry *l1[TIMER_L1_SIZE]; /*!< Nivel 1 */
+} timer_wheel;
+
+void timer_wheel_init(long long now_ms, timer_wheel *wheel);
+
+void timer_entry_init(timer_cb callback, void *data, timer_entry *entry);
+
+void timer_wheel_add(long long expire_ms, timer_entry *entry,
+                     timer_wheel *wheel);
+
+void timer_wheel_del(timer_entry *entry, timer_wheel *wheel);
+
+int timer_wheel_pending(const timer_entry *entry);
+
+void timer_wheel_advance(long long now_ms, void *arg, timer_wheel *wheel);
+
+long long timer_wheel_next_ms(long long now_ms, const timer_wheel *wheel);
+
+#endif
@@ -13,11 +13,27 @@
 #include <unistd.h>
 
 #define BURST_TIME 1
+#define NSEC_PER_SEC 1000000000LL
+
+#undef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#undef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+extern const char *supported_bucket_modes[];
+typedef enum bucket_mode_
+{
+  BURST_BUCKET, /*!< Recarga completa a cada BURST_TIME */
+  CONTINUOUS_BUCKET, /*!< Recarga proporcional ao tempo decorrido */
+  PACING_BUCKET, /*!< Envio cadenciado pelo kernel, burst como alternativa */
+  NUM_BUCKET_MODE
+} bucket_mode;
 
 typedef struct token_bucket_
 {
   int remain_tokens; /*!< Numero atual de tokens */
   int transmission; /*!< Flag para transmissao */
+  int resume; /*!< Minimo de tokens para transmitir (bucket continuo) */
+  long long last_ns; /*!< Instante ate o qual os tokens foram creditados */
 } token_bucket;
 
 void bucket_init(const int rate, token_bucket *bucket);
@@ -26,6 +42,18 @@ int bucket_withdraw(const int remove_tokens, token_bucket *bucket);
 
 void bucket_fill(const int rate, token_bucket *bucket);
 
+void bucket_deposit(const int tokens, token_bucket *bucket);
+
+int bucket_parse_mode(const char *mode_str, bucket_mode *mode);
+
+void bucket_init_continuous(const int depth, const int resume,
+                            const long long now_ns, token_bucket *bucket);
+
+void bucket_refill(const int rate, const int depth, const long long now_ns,
+                   token_bucket *bucket);
+
+long long bucket_ready_time(const int rate, const token_bucket *bucket);
+
 void bucket_burst_remain_time(const struct timespec *burst_cur_time,
                               struct timespec *burst_rem_time);
 
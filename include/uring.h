@@ -0,0 +1,70 @@
+/*!
+ * \file uring.h
+ * \brief Interface minima para o io_uring, usando as chamadas de sistema
+ * diretamente
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 256
+#define URING_REAP_BATCH 64
+#define URING_SUBMIT_RETRIES 4
+
+/*! \brief Copia dos campos usados de uma conclusao do io_uring */
+typedef struct uring_cqe_
+{
+  unsigned long long user_data; /*!< Dado informado na submissao */
+  int res; /*!< Resultado da operacao */
+} uring_cqe;
+
+/*! \brief Estado de um io_uring com seus aneis mapeados em memoria */
+typedef struct uring_
+{
+  int ring_fd; /*!< Descritor do io_uring, monitoravel pelo reactor */
+  unsigned *sq_head; /*!< Cabeca do anel de submissao (kernel) */
+  unsigned *sq_tail; /*!< Cauda do anel de submissao */
+  unsigned *sq_mask; /*!< Mascara do anel de submissao */
+  unsigned *sq_array; /*!< Indices das entradas submetidas */
+  unsigned *sq_flags; /*!< Flags do anel de submissao (kernel) */
+  unsigned sq_entries; /*!< Tamanho do anel de submissao */
+  unsigned sqe_tail; /*!< Cauda local, ainda nao publicada */
+  struct io_uring_sqe *sqes; /*!< Entradas de submissao */
+  unsigned *cq_head; /*!< Cabeca do anel de conclusao */
+  unsigned *cq_tail; /*!< Cauda do anel de conclusao (kernel) */
+  unsigned *cq_mask; /*!< Mascara do anel de conclusao */
+  struct io_uring_cqe *cqes; /*!< Entradas de conclusao */
+  void *sq_ring; /*!< Mapeamento do anel de submissao */
+  size_t sq_ring_len; /*!< Tamanho do mapeamento de submissao */
+  void *cq_ring; /*!< Mapeamento do anel de conclusao */
+  size_t cq_ring_len; /*!< Tamanho do mapeamento de conclusao */
+  size_t sqes_len; /*!< Tamanho do mapeamento das entradas */
+} uring;
+
+int uring_init(unsigned entries, uring *ring);
+
+int uring_reserve(unsigned count, uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+
+void uring_prep_rw(int opcode, int fd, void *buf, unsigned len,
+                   unsigned long long offset, unsigned long long user_data,
+                   struct io_uring_sqe *sqe);
+
+int uring_submit(uring *ring);
+
+int uring_reap(uring_cqe *cqes, unsigned max, uring *ring);
+
+void uring_destroy(uring *ring);
+
+#endif
@@ -0,0 +1,692 @@
+/*!
+ * \file file_cache.c
+ * \brief Implementacao do cache de descritores de arquivos abertos
+ */
+
+#include "file_cache.h"
+
+/*! \brief Invalidacoes feitas por todos os reactors, numeradas por
+ * file_cache_gen, com os caminhos das ultimas FILE_CACHE_LOG. Cada cache
+ * guarda a ultima que viu e descarta somente os caminhos invalidados desde
+ * entao; se ficou mais de FILE_CACHE_LOG atras, descarta tudo */
+static unsigned long file_cache_gen = 0;
+static char file_cache_log[FILE_CACHE_LOG][PATH_MAX];
+static pthread_mutex_t file_cache_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! \brief Hash FNV-1a do caminho
+ *
+ * \param[in] path O caminho
+ * \param[in] buckets Tamanho da tabela, potencia de 2
+ *
+ * \return hash Posicao na tabela
+ */
+static unsigned int file_cache_hash(const char *path, unsigned int buckets)
+{
+  unsigned int hash = 2166136261u;
+
+  for (; *path; path++)
+  {
+    hash ^= (unsigned char) *path;
+    hash *= 16777619u;
+  }
+
+  return hash & (buckets - 1);
+}
+
+/*! \brief Inicializa um cache vazio
+ *
+ * \param[in] content_max Maior arquivo com conteudo em memoria, 0 = sem
+ * \param[in] map_min Menor arquivo mapeado com mmap, 0 = sem
+ * \param[out] cache O cache
+ */
+void file_cache_init(off_t content_max, off_t map_min, file_cache *cache)
+{
+  memset(cache, 0, sizeof(*cache));
+  cache->gen = __atomic_load_n(&file_cache_gen, __ATOMIC_ACQUIRE);
+  cache->validate = 1;
+  cache->content_max = content_max;
+  cache->map_min = map_min;
+}
+
+/*! \brief Fecha o arquivo e libera a entrada. O conteudo so' deixa de ser
+ * contado no limite do cache aqui, quando a memoria e' de fato liberada
+ *
+ * \param[out] entry A entrada
+ * \param[out] cache O cache que contou o conteudo
+ */
+static void file_entry_free(file_entry *entry, file_cache *cache)
+{
+  if (0 <= entry->fd)
+    close(entry->fd);
+  if (entry->mapped)
+  {
+    munmap(entry->data, entry->size);
+    cache->map_used -= entry->size;
+  }
+  else if (entry->data)
+  {
+    free(entry->data);
+    cache->mem_used -= entry->size;
+  }
+  free(entry->path);
+  free(entry);
+}
+
+/*! \brief Abre um arquivo regular para leitura
+ *
+ * \param[in] path Caminho resolvido do arquivo
+ * \param[out] cache O cache
+ *
+ * \return NULL Caso erro (errno indica o motivo)
+ * \return entry A entrada, com uma referencia e fora da tabela
+ */
+static file_entry *file_entry_open(const char *path, file_cache *cache)
+{
+  struct stat file_stat;
+  file_entry *entry;
+
+  if (!(entry = (file_entry *) calloc(1, sizeof(file_entry))))
+    return NULL;
+
+  entry->fd = -1;
+  if (!(entry->path = strdup(path)) ||
+      0 > (entry->fd = open(path, O_RDONLY | O_CLOEXEC)) ||
+      0 > fstat(entry->fd, &file_stat))
+    goto error;
+
+  if (!S_ISREG(file_stat.st_mode))
+  {
+    errno = EISDIR;
+    goto error;
+  }
+
+  entry->size = file_stat.st_size;
+  entry->dev = file_stat.st_dev;
+  entry->ino = file_stat.st_ino;
+  entry->mtime = file_stat.st_mtim;
+  entry->refs = 1;
+  return entry;
+
+error:
+  file_entry_free(entry, cache);
+  return NULL;
+}
+
+/*! \brief Verifica se o arquivo no caminho ainda e' o da abertura, sem
+ * alteracao: mesmo inode (nao foi substituido), tamanho e modificacao
+ *
+ * \param[in] entry A entrada
+ *
+ * \return 1 Caso inalterado
+ * \return 0 Caso alterado, substituido ou removido
+ */
+static int file_entry_current(const file_entry *entry)
+{
+  struct stat file_stat;
+
+  return !stat(entry->path, &file_stat) &&
+         file_stat.st_dev == entry->dev && file_stat.st_ino == entry->ino &&
+         file_stat.st_size == entry->size &&
+         file_stat.st_mtim.tv_sec == entry->mtime.tv_sec &&
+         file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/*! \brief Retira uma entrada sem referencias da lista LRU
+ *
+ * \param[out] entry A entrada
+ * \param[out] cache O cache
+ */
+static void file_cache_lru_unlink(file_entry *entry, file_cache *cache)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+
+  entry->lru_next = NULL;
+  entry->lru_prev = NULL;
+}
+
+/*! \brief Coloca uma entrada que ficou sem referencias no inicio da LRU
+ *
+ * \param[out] entry A entrada
+ * \param[out] cache O cache
+ */
+static void file_cache_lru_push(file_entry *entry, file_cache *cache)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+/*! \brief Retira uma entrada da tabela. Sem referencias, o arquivo e'
+ * fechado; caso contrario, e' fechado na liberacao da ultima referencia,
+ * e o conteudo continua contado nos limites ate la'
+ *
+ * \param[out] entry A entrada
+ * \param[out] cache O cache
+ */
+static void file_cache_remove(file_entry *entry, file_cache *cache)
+{
+  file_entry **link = &cache->table[entry->hash];
+
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+
+  entry->cached = 0;
+  cache->count--;
+
+  if (!entry->refs)
+  {
+    file_cache_lru_unlink(entry, cache);
+    file_entry_free(entry, cache);
+  }
+}
+
+/*! \brief Descarta todos os arquivos
+ *
+ * \param[out] cache O cache
+ */
+static void file_cache_flush_files(file_cache *cache)
+{
+  int cont;
+
+  for (cont = 0; cont < FILE_CACHE_BUCKETS; cont++)
+    while (cache->table[cont])
+      file_cache_remove(cache->table[cont], cache);
+}
+
+/*! \brief Descarta os caminhos invalidados pelos reactors desde a ultima
+ * invalidacao vista por este cache, ou tudo, caso o registro ja os tenha
+ * sobrescrito
+ *
+ * \param[out] cache O cache
+ */
+static void file_cache_sync(file_cache *cache)
+{
+  unsigned long gen = __atomic_load_n(&file_cache_gen, __ATOMIC_ACQUIRE);
+
+  if (gen == cache->gen)
+    return;
+
+  pthread_mutex_lock(&file_cache_log_lock);
+
+  gen = file_cache_gen;
+  if (gen - cache->gen > FILE_CACHE_LOG)
+    file_cache_flush(cache);
+  else
+    while (cache->gen != gen)
+      file_cache_drop(file_cache_log[++cache->gen % FILE_CACHE_LOG], 0,
+                      cache);
+  cache->gen = gen;
+
+  pthread_mutex_unlock(&file_cache_log_lock);
+}
+
+/*! \brief Carrega em memoria o conteudo de um arquivo pequeno do cache.
+ * Sem espaco, fecha os arquivos sem referencias usados ha mais tempo; se
+ * ainda assim nao couber, o arquivo fica apenas com o descritor
+ *
+ * \param[out] entry O arquivo
+ * \param[out] cache O cache
+ */
+static void file_cache_load(file_entry *entry, file_cache *cache)
+{
+  size_t size = entry->size;
+  size_t loaded = 0;
+  char *data;
+
+  while (cache->mem_used + size > FILE_CACHE_MEM && cache->lru_tail)
+  {
+    file_cache_remove(cache->lru_tail, cache);
+    cache->evictions++;
+  }
+
+  if (cache->mem_used + size > FILE_CACHE_MEM ||
+      !(data = (char *) malloc(size ? size : 1)))
+    return;
+
+  while (loaded < size)
+  {
+    ssize_t bytes_read = pread(entry->fd, data + loaded, size - loaded,
+                               loaded);
+    if (0 >= bytes_read)
+    {
+      if (0 > bytes_read && EINTR == errno)
+        continue;
+
+      free(data);
+      return;
+    }
+
+    loaded += bytes_read;
+  }
+
+  entry->data = data;
+  cache->mem_used += size;
+  cache->misses++;
+}
+
+/*! \brief Mapeia um arquivo grande do cache, compartilhado por todos os
+ * GETs. Sem espaco, os arquivos sem referencias usados ha mais tempo sao
+ * fechados e desmapeados; se ainda assim nao couber, o arquivo fica apenas
+ * com o descritor
+ *
+ * \param[out] entry O arquivo
+ * \param[out] cache O cache
+ */
+static void file_cache_map(file_entry *entry, file_cache *cache)
+{
+  void *map;
+
+  while (cache->map_used + entry->size > FILE_CACHE_MAP_MEM &&
+         cache->lru_tail)
+  {
+    file_cache_remove(cache->lru_tail, cache);
+    cache->evictions++;
+  }
+
+  if (cache->map_used + entry->size > FILE_CACHE_MAP_MEM)
+    return;
+
+  map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, entry->fd, 0);
+  if (MAP_FAILED == map)
+    return;
+
+  entry->data = (char *) map;
+  entry->mapped = 1;
+  cache->map_used += entry->size;
+  madvise(map, entry->size, MADV_SEQUENTIAL);
+  file_entry_advise(entry, 0, 0);
+  cache->misses++;
+}
+
+/*! \brief Obtem o arquivo de um caminho, abrindo-o se nao estiver no cache.
+ * Com o cache cheio, o arquivo sem referencias usado ha mais tempo e'
+ * fechado; se todos estiverem em uso, o novo arquivo fica fora do cache.
+ * Arquivos de ate content_max bytes tem o conteudo carregado em memoria e
+ * arquivos de pelo menos map_min bytes sao mapeados. Com validate, um
+ * arquivo alterado desde a abertura e' descartado e reaberto
+ *
+ * \param[in] path Caminho resolvido do arquivo
+ * \param[out] cache O cache
+ *
+ * \return NULL Caso erro ao abrir o arquivo
+ * \return entry O arquivo, com uma referencia a mais
+ */
+file_entry *file_cache_get(const char *path, file_cache *cache)
+{
+  unsigned int hash = file_cache_hash(path, FILE_CACHE_BUCKETS);
+  file_entry *entry;
+
+  file_cache_sync(cache);
+
+  for (entry = cache->table[hash]; entry; entry = entry->next)
+    if (!strcmp(entry->path, path))
+    {
+      if (cache->validate && !file_entry_current(entry))
+      {
+        file_cache_remove(entry, cache);
+        entry = NULL;
+      }
+      else if (!entry->refs++)
+        file_cache_lru_unlink(entry, cache);
+      break;
+    }
+
+  if (!entry)
+  {
+    if (!(entry = file_entry_open(path, cache)))
+      return NULL;
+
+    if (FILE_CACHE_MAX <= cache->count && cache->lru_tail)
+    {
+      file_cache_remove(cache->lru_tail, cache);
+      cache->evictions++;
+    }
+
+    /* Com todos em uso, o arquivo fica fora do cache e sem conteudo */
+    if (FILE_CACHE_MAX <= cache->count)
+      return entry;
+
+    entry->hash = hash;
+    entry->cached = 1;
+    entry->next = cache->table[hash];
+    cache->table[hash] = entry;
+    cache->count++;
+  }
+
+  if (entry->data)
+    cache->hits++;
+  else if (cache->content_max && entry->size <= cache->content_max)
+    file_cache_load(entry, cache);
+  else if (cache->map_min && entry->size >= cache->map_min)
+    file_cache_map(entry, cache);
+
+  return entry;
+}
+
+/*! \brief Libera uma referencia ao arquivo. Sem referencias, o arquivo
+ * continua aberto no cache, a menos que tenha sido invalidado
+ *
+ * \param[out] entry O arquivo
+ * \param[out] cache O cache
+ */
+void file_cache_put(file_entry *entry, file_cache *cache)
+{
+  if (--entry->refs)
+    return;
+
+  if (entry->cached)
+    file_cache_lru_push(entry, cache);
+  else
+    file_entry_free(entry, cache);
+}
+
+/*! \brief Pede ao kernel a leitura antecipada do trecho seguinte de um
+ * arquivo mapeado, sempre que o envio entra em uma nova janela de
+ * FILE_CACHE_READAHEAD bytes
+ *
+ * \param[in] entry O arquivo
+ * \param[in] from Posicao antes do envio
+ * \param[in] to Posicao apos o envio
+ */
+void file_entry_advise(const file_entry *entry, off_t from, off_t to)
+{
+  off_t window = to / FILE_CACHE_READAHEAD * FILE_CACHE_READAHEAD;
+  off_t len;
+
+  if (!entry->mapped || window >= entry->size ||
+      (to && from / FILE_CACHE_READAHEAD == to / FILE_CACHE_READAHEAD))
+    return;
+
+  /* Janela atual, ja iniciada, e a seguinte */
+  len = MIN(2 * FILE_CACHE_READAHEAD, entry->size - window);
+  madvise(entry->data + window, len, MADV_WILLNEED);
+}
+
+/*! \brief Invalida o arquivo de um caminho, alterado por um PUT, e as
+ * resolucoes que levam a ele, ja que o PUT pode ter criado o arquivo. Os GETs
+ * em andamento continuam com o descritor antigo. Os caches dos demais
+ * reactors descartam o mesmo caminho em seu proximo acesso, sem esperar o
+ * evento do inotify
+ *
+ * \param[in] path Caminho resolvido do arquivo
+ * \param[out] cache O cache do reactor que alterou o arquivo
+ */
+void file_cache_invalidate(const char *path, file_cache *cache)
+{
+  pthread_mutex_lock(&file_cache_log_lock);
+  snprintf(file_cache_log[(file_cache_gen + 1) % FILE_CACHE_LOG], PATH_MAX,
+           "%s", path);
+  __atomic_store_n(&file_cache_gen, file_cache_gen + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&file_cache_log_lock);
+
+  file_cache_sync(cache);
+}
+
+/*! \brief Retira um recurso resolvido da lista LRU
+ *
+ * \param[out] entry O recurso
+ * \param[out] cache O cache
+ */
+static void file_cache_path_unlink(path_entry *entry, file_cache *cache)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->path_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->path_tail = entry->lru_prev;
+}
+
+/*! \brief Coloca um recurso resolvido no inicio da lista LRU
+ *
+ * \param[out] entry O recurso
+ * \param[out] cache O cache
+ */
+static void file_cache_path_push(path_entry *entry, file_cache *cache)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->path_head;
+  if (cache->path_head)
+    cache->path_head->lru_prev = entry;
+  else
+    cache->path_tail = entry;
+  cache->path_head = entry;
+}
+
+/*! \brief Retira um recurso resolvido da tabela e o libera
+ *
+ * \param[out] entry O recurso
+ * \param[out] cache O cache
+ */
+static void file_cache_path_remove(path_entry *entry, file_cache *cache)
+{
+  path_entry **link = &cache->paths[entry->hash];
+
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+
+  for (link = &cache->resolved[entry->path_hash]; *link != entry;
+       link = &(*link)->path_next)
+    ;
+  *link = entry->path_next;
+
+  file_cache_path_unlink(entry, cache);
+  cache->path_count--;
+  if (!entry->direct)
+    cache->path_indirect--;
+  free(entry->name);
+  free(entry->path);
+  free(entry);
+}
+
+/*! \brief Obtem a resolucao de um recurso, se estiver no cache
+ *
+ * \param[in] name O recurso, como na requisicao
+ * \param[out] cache O cache
+ *
+ * \return NULL Caso o recurso nao tenha sido resolvido
+ * \return entry A resolucao, valida ate a proxima alteracao do cache
+ */
+const path_entry *file_cache_path_get(const char *name, file_cache *cache)
+{
+  unsigned int hash = file_cache_hash(name, PATH_CACHE_BUCKETS);
+  path_entry *entry;
+
+  file_cache_sync(cache);
+
+  for (entry = cache->paths[hash]; entry; entry = entry->next)
+    if (!strcmp(entry->name, name))
+    {
+      file_cache_path_unlink(entry, cache);
+      file_cache_path_push(entry, cache);
+      cache->path_hits++;
+      return entry;
+    }
+
+  cache->path_misses++;
+  return NULL;
+}
+
+/*! \brief Guarda a resolucao de um recurso. Com o cache cheio, a usada ha
+ * mais tempo e' descartada. Sem memoria, o recurso nao e' guardado
+ *
+ * \param[in] name O recurso, como na requisicao
+ * \param[in] path O caminho resolvido
+ * \param[in] exists 0 se o recurso nao existe
+ * \param[in] direct 0 se a resolucao passou por links ou '..', e so pode
+ * ser invalidada junto com todas as demais indiretas
+ * \param[out] cache O cache
+ */
+void file_cache_path_add(const char *name, const char *path, int exists,
+                         int direct, file_cache *cache)
+{
+  path_entry *entry;
+
+  if (PATH_CACHE_MAX <= cache->path_count)
+    file_cache_path_remove(cache->path_tail, cache);
+
+  if (!(entry = (path_entry *) calloc(1, sizeof(path_entry))))
+    return;
+
+  if (!(entry->name = strdup(name)) || !(entry->path = strdup(path)))
+  {
+    free(entry->name);
+    free(entry);
+    return;
+  }
+
+  entry->exists = exists;
+  entry->direct = direct;
+  entry->hash = file_cache_hash(name, PATH_CACHE_BUCKETS);
+  entry->next = cache->paths[entry->hash];
+  cache->paths[entry->hash] = entry;
+  entry->path_hash = file_cache_hash(path, PATH_CACHE_BUCKETS);
+  entry->path_next = cache->resolved[entry->path_hash];
+  cache->resolved[entry->path_hash] = entry;
+  file_cache_path_push(entry, cache);
+  cache->path_count++;
+  if (!direct)
+    cache->path_indirect++;
+}
+
+/*! \brief Verifica se um caminho e' o caminho base ou esta abaixo dele
+ *
+ * \param[in] path O caminho
+ * \param[in] base O caminho base
+ * \param[in] base_len Tamanho do caminho base
+ *
+ * \return 1 Caso esteja
+ * \return 0 Caso contrario
+ */
+static int file_cache_under(const char *path, const char *base,
+                            size_t base_len)
+{
+  return !strncmp(path, base, base_len) &&
+         ('\0' == path[base_len] || '/' == path[base_len]);
+}
+
+/*! \brief Descarta o arquivo de um caminho, cujo conteudo foi alterado. Os
+ * GETs em andamento continuam com o descritor antigo
+ *
+ * \param[in] path Caminho resolvido do arquivo
+ * \param[out] cache O cache
+ */
+void file_cache_drop_file(const char *path, file_cache *cache)
+{
+  file_entry *entry;
+
+  for (entry = cache->table[file_cache_hash(path, FILE_CACHE_BUCKETS)];
+       entry; entry = entry->next)
+    if (!strcmp(entry->path, path))
+    {
+      file_cache_remove(entry, cache);
+      return;
+    }
+}
+
+/*! \brief Descarta o que depende de um caminho criado, removido ou movido:
+ * o arquivo, as resolucoes que levam a ele (inclusive as inexistentes, cuja
+ * resolucao parou nele) e as indiretas. Para um diretorio, descarta tambem
+ * tudo que esta abaixo dele
+ *
+ * \param[in] path O caminho
+ * \param[in] tree 1 se o caminho e' (ou era) um diretorio
+ * \param[out] cache O cache
+ */
+void file_cache_drop(const char *path, int tree, file_cache *cache)
+{
+  size_t len = strlen(path);
+  path_entry *entry;
+  path_entry *next;
+
+  if (!tree)
+  {
+    file_cache_drop_file(path, cache);
+
+    entry = cache->resolved[file_cache_hash(path, PATH_CACHE_BUCKETS)];
+    for (; entry; entry = next)
+    {
+      next = entry->path_next;
+      if (!strcmp(entry->path, path))
+        file_cache_path_remove(entry, cache);
+    }
+  }
+  else
+  {
+    file_entry *file;
+    file_entry *next_file;
+    int cont;
+
+    for (cont = 0; cont < FILE_CACHE_BUCKETS; cont++)
+      for (file = cache->table[cont]; file; file = next_file)
+      {
+        next_file = file->next;
+        if (file_cache_under(file->path, path, len))
+          file_cache_remove(file, cache);
+      }
+
+    for (entry = cache->path_head; entry; entry = next)
+    {
+      next = entry->lru_next;
+      if (file_cache_under(entry->path, path, len))
+        file_cache_path_remove(entry, cache);
+    }
+  }
+
+  for (entry = cache->path_head; cache->path_indirect && entry; entry = next)
+  {
+    next = entry->lru_next;
+    if (!entry->direct)
+      file_cache_path_remove(entry, cache);
+  }
+}
+
+/*! \brief Descarta todas as resolucoes de recursos, apos uma alteracao na
+ * arvore de arquivos
+ *
+ * \param[out] cache O cache
+ */
+void file_cache_path_flush(file_cache *cache)
+{
+  while (cache->path_head)
+    file_cache_path_remove(cache->path_head, cache);
+}
+
+/*! \brief Descarta todos os arquivos e resolucoes de recursos, como na
+ * troca da raiz do servidor. Arquivos ainda referenciados sao fechados na
+ * liberacao da ultima referencia
+ *
+ * \param[out] cache O cache
+ */
+void file_cache_flush(file_cache *cache)
+{
+  file_cache_flush_files(cache);
+  file_cache_path_flush(cache);
+}
+
+/*! \brief Fecha os arquivos sem referencias e esvazia o cache. Arquivos
+ * ainda referenciados sao fechados na liberacao da ultima referencia
+ *
+ * \param[out] cache O cache
+ */
+void file_cache_destroy(file_cache *cache)
+{
+  file_cache_flush(cache);
+}
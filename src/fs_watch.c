@@ -0,0 +1,227 @@
+/*!
+ * \file fs_watch.c
+ * \brief Implementacao do observador de alteracoes com inotify
+ */
+
+#include "fs_watch.h"
+
+/*! \brief Observa um diretorio. Um diretorio ja observado (movido, por
+ * exemplo) mantem o watch e tem o caminho atualizado
+ *
+ * \param[in] path O diretorio
+ * \param[out] watch O observador
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+static int fs_watch_add_dir(const char *path, fs_watch *watch)
+{
+  char *dir_path;
+  int wd;
+
+  if (0 > (wd = inotify_add_watch(watch->fd, path, FS_WATCH_MASK |
+                                  IN_ONLYDIR | IN_DONT_FOLLOW)))
+    return -1;
+
+  if (wd >= watch->num_dirs)
+  {
+    int num_dirs = MAX(2 * watch->num_dirs, wd + FS_WATCH_GROW);
+    char **dirs = (char **) realloc(watch->dirs, num_dirs * sizeof(char *));
+
+    if (!dirs)
+      return -1;
+
+    memset(dirs + watch->num_dirs, 0,
+           (num_dirs - watch->num_dirs) * sizeof(char *));
+    watch->dirs = dirs;
+    watch->num_dirs = num_dirs;
+  }
+
+  if (!(dir_path = strdup(path)))
+    return -1;
+
+  free(watch->dirs[wd]);
+  watch->dirs[wd] = dir_path;
+  return 0;
+}
+
+/*! \brief Monta o caminho de uma entrada de um diretorio. Um diretorio
+ * terminado em '/' (a raiz do sistema) nao recebe outra barra, para que o
+ * caminho coincida com o de realpath
+ *
+ * \param[in] dir O diretorio
+ * \param[in] name A entrada, NULL para o proprio diretorio
+ * \param[out] path Recebe o caminho
+ * \param[in] size Tamanho de path
+ *
+ * \return -1 Caso o caminho nao caiba
+ * \return 0 Caso ok
+ */
+int fs_watch_join(const char *dir, const char *name, char *path, size_t size)
+{
+  size_t dir_len = strlen(dir);
+  int printf_return;
+
+  printf_return = snprintf(path, size, "%s%s%s", dir,
+                           name && dir_len && '/' != dir[dir_len - 1] ?
+                           "/" : "", name ? name : "");
+  if (0 > printf_return || (size_t) printf_return >= size)
+    return -1;
+
+  return 0;
+}
+
+/*! \brief Observa um diretorio e, recursivamente, seus subdiretorios. Links
+ * simbolicos nao sao seguidos
+ *
+ * \param[in] path O diretorio
+ * \param[out] watch O observador
+ *
+ * \return -1 Caso erro ao observar o diretorio
+ * \return 0 Caso ok
+ */
+static int fs_watch_add_tree(const char *path, fs_watch *watch)
+{
+  char sub_path[PATH_MAX];
+  struct dirent *entry;
+  DIR *dir;
+
+  if (0 > fs_watch_add_dir(path, watch))
+    return -1;
+
+  /* Removido logo apos a criacao: os eventos ja foram recebidos */
+  if (!(dir = opendir(path)))
+    return 0;
+
+  while ((entry = readdir(dir)))
+  {
+    struct stat sub_stat;
+
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+        (DT_DIR != entry->d_type && DT_UNKNOWN != entry->d_type))
+      continue;
+
+    if (0 > fs_watch_join(path, entry->d_name, sub_path, sizeof(sub_path)))
+      continue;
+
+    if (DT_UNKNOWN == entry->d_type &&
+        (0 > lstat(sub_path, &sub_stat) || !S_ISDIR(sub_stat.st_mode)))
+      continue;
+
+    fs_watch_add_tree(sub_path, watch);
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+/*! \brief Cria o inotify e observa a arvore a partir da raiz
+ *
+ * \param[in] root A raiz
+ * \param[out] watch O observador
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int fs_watch_init(const char *root, fs_watch *watch)
+{
+  memset(watch, 0, sizeof(*watch));
+
+  if (0 > (watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+    return -1;
+
+  if (0 > fs_watch_add_tree(root, watch))
+  {
+    fs_watch_destroy(watch);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! \brief Le os eventos pendentes e chama a funcao para cada um.
+ * Diretorios criados ou movidos para dentro da arvore passam a ser
+ * observados antes da chamada
+ *
+ * \param[in] callback Funcao chamada a cada evento
+ * \param[in] arg Argumento repassado a funcao
+ * \param[out] watch O observador
+ *
+ * \return -1 Caso erro na leitura
+ * \return 0 Caso ok
+ */
+int fs_watch_process(fs_watch_cb callback, void *arg, fs_watch *watch)
+{
+  union
+  {
+    struct inotify_event event;
+    char buf[FS_WATCH_BUF];
+  } events;
+  ssize_t len;
+
+  while (0 < (len = read(watch->fd, events.buf, sizeof(events.buf))))
+  {
+    ssize_t pos;
+
+    for (pos = 0; pos < len;
+         pos += sizeof(struct inotify_event) +
+                ((struct inotify_event *) (events.buf + pos))->len)
+    {
+      const struct inotify_event *event =
+        (const struct inotify_event *) (events.buf + pos);
+      const char *name = event->len ? event->name : NULL;
+      const char *dir;
+
+      if (event->mask & IN_Q_OVERFLOW)
+      {
+        callback(NULL, NULL, event->mask, arg);
+        continue;
+      }
+
+      if (0 > event->wd || event->wd >= watch->num_dirs ||
+          !(dir = watch->dirs[event->wd]))
+        continue;
+
+      if (name && event->mask & IN_ISDIR &&
+          event->mask & (IN_CREATE | IN_MOVED_TO))
+      {
+        char sub_path[PATH_MAX];
+
+        if (0 <= fs_watch_join(dir, name, sub_path, sizeof(sub_path)))
+          fs_watch_add_tree(sub_path, watch);
+      }
+
+      callback(dir, name, event->mask, arg);
+
+      if (event->mask & IN_IGNORED)
+      {
+        free(watch->dirs[event->wd]);
+        watch->dirs[event->wd] = NULL;
+      }
+    }
+  }
+
+  if (0 > len && EAGAIN != errno && EINTR != errno)
+    return -1;
+
+  return 0;
+}
+
+/*! \brief Fecha o inotify e libera os caminhos observados
+ *
+ * \param[out] watch O observador
+ */
+void fs_watch_destroy(fs_watch *watch)
+{
+  int cont;
+
+  if (0 <= watch->fd)
+    close(watch->fd);
+  watch->fd = -1;
+
+  for (cont = 0; cont < watch->num_dirs; cont++)
+    free(watch->dirs[cont]);
+  free(watch->dirs);
+  watch->dirs = NULL;
+  watch->num_dirs = 0;
+}
@@ -0,0 +1,468 @@
+/*!
+ * \file http_parser.c
+ * \brief Implementacao do analisador incremental de requisicoes HTTP
+ */
+
+#include <limits.h>
+
+#include "http_parser.h"
+
+/* Sem otimizacao as intrinsics nao sao expandidas e a varredura em blocos
+ * fica mais lenta que o memchr */
+#if defined(__x86_64__) && defined(__OPTIMIZE__)
+#include <immintrin.h>
+#define HTTP_SCAN_SIMD
+#endif
+
+/*! \brief Varredura dos '\n' de um trecho do buffer. Com SIMD, cada bloco
+ * de 16 (SSE2) ou 32 (AVX2) bytes e' comparado uma unica vez e a mascara
+ * resultante fornece todos os fins de linha do bloco */
+typedef struct http_scan_
+{
+  const char *buffer; /*!< O buffer */
+  int len; /*!< Fim do trecho */
+  int block; /*!< Inicio do bloco atual (com memchr, proximo byte) */
+  int width; /*!< Tamanho do bloco, 0 com memchr */
+  unsigned int mask; /*!< '\n' ainda nao consumidos do bloco atual */
+} http_scan;
+
+/*! \brief Tamanho do bloco escolhido com http_scan_select, -1 para o
+ * melhor suportado */
+static int http_scan_width = -1;
+
+const char *supported_methods[] = {"GET", "PUT"};
+const char *supported_protocols[] = {"HTTP/1.0", "HTTP/1.1"};
+
+/*! \brief Inicializa o analisador para uma nova requisicao, no inicio do
+ * buffer
+ *
+ * \param[out] parser O analisador
+ */
+void http_parser_init(http_parser *parser)
+{
+  memset(parser, 0, sizeof(*parser));
+  parser->method = -1;
+  parser->protocol = -1;
+  parser->content_length = -1;
+}
+
+/*! \brief Identifica o metodo. Os metodos suportados diferem no primeiro
+ * caractere, entao basta uma comparacao
+ *
+ * \param[in] token O metodo na requisicao
+ * \param[in] len Tamanho do metodo
+ *
+ * \return -1 Caso nao suportado
+ * \return method O metodo (http_methods)
+ */
+static int http_parser_method(const char *token, int len)
+{
+  int method;
+
+  switch (*token)
+  {
+    case 'G':
+      method = GET;
+      break;
+
+    case 'P':
+      method = PUT;
+      break;
+
+    default:
+      return -1;
+  }
+
+  if ((size_t) len != strlen(supported_methods[method]) ||
+      memcmp(token, supported_methods[method], len))
+    return -1;
+
+  return method;
+}
+
+/*! \brief Identifica o protocolo pelo digito apos HTTP_VERSION_PREFIX
+ *
+ * \param[in] token O protocolo na requisicao
+ * \param[in] len Tamanho do protocolo
+ *
+ * \return -1 Caso nao suportado
+ * \return protocol O protocolo (http_protocols)
+ */
+static int http_parser_protocol(const char *token, int len)
+{
+  size_t prefix_len = strlen(HTTP_VERSION_PREFIX);
+
+  if ((size_t) len != prefix_len + 1 ||
+      memcmp(token, HTTP_VERSION_PREFIX, prefix_len))
+    return -1;
+
+  switch (token[prefix_len])
+  {
+    case '0':
+      return HTTP10;
+
+    case '1':
+      return HTTP11;
+  }
+
+  return -1;
+}
+
+/*! \brief Localiza o proximo campo da linha, separado por espacos
+ *
+ * \param[in] buffer O buffer da requisicao
+ * \param[out] pos Posicao atual na linha, avancada ate o fim do campo
+ * \param[in] end Fim da linha
+ * \param[out] span Recebe o campo
+ *
+ * \return len Tamanho do campo, 0 se a linha acabou
+ */
+static int http_parser_field(const char *buffer, int *pos, int end,
+                             http_span *span)
+{
+  while (*pos < end && ' ' == buffer[*pos])
+    (*pos)++;
+
+  span->start = *pos;
+  while (*pos < end && ' ' != buffer[*pos])
+    (*pos)++;
+
+  span->len = *pos - span->start;
+  return span->len;
+}
+
+/*! \brief Analisa a linha de requisicao: metodo, recurso e protocolo
+ *
+ * \param[in] buffer O buffer da requisicao
+ * \param[in] start Inicio da linha
+ * \param[in] end Fim da linha, sem o "\r\n"
+ * \param[out] parser O analisador
+ */
+static void http_parser_request_line(const char *buffer, int start, int end,
+                                     http_parser *parser)
+{
+  http_span method;
+  http_span version;
+  http_span extra;
+  int pos = start;
+
+  if (!http_parser_field(buffer, &pos, end, &method) ||
+      !http_parser_field(buffer, &pos, end, &parser->target) ||
+      !http_parser_field(buffer, &pos, end, &version) ||
+      http_parser_field(buffer, &pos, end, &extra))
+  {
+    parser->malformed = 1;
+    return;
+  }
+
+  parser->method = http_parser_method(buffer + method.start, method.len);
+  parser->protocol = http_parser_protocol(buffer + version.start,
+                                          version.len);
+}
+
+/*! \brief Converte um valor decimal sem sinal
+ *
+ * \param[in] value O valor
+ * \param[in] len Tamanho do valor
+ *
+ * \return -1 Caso vazio, invalido ou grande demais
+ * \return number O numero
+ */
+static long long http_parser_number(const char *value, int len)
+{
+  long long number = 0;
+  int cont;
+
+  if (!len)
+    return -1;
+
+  for (cont = 0; cont < len; cont++)
+  {
+    if ('0' > value[cont] || '9' < value[cont] ||
+        number > (LLONG_MAX - 9) / 10)
+      return -1;
+
+    number = number * 10 + (value[cont] - '0');
+  }
+
+  return number;
+}
+
+/*! \brief Analisa uma linha de header, guardando os reconhecidos. Os nomes
+ * reconhecidos diferem no tamanho, entao basta uma comparacao
+ *
+ * \param[in] buffer O buffer da requisicao
+ * \param[in] start Inicio da linha
+ * \param[in] end Fim da linha, sem o "\r\n"
+ * \param[out] parser O analisador
+ */
+static void http_parser_header(const char *buffer, int start, int end,
+                               http_parser *parser)
+{
+  const char *colon = memchr(buffer + start, ':', end - start);
+  const char *name = buffer + start;
+  http_span value;
+  int name_len;
+
+  /* Linha sem ':' e' ignorada */
+  if (!colon)
+    return;
+
+  name_len = colon - name;
+  value.start = colon - buffer + 1;
+  while (value.start < end &&
+         (' ' == buffer[value.start] || '\t' == buffer[value.start]))
+    value.start++;
+
+  value.len = end - value.start;
+  while (value.len && (' ' == buffer[value.start + value.len - 1] ||
+                       '\t' == buffer[value.start + value.len - 1]))
+    value.len--;
+
+  switch (name_len)
+  {
+    case sizeof(HTTP_CONTENT_LENGTH) - 1:
+      if (!strncasecmp(name, HTTP_CONTENT_LENGTH, name_len))
+        parser->content_length = http_parser_number(buffer + value.start,
+                                                    value.len);
+      break;
+
+    case sizeof(HTTP_CONNECTION) - 1:
+      if (!strncasecmp(name, HTTP_CONNECTION, name_len))
+        parser->connection = value;
+      break;
+
+    case sizeof(HTTP_RANGE) - 1:
+      if (!strncasecmp(name, HTTP_RANGE, name_len))
+        parser->range = value;
+      break;
+
+    case sizeof(HTTP_IF_NONE_MATCH) - 1:
+      if (!strncasecmp(name, HTTP_IF_NONE_MATCH, name_len))
+        parser->if_none_match = value;
+      break;
+  }
+}
+
+#ifdef HTTP_SCAN_SIMD
+/*! \brief Mascara dos '\n' de um bloco de 16 bytes
+ *
+ * \param[in] block Inicio do bloco
+ *
+ * \return mask Um bit por byte
+ */
+static unsigned int http_scan_sse2(const char *block)
+{
+  __m128i bytes = _mm_loadu_si128((const __m128i *) block);
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+}
+
+/*! \brief Mascara dos '\n' de um bloco de 32 bytes
+ *
+ * \param[in] block Inicio do bloco
+ *
+ * \return mask Um bit por byte
+ */
+__attribute__((target("avx2")))
+static unsigned int http_scan_avx2(const char *block)
+{
+  __m256i bytes = _mm256_loadu_si256((const __m256i *) block);
+
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes,
+                                                _mm256_set1_epi8('\n')));
+}
+
+/*! \brief Carrega a mascara do bloco atual, sem os bytes apos o trecho
+ *
+ * \param[out] scan A varredura
+ */
+static void http_scan_load(http_scan *scan)
+{
+  int valid = scan->len - scan->block;
+
+  if (32 == scan->width)
+    scan->mask = http_scan_avx2(scan->buffer + scan->block);
+  else
+    scan->mask = http_scan_sse2(scan->buffer + scan->block);
+
+  if (valid < scan->width)
+    scan->mask &= (1u << valid) - 1;
+}
+#endif
+
+/*! \brief Inicia a varredura de [pos, len)
+ *
+ * \param[in] buffer O buffer, com HTTP_PARSER_PAD bytes legiveis apos len
+ * \param[in] pos Inicio do trecho
+ * \param[in] len Fim do trecho
+ * \param[out] scan A varredura
+ */
+static void http_scan_init(const char *buffer, int pos, int len,
+                           http_scan *scan)
+{
+  scan->buffer = buffer;
+  scan->len = len;
+  scan->block = pos;
+  scan->width = 0;
+  scan->mask = 0;
+
+#ifdef HTTP_SCAN_SIMD
+  if (0 <= http_scan_width)
+    scan->width = http_scan_width;
+  else
+    scan->width = __builtin_cpu_supports("avx2") ? 32 : 16;
+
+  if (scan->width && pos < len)
+    http_scan_load(scan);
+#endif
+}
+
+/*! \brief Proximo '\n' da varredura
+ *
+ * \param[out] scan A varredura
+ *
+ * \return -1 Caso nao haja mais
+ * \return pos Posicao do '\n' no buffer
+ */
+static int http_scan_next(http_scan *scan)
+{
+  const char *newline;
+
+#ifdef HTTP_SCAN_SIMD
+  if (scan->width)
+  {
+    int pos;
+
+    while (!scan->mask)
+    {
+      scan->block += scan->width;
+      if (scan->block >= scan->len)
+        return -1;
+
+      http_scan_load(scan);
+    }
+
+    pos = scan->block + __builtin_ctz(scan->mask);
+    scan->mask &= scan->mask - 1;
+    return pos;
+  }
+#endif
+
+  if (scan->block >= scan->len || !(newline = memchr(scan->buffer +
+      scan->block, '\n', scan->len - scan->block)))
+    return -1;
+
+  scan->block = newline - scan->buffer + 1;
+  return newline - scan->buffer;
+}
+
+/*! \brief Continua a analise com os bytes recebidos desde a ultima chamada.
+ * Cada linha completa e' analisada uma unica vez; uma linha incompleta fica
+ * para a proxima chamada. Linhas vazias antes da requisicao sao ignoradas
+ *
+ * \param[in] buffer O buffer da requisicao, com HTTP_PARSER_PAD bytes
+ * legiveis apos len
+ * \param[in] len Bytes validos no buffer
+ * \param[out] parser O analisador
+ *
+ * \return 1 Caso a requisicao esteja completa (ate a linha vazia final)
+ * \return 0 Caso faltem bytes
+ */
+int http_parser_execute(const char *buffer, int len, http_parser *parser)
+{
+  http_scan scan;
+
+  http_scan_init(buffer, parser->pos, len, &scan);
+
+  while (HTTP_PARSE_DONE != parser->state && parser->pos < len)
+  {
+    int line_start = parser->line_start;
+    int line_end;
+
+    if (0 > (line_end = http_scan_next(&scan)))
+    {
+      parser->pos = len;
+      break;
+    }
+
+    parser->pos = line_end + 1;
+    parser->line_start = parser->pos;
+    if (line_end > line_start && '\r' == buffer[line_end - 1])
+      line_end--;
+
+    if (HTTP_PARSE_REQUEST_LINE == parser->state)
+    {
+      if (line_end > line_start)
+      {
+        http_parser_request_line(buffer, line_start, line_end, parser);
+        parser->state = HTTP_PARSE_HEADERS;
+      }
+    }
+    else if (line_end == line_start)
+    {
+      parser->header_end = parser->pos;
+      parser->state = HTTP_PARSE_DONE;
+    }
+    else
+      http_parser_header(buffer, line_start, line_end, parser);
+  }
+
+  return HTTP_PARSE_DONE == parser->state;
+}
+
+/*! \brief Verifica se um valor comeca com um token, sem diferenciar
+ * maiusculas
+ *
+ * \param[in] buffer O buffer da requisicao
+ * \param[in] span O valor
+ * \param[in] token O token
+ *
+ * \return 1 Caso comece
+ * \return 0 Caso contrario ou valor ausente
+ */
+int http_span_starts(const char *buffer, http_span span, const char *token)
+{
+  size_t len = strlen(token);
+
+  return (size_t) span.len >= len &&
+         !strncasecmp(buffer + span.start, token, len);
+}
+
+/*! \brief Escolhe a varredura dos fins de linha, para testes e medicoes.
+ * Deve ser chamada antes de iniciar os reactors
+ *
+ * \param[in] mode A varredura
+ *
+ * \return -1 Caso nao suportada nesta compilacao ou processador
+ * \return 0 Caso ok
+ */
+int http_scan_select(http_scan_mode mode)
+{
+  switch (mode)
+  {
+    case HTTP_SCAN_AUTO:
+      http_scan_width = -1;
+      return 0;
+
+    case HTTP_SCAN_MEMCHR:
+      http_scan_width = 0;
+      return 0;
+
+#ifdef HTTP_SCAN_SIMD
+    case HTTP_SCAN_SSE2:
+      http_scan_width = 16;
+      return 0;
+
+    case HTTP_SCAN_AVX2:
+      if (!__builtin_cpu_supports("avx2"))
+        return -1;
+
+      http_scan_width = 32;
+      return 0;
+#endif
+
+    default:
+      return -1;
+  }
+}
@@ -5,88 +5,196 @@
 
 #include "multithread.h"
 
-/*! \brief Distribui as tarefas entre as threads
+/*! \brief Instante atual do relogio monotonico
  *
- * \param[out] cur_threadpool O pool de threads
+ * \return ns O instante em nanossegundos
  */
-static void *threadpool_thread(void *cur_threadpool)
+static long long threadpool_now_ns(void)
 {
-  int bytes_sent;
-  char signal_str[SIGNAL_LEN];
-  threadpool *pool = (threadpool *) cur_threadpool;
-  task_node *task = NULL;
+  struct timespec now;
 
-  memset(signal_str, 0, sizeof(signal_str));
-  
-  while (1)
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*! \brief Verifica se a thread foi retirada do pool por threadpool_resize
+ *
+ * \param[in] self A thread
+ *
+ * \return 1 Caso retirada
+ * \return 0 Caso ativa
+ */
+static int threadpool_retired(const worker *self)
+{
+  return self->id >= __atomic_load_n(&self->pool->num_workers,
+                                     __ATOMIC_ACQUIRE);
+}
+
+/*! \brief Retira uma tarefa da propria fila ou, vazia, rouba das filas
+ * das outras threads, a partir da seguinte. Uma thread retirada so' esvazia
+ * a propria fila; as ativas tambem roubam das filas das retiradas
+ *
+ * \param[out] task Recebe a tarefa
+ * \param[out] self A thread
+ *
+ * \return -1 Caso todas as filas estejam vazias
+ * \return 0 Caso ok
+ */
+static int threadpool_take_task(task_slot *task, worker *self)
+{
+  threadpool *pool = self->pool;
+  int num_slots;
+  int cont;
+
+  if (0 <= task_ring_pop(task, &self->queue))
+    return 0;
+
+  if (threadpool_retired(self))
+    return -1;
+
+  num_slots = __atomic_load_n(&pool->num_slots, __ATOMIC_ACQUIRE);
+  for (cont = 1; cont < num_slots; cont++)
   {
-    pthread_mutex_lock(&(pool->lock));
+    worker *victim = &pool->workers[(self->id + cont) % num_slots];
 
-    while (!pool->queue->size && !pool->shut_down)
-      pthread_cond_wait(&(pool->notify), &(pool->lock));
+    if (0 <= task_ring_pop(task, &victim->queue))
+    {
+      __atomic_add_fetch(&self->stolen, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
 
-    if (pool->shut_down)
-      break;
+  return -1;
+}
+
+/*! \brief Aguarda uma tarefa. A thread so estaciona com todas as filas
+ * vazias: parked e' marcado antes de verificar as filas de novo, e quem
+ * insere verifica parked apos a insercao, entao uma das partes ve a outra.
+ * Uma thread retirada sai com a propria fila vazia, marcando WORKER_EXITED
+ *
+ * \param[out] task Recebe a tarefa
+ * \param[out] self A thread
+ *
+ * \return -1 Caso encerramento do pool ou thread retirada
+ * \return 0 Caso ok
+ */
+static int threadpool_wait_task(task_slot *task, worker *self)
+{
+  threadpool *pool = self->pool;
+  int found = -1;
 
-    task = pool->queue->head;
-    task_node_pop_first(pool->queue);
+  if (__atomic_load_n(&pool->shut_down, __ATOMIC_ACQUIRE))
+    return -1;
+
+  if (0 <= threadpool_take_task(task, self))
+    return 0;
+
+  pthread_mutex_lock(&(pool->lock));
+  __atomic_store_n(&self->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  while (!pool->shut_down && 0 > (found = threadpool_take_task(task, self)) &&
+         !threadpool_retired(self))
+    pthread_cond_wait(&(self->notify), &(pool->lock));
+
+  __atomic_store_n(&self->parked, 0, __ATOMIC_SEQ_CST);
+  if (pool->shut_down)
+    found = -1;
+  else if (0 > found)
+    self->state = WORKER_EXITED;
+  pthread_mutex_unlock(&(pool->lock));
+
+  return found;
+}
 
-    pthread_mutex_unlock(&(pool->lock));
+/*! \brief Entrega uma tarefa concluida ao reactor. So' a primeira
+ * conclusao apos o reactor consumir o aviso escreve no event_fd; as
+ * seguintes sao recolhidas no mesmo lote
+ *
+ * \param[in] argument Argumento da tarefa
+ * \param[out] pool O pool de threads
+ */
+static void threadpool_complete(void *argument, threadpool *pool)
+{
+  uint64_t one = 1;
 
-    (*(task->function))(task->argument);
+  /* Sempre cabe: pending limita as tarefas em andamento ao tamanho de done */
+  task_ring_push(NULL, argument, 0, &pool->done);
+
+  if (!__atomic_exchange_n(&pool->notified, 1, __ATOMIC_SEQ_CST) &&
+      (ssize_t) sizeof(one) != write(pool->event_fd, &one, sizeof(one)))
+    __atomic_store_n(&pool->notified, 0, __ATOMIC_SEQ_CST);
+}
+
+/*! \brief Distribui as tarefas entre as threads
+ *
+ * \param[out] cur_worker A thread
+ */
+static void *threadpool_thread(void *cur_worker)
+{
+  worker *self = (worker *) cur_worker;
+  task_slot task;
 
-    sprintf(signal_str, "%p", task->argument);
-    bytes_sent = send(pool->l_socket, signal_str, SIGNAL_LEN, 0);
+  while (!threadpool_wait_task(&task, self))
+  {
+    /* Marcada so' com o ajuste automatico ativo */
+    if (task.queued_ns)
+    {
+      __atomic_add_fetch(&self->wait_ns, threadpool_now_ns() - task.queued_ns,
+                         __ATOMIC_RELAXED);
+      __atomic_add_fetch(&self->tasks, 1, __ATOMIC_RELAXED);
+    }
 
-    task_node_free(task);
+    (*(task.function))(task.argument);
+    threadpool_complete(task.argument, self->pool);
   }
   
-  pthread_mutex_unlock(&(pool->lock));
   pthread_exit(NULL);
   return NULL;
 }
 
-/*! \brief Funcao que inicia um pool de threads que ja esteja alocado
+/*! \brief Thread de destino de uma tarefa, pelo hash do argumento: as
+ * tarefas de um mesmo cliente ficam na mesma thread
+ *
+ * \param[in] argument Argumento da tarefa
+ * \param[in] pool O pool de threads
+ *
+ * \return id A posicao da thread no pool
+ */
+static int threadpool_worker_of(const void *argument, const threadpool *pool)
+{
+  uint64_t hash = (uint64_t) (uintptr_t) argument * 0x9E3779B97F4A7C15ull;
+
+  return (int) ((hash >> 32) % (uint64_t) pool->num_workers);
+}
+
+/*! \brief Funcao que inicia um pool de threads que ja esteja alocado,
+ * com min_workers threads. O event_fd fica legivel quando ha tarefas
+ * concluidas
  *
- * \param[in] lsocket_name O nome do socket local da thread principal
+ * \param[in] min_workers Threads iniciais e minimo do ajuste automatico
+ * \param[in] max_workers Maximo do ajuste automatico. Igual a min_workers
+ * para um pool de tamanho fixo
  * \param[out] pool O pool a ser iniciado
  *
  * \return -1 Caso haja erro
  * \return 0 Caso ok
  */
-int threadpool_init(const char *lsocket_name, threadpool *pool) 
+int threadpool_init(int min_workers, int max_workers, threadpool *pool)
 {
-  int i;
-  struct sockaddr_un main_t_address;
-  socklen_t address_len = sizeof(struct sockaddr_un);
-
   if (!pool) 
     return -1;
 
-  pool->threads = (pthread_t *) calloc(THREAD_NUM, sizeof(pthread_t));
-  pool->queue = (task_list *) calloc(1, sizeof(task_list));
+  pool->workers = (worker *) calloc(MAX_WORKERS, sizeof(worker));
 
-  if (0 > (pool->l_socket = socket(AF_UNIX, SOCK_DGRAM, 0)))
+  if (0 > (pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
     return -1;
 
-  memset(&main_t_address, 0, sizeof(main_t_address));
-  main_t_address.sun_family = AF_UNIX;
-  strcpy(main_t_address.sun_path, lsocket_name);
-
-  if (0 > connect(pool->l_socket,
-                   (struct sockaddr *) &main_t_address, address_len))
-    goto error;
-
-  if (pthread_mutex_init(&(pool->lock), NULL) ||
-      pthread_cond_init(&(pool->notify), NULL) ||
-      !pool->threads || !pool->queue) 
+  if (pthread_mutex_init(&(pool->lock), NULL) || !pool->workers ||
+      0 > task_ring_init(DONE_RING_SIZE, &pool->done) ||
+      0 > threadpool_set_limits(min_workers, max_workers, pool))
     goto error;
 
-  for (i = 0; i < THREAD_NUM; i++)
-    if (pthread_create(&(pool->threads[i]), NULL, threadpool_thread, 
-       (void*)pool))
-      goto error;
-
   return 0;
 
 error:
@@ -94,32 +202,242 @@ error:
   return -1;
 }
 
-/*! \brief Adiciona uma tarefa ao pool de threads
+/*! \brief Altera a quantidade de threads ativas. Executado somente pelo
+ * reactor. Ao diminuir, as threads retiradas deixam de receber tarefas,
+ * esvaziam a propria fila e saem; nenhuma tarefa e' descartada. Ao
+ * aumentar, reaproveita as retiradas que ainda nao sairam e aguarda as que
+ * ja sairam antes de recria-las. As filas sao mantidas ate' o
+ * threadpool_destroy
+ *
+ * \param[in] num_workers A nova quantidade, de 1 a MAX_WORKERS
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso erro. As threads ja iniciadas continuam ativas
+ * \return 0 Caso ok
+ */
+int threadpool_resize(int num_workers, threadpool *pool)
+{
+  int old_workers = pool->num_workers;
+  int i;
+
+  if (1 > num_workers || MAX_WORKERS < num_workers || !pool->workers)
+    return -1;
+
+  if (pthread_mutex_lock(&(pool->lock)))
+    return -1;
+
+  for (i = old_workers; i < num_workers; i++)
+  {
+    worker *cur_worker = &pool->workers[i];
+
+    if (WORKER_RUNNING == cur_worker->state)
+      continue;
+
+    if (WORKER_EXITED == cur_worker->state)
+    {
+      if (pthread_join(cur_worker->thread, NULL))
+        break;
+
+      cur_worker->state = WORKER_STOPPED;
+    }
+
+    /* A fila existe antes que alguma thread tente roubar dela */
+    if (i >= pool->num_slots)
+    {
+      cur_worker->id = i;
+      cur_worker->pool = pool;
+      if (0 > task_ring_init(TASK_RING_SIZE, &cur_worker->queue))
+        break;
+
+      if (pthread_cond_init(&(cur_worker->notify), NULL))
+      {
+        task_ring_destroy(&cur_worker->queue);
+        break;
+      }
+
+      __atomic_store_n(&pool->num_slots, i + 1, __ATOMIC_RELEASE);
+    }
+
+    if (pthread_create(&(cur_worker->thread), NULL, threadpool_thread,
+        (void *) cur_worker))
+      break;
+
+    cur_worker->state = WORKER_RUNNING;
+  }
+
+  if (i > num_workers)
+    i = num_workers;
+  __atomic_store_n(&pool->num_workers, i, __ATOMIC_SEQ_CST);
+
+  /* Acorda as retiradas estacionadas, que verificam a propria fila e saem */
+  for (; i < old_workers; i++)
+    pthread_cond_signal(&(pool->workers[i].notify));
+
+  if (pthread_mutex_unlock(&(pool->lock)) || pool->num_workers < num_workers)
+    return -1;
+
+  return 0;
+}
+
+/*! \brief Define os limites do ajuste automatico e ajusta as threads
+ * ativas a eles
+ *
+ * \param[in] min_workers Minimo de threads, a partir de 1
+ * \param[in] max_workers Maximo de threads, ate' MAX_WORKERS
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso limites invalidos ou erro ao ajustar
+ * \return 0 Caso ok
+ */
+int threadpool_set_limits(int min_workers, int max_workers,
+                          threadpool *pool)
+{
+  if (1 > min_workers || min_workers > max_workers ||
+      MAX_WORKERS < max_workers)
+    return -1;
+
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+
+  if (pool->num_workers < min_workers)
+    return threadpool_resize(min_workers, pool);
+
+  if (pool->num_workers > max_workers)
+    return threadpool_resize(max_workers, pool);
+
+  return 0;
+}
+
+/*! \brief Ajuste automatico, chamado periodicamente pelo reactor. Acrescenta
+ * uma thread se a fila passou do numero de threads ou se a espera media das
+ * tarefas desde o ultimo ajuste passou de POOL_GROW_WAIT_NS. Retira uma se
+ * a fila esta vazia, a espera ficou abaixo de POOL_SHRINK_WAIT_NS e ao
+ * menos duas threads estao estacionadas
+ *
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso erro ao ajustar
+ * \return 0 Caso ok
+ */
+int threadpool_scale(threadpool *pool)
+{
+  unsigned long long wait_ns = 0;
+  unsigned long tasks = 0;
+  long long avg_wait = 0;
+  int num_workers = pool->num_workers;
+  int depth = threadpool_depth(pool);
+  int peak = depth > pool->depth_peak ? depth : pool->depth_peak;
+  int parked = 0;
+  int cont;
+
+  for (cont = 0; cont < pool->num_slots; cont++)
+  {
+    wait_ns += __atomic_load_n(&pool->workers[cont].wait_ns,
+                               __ATOMIC_RELAXED);
+    tasks += __atomic_load_n(&pool->workers[cont].tasks, __ATOMIC_RELAXED);
+  }
+
+  for (cont = 0; cont < pool->num_workers; cont++)
+    parked += __atomic_load_n(&pool->workers[cont].parked, __ATOMIC_RELAXED);
+
+  if (tasks > pool->last_tasks)
+    avg_wait = (wait_ns - pool->last_wait_ns) / (tasks - pool->last_tasks);
+
+  pool->last_wait_ns = wait_ns;
+  pool->last_tasks = tasks;
+  pool->depth_peak = 0;
+
+  if (peak > num_workers || POOL_GROW_WAIT_NS < avg_wait)
+    num_workers++;
+  else if (!depth && POOL_SHRINK_WAIT_NS > avg_wait && 2 <= parked)
+    num_workers--;
+
+  if (num_workers > pool->max_workers)
+    num_workers = pool->max_workers;
+  if (num_workers < pool->min_workers)
+    num_workers = pool->min_workers;
+
+  if (num_workers == pool->num_workers)
+    return 0;
+
+  return threadpool_resize(num_workers, pool);
+}
+
+/*! \brief Adiciona uma tarefa ao pool de threads, sem alocacao nem lock, na
+ * fila da thread do argumento (ou na seguinte com espaco). O lock so e'
+ * usado para acordar uma thread estacionada: a dona da fila ou, se ocupada,
+ * outra que roubara' a tarefa
  *
  * \param[in] function A funcao a ser executada
  * \param[in] Os argumentos para a funcao
  * \param[out] pool O pool de threads
  *
- * \return -1 Caso haja algum erro
+ * \return -1 Caso haja algum erro ou as filas estejam cheias
  * \return 0 Caso OK
  */
 int threadpool_add(void (*function)(void *), void *argument, 
                    threadpool *pool) 
 {
-  task_node *new_node = NULL;
+  worker *to_wake = NULL;
+  long long queued_ns = 0;
+  int target;
+  int depth;
+  int cont;
 
-  if (!pool || !function)
+  if (!pool || !function || !pool->num_workers)
     return -1;
 
-  if (pthread_mutex_lock(&(pool->lock)))
+  if (pool->pending > (int) pool->done.mask)
+  {
+    pool->full++;
     return -1;
+  }
+
+  if (pool->min_workers < pool->max_workers)
+    queued_ns = threadpool_now_ns();
+
+  target = threadpool_worker_of(argument, pool);
+  for (cont = 0; cont < pool->num_workers; cont++)
+    if (0 <= task_ring_push(function, argument, queued_ns,
+                            &pool->workers[target].queue))
+      break;
+    else
+      target = (target + 1) % pool->num_workers;
+
+  if (cont == pool->num_workers)
+  {
+    pool->full++;
+    return -1;
+  }
 
-  if(!(new_node = task_node_alloc(function, argument)))
+  pool->pending++;
+
+  if ((depth = threadpool_depth(pool)) > pool->depth_max)
+    pool->depth_max = depth;
+  if (depth > pool->depth_peak)
+    pool->depth_peak = depth;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (cont = 0; cont < pool->num_workers && !to_wake; cont++)
+  {
+    worker *cur_worker =
+      &pool->workers[(target + cont) % pool->num_workers];
+
+    if (__atomic_load_n(&cur_worker->parked, __ATOMIC_RELAXED))
+      to_wake = cur_worker;
+  }
+
+  if (!to_wake)
+    return 0;
+
+  if (pthread_mutex_lock(&(pool->lock)))
     return -1;
-  task_node_append(new_node, pool->queue);
 
-  if (pthread_cond_signal(&(pool->notify)))
+  if (pthread_cond_signal(&(to_wake->notify)))
+  {
+    pthread_mutex_unlock(&pool->lock);
     return -1;
+  }
 
   if (pthread_mutex_unlock(&pool->lock))
     return -1;
@@ -127,6 +445,100 @@ int threadpool_add(void (*function)(void *), void *argument,
   return 0;
 }
 
+/*! \brief Consome o aviso de tarefas concluidas. Deve preceder o
+ * recolhimento com threadpool_done: conclusoes posteriores geram novo aviso
+ *
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso erro na leitura
+ * \return 0 Caso ok
+ */
+int threadpool_ack(threadpool *pool)
+{
+  uint64_t count;
+
+  if (0 > read(pool->event_fd, &count, sizeof(count)) && EAGAIN != errno &&
+      EINTR != errno)
+    return -1;
+
+  __atomic_store_n(&pool->notified, 0, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/*! \brief Recolhe uma tarefa concluida. Executado somente pelo reactor
+ *
+ * \param[out] argument Recebe o argumento da tarefa
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso nao haja mais tarefas concluidas
+ * \return 0 Caso ok
+ */
+int threadpool_done(void **argument, threadpool *pool)
+{
+  task_slot task;
+
+  if (0 > task_ring_pop(&task, &pool->done))
+    return -1;
+
+  pool->pending--;
+  *argument = task.argument;
+  return 0;
+}
+
+/*! \brief Acorda o reactor que monitora o event_fd, sem tarefa concluida
+ *
+ * \param[out] pool O pool de threads
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int threadpool_wakeup(threadpool *pool)
+{
+  uint64_t one = 1;
+
+  if ((ssize_t) sizeof(one) != write(pool->event_fd, &one, sizeof(one)) &&
+      EAGAIN != errno)
+    return -1;
+
+  return 0;
+}
+
+/*! \brief Tarefas nas filas do pool, aguardando uma thread
+ *
+ * \param[in] pool O pool de threads
+ *
+ * \return depth A quantidade
+ */
+int threadpool_depth(const threadpool *pool)
+{
+  int depth = 0;
+  int cont;
+
+  for (cont = 0; cont < pool->num_slots; cont++)
+    depth += task_ring_depth(&pool->workers[cont].queue);
+
+  return depth;
+}
+
+/*! \brief Tarefas executadas por uma thread que nao a de destino
+ *
+ * \param[in] pool O pool de threads
+ *
+ * \return stolen A quantidade
+ */
+unsigned long threadpool_stolen(const threadpool *pool)
+{
+  unsigned long stolen = 0;
+  int cont;
+
+  for (cont = 0; cont < pool->num_slots; cont++)
+    stolen += __atomic_load_n(&pool->workers[cont].stolen,
+                              __ATOMIC_RELAXED);
+
+  return stolen;
+}
+
 /*! \brief Para a execucao e elimina o pool de threads
  *
  * \param[out] pool O pool a ser eliminado
@@ -141,121 +553,179 @@ int threadpool_destroy(threadpool *pool)
   if (!pool)
     return -1;
 
-  if (0 < pool->l_socket)
-    close(pool->l_socket);
-
   if (pthread_mutex_lock(&(pool->lock)))
     return -1;
 
-  pool->shut_down = 1;
-  if (pthread_cond_broadcast(&(pool->notify)) ||
-      pthread_mutex_unlock(&(pool->lock)))
+  __atomic_store_n(&pool->shut_down, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < pool->num_slots; i++)
+    if (pthread_cond_broadcast(&(pool->workers[i].notify)))
+      break;
+
+  if (i < pool->num_slots || pthread_mutex_unlock(&(pool->lock)))
     return -1;
 
-  for (i = 0; i < THREAD_NUM; i++)
-    if (pthread_join(pool->threads[i], NULL))
+  for (i = 0; i < pool->num_slots; i++)
+  {
+    worker *cur_worker = &pool->workers[i];
+
+    if (WORKER_STOPPED != cur_worker->state &&
+        pthread_join(cur_worker->thread, NULL))
         return -1;
 
-  if (pool->threads)
-    free(pool->threads);
+    task_ring_destroy(&cur_worker->queue);
+    pthread_cond_destroy(&(cur_worker->notify));
+  }
 
-  if (pool->queue)
-  {
-    while (pool->queue->head)
-    {
-      task_node *task = task_node_pop_first(pool->queue);
-      task_node_free(task);
-    }
+  if (pool->workers)
+    free(pool->workers);
+  pool->workers = NULL;
+  pool->num_workers = 0;
+  pool->num_slots = 0;
+  task_ring_destroy(&pool->done);
 
-    free(pool->queue);
-  }
+  /* Apos o fim das threads, que escrevem no event_fd */
+  if (0 < pool->event_fd)
+    close(pool->event_fd);
+  pool->event_fd = -1;
 
-  if (pthread_mutex_destroy(&(pool->lock)) ||
-      pthread_cond_destroy(&(pool->notify)))
+  if (pthread_mutex_destroy(&(pool->lock)))
     return -1;
 
   return 0;
 }
 
-/*! \brief Aloca um no' para uma tarefa
+/*! \brief Aloca as posicoes da fila de tarefas
  *
- * \param[in] function Ponteiro para a funcao
- * \param[in] argument Argumento para a funcao
+ * \param[in] size Quantidade de posicoes, potencia de 2
+ * \param[out] ring A fila
  *
- * \return NULL Caso haja erro
- * \return task_node Caso ok
+ * \return -1 Caso haja erro
+ * \return 0 Caso ok
  */
-task_node *task_node_alloc(void (*function)(void *), void *argument)
+int task_ring_init(unsigned long size, task_ring *ring)
 {
-  task_node *new_node = NULL;
-  
-  if(!(new_node = (task_node *) calloc(1, sizeof(task_node))))
-    return NULL;
+  unsigned long cont;
+
+  memset(ring, 0, sizeof(*ring));
 
-  new_node->function = function;
-  new_node->argument = argument;
+  if (!size || size & (size - 1))
+    return -1;
 
-  return new_node;
+  if (!(ring->slots = (task_slot *) calloc(size, sizeof(task_slot))))
+    return -1;
+
+  for (cont = 0; cont < size; cont++)
+    ring->slots[cont].seq = cont;
+
+  ring->mask = size - 1;
+  return 0;
 }
 
-/*! \brief Libera uma tarefa
+/*! \brief Libera as posicoes da fila de tarefas
  *
- * \param[out] node Tarefa a ser liberada
+ * \param[out] ring A fila
+ */
+void task_ring_destroy(task_ring *ring)
+{
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+/*! \brief Insere uma tarefa. A posicao e' reservada avancando head e
+ * liberada aos consumidores ao publicar seq
  *
- * \return -1 Caso haja erro
+ * \param[in] function Ponteiro para a funcao
+ * \param[in] argument Argumento para a funcao
+ * \param[in] queued_ns Instante da insercao, 0 se nao medido
+ * \param[out] ring A fila
+ *
+ * \return -1 Caso a fila esteja cheia
  * \return 0 Caso ok
  */
-int task_node_free(task_node *node)
+int task_ring_push(void (*function)(void *), void *argument,
+                   long long queued_ns, task_ring *ring)
 {
-  if (!node)
-    return -1;
+  unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  task_slot *slot;
+
+  while (1)
+  {
+    long diff;
+
+    slot = &ring->slots[pos & ring->mask];
+    diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
 
-  free(node);
+    if (!diff)
+    {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (0 > diff)
+      return -1;
+    else
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  }
+
+  slot->function = function;
+  slot->argument = argument;
+  slot->queued_ns = queued_ns;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
   return 0;
 }
 
-/*! \brief Adiciona um elemento a lista
+/*! \brief Retira a tarefa mais antiga. A posicao volta aos produtores na
+ * proxima volta da fila
  *
- * \param[in] new_node O novo no a ser adicionado
- * \param[out] queue A lista
+ * \param[out] task Recebe a tarefa
+ * \param[out] ring A fila
+ *
+ * \return -1 Caso a fila esteja vazia
+ * \return 0 Caso ok
  */
-void task_node_append(task_node *new_node, task_list *queue)
+int task_ring_pop(task_slot *task, task_ring *ring)
 {
-  task_node *last_node = NULL;
+  unsigned long pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  task_slot *slot;
 
-  if (!queue->size)
-    queue->head = new_node;
-  else
+  while (1)
   {
-    for(last_node = queue->head; last_node->next;
-        last_node = last_node->next)
-      ;
+    long diff;
+
+    slot = &ring->slots[pos & ring->mask];
+    diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                   (pos + 1));
 
-    last_node->next = new_node;
-    new_node->prev = last_node;
+    if (!diff)
+    {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (0 > diff)
+      return -1;
+    else
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
   }
 
-  queue->size++;
+  task->function = slot->function;
+  task->argument = slot->argument;
+  task->queued_ns = slot->queued_ns;
+  __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  return 0;
 }
 
-/*! \brief Remove o primeiro elemento da lista
+/*! \brief Tarefas na fila. Aproximado com insercoes ou retiradas em
+ * andamento
  *
- * \param[in] node O no' a ser eliminado da lista
- * \param[out] queue A lista
+ * \param[in] ring A fila
  *
- * \return -1 Caso haja erro
- * \return 0 Caso ok
+ * \return depth A quantidade
  */
-task_node *task_node_pop_first(task_list *queue)
+int task_ring_depth(const task_ring *ring)
 {
-  task_node *task_to_remove = NULL;
-
-  if (!queue->size)
-    return task_to_remove;
-
-  task_to_remove = queue->head;
-  queue->head = queue->head->next;
-  queue->size--;
+  unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
 
-  return task_to_remove;
+  return head > tail ? (int) (head - tail) : 0;
 }
@@ -0,0 +1,354 @@
+/*!
+ * \file reactor.c
+ * \brief Implementacao do laco de eventos com backend epoll ou pselect
+ */
+
+#include "reactor.h"
+
+const char *supported_backends[] = {"select", "epoll"};
+
+/*! \brief Converte os eventos do reactor para o formato do epoll
+ *
+ * \param[in] events Eventos no formato EV_*
+ *
+ * \return Os eventos no formato do epoll
+ */
+static uint32_t reactor_to_epoll(unsigned int events)
+{
+  uint32_t ep_events = 0;
+
+  if (events & EV_READ)
+    ep_events |= EPOLLIN;
+  if (events & EV_WRITE)
+    ep_events |= EPOLLOUT;
+
+  return ep_events;
+}
+
+/*! \brief Converte os eventos retornados pelo epoll para o formato do reactor
+ *
+ * \param[in] ep_events Eventos do epoll
+ *
+ * \return Os eventos no formato EV_*
+ */
+static unsigned int reactor_from_epoll(uint32_t ep_events)
+{
+  unsigned int events = 0;
+
+  if (ep_events & EPOLLIN)
+    events |= EV_READ;
+  if (ep_events & EPOLLOUT)
+    events |= EV_WRITE;
+  if (ep_events & (EPOLLERR | EPOLLHUP))
+    events |= EV_ERROR;
+
+  return events;
+}
+
+/*! \brief Converte um timeout em timespec para milissegundos, arredondando
+ * para cima para nao acordar antes do prazo
+ *
+ * \param[in] timeout O timeout, NULL para espera indefinida
+ *
+ * \return -1 Caso espera indefinida
+ * \return ms O timeout em milissegundos
+ */
+static int reactor_timeout_ms(const struct timespec *timeout)
+{
+  long long ms;
+
+  if (!timeout)
+    return -1;
+
+  ms = (long long) timeout->tv_sec * 1000 +
+       (timeout->tv_nsec + 999999) / 1000000;
+  if (ms > INT_MAX)
+    return INT_MAX;
+
+  return (int) ms;
+}
+
+/*! \brief Atualiza os fd_sets mestres do pselect para um descritor
+ *
+ * \param[in] fd O descritor
+ * \param[in] events Os eventos de interesse, 0 remove o descritor
+ * \param[in] data Dado associado ao descritor
+ * \param[out] r O reactor
+ */
+static void reactor_select_set(int fd, unsigned int events, void *data,
+                               reactor *r)
+{
+  FD_CLR(fd, &r->read_s);
+  FD_CLR(fd, &r->write_s);
+  FD_CLR(fd, &r->except_s);
+
+  if (events & EV_READ)
+    FD_SET(fd, &r->read_s);
+  if (events & EV_WRITE)
+    FD_SET(fd, &r->write_s);
+  if (events)
+    FD_SET(fd, &r->except_s);
+
+  r->fd_data[fd] = events ? data : NULL;
+
+  if (events)
+    r->maxfd = MAX(fd, r->maxfd);
+  else
+    while (0 <= r->maxfd && !r->fd_data[r->maxfd])
+      r->maxfd--;
+}
+
+/*! \brief Espera eventos com pselect, varrendo apenas ate o maior descritor
+ * registrado
+ *
+ * \param[in] timeout O timeout da espera
+ * \param[in] sigmask Mascara de sinais durante a espera
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro
+ * \return nevents Numero de eventos prontos
+ */
+static int reactor_select_wait(const struct timespec *timeout,
+                               const sigset_t *sigmask, reactor *r)
+{
+  fd_set read_s = r->read_s;
+  fd_set write_s = r->write_s;
+  fd_set except_s = r->except_s;
+  int nready;
+  int nevents = 0;
+  int fd;
+
+  nready = pselect(r->maxfd + 1, &read_s, &write_s, &except_s, timeout,
+                   sigmask);
+  if (0 >= nready)
+    return nready;
+
+  for (fd = 0; fd <= r->maxfd && nevents < REACTOR_MAX_EVENTS &&
+       nevents < nready; fd++)
+  {
+    unsigned int events = 0;
+
+    if (FD_ISSET(fd, &read_s))
+      events |= EV_READ;
+    if (FD_ISSET(fd, &write_s))
+      events |= EV_WRITE;
+    if (FD_ISSET(fd, &except_s))
+      events |= EV_ERROR;
+
+    if (!events)
+      continue;
+
+    r->events[nevents].data = r->fd_data[fd];
+    r->events[nevents].events = events;
+    nevents++;
+  }
+
+  return nevents;
+}
+
+/*! \brief Inicializa o reactor. Caso o epoll nao esteja disponivel, usa o
+ * pselect como alternativa
+ *
+ * \param[in] backend O backend desejado
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int reactor_init(reactor_backend backend, reactor *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->epollfd = -1;
+  r->maxfd = -1;
+  r->backend = backend;
+
+  if (!(r->events = (reactor_event *) calloc(REACTOR_MAX_EVENTS,
+                                             sizeof(reactor_event))))
+    return -1;
+
+  if (EPOLL_BACKEND == backend)
+  {
+    r->ep_events = (struct epoll_event *) calloc(REACTOR_MAX_EVENTS,
+                                                 sizeof(struct epoll_event));
+    if (!r->ep_events)
+      goto error;
+
+    if (0 > (r->epollfd = epoll_create1(EPOLL_CLOEXEC)))
+    {
+      free(r->ep_events);
+      r->ep_events = NULL;
+      r->backend = SELECT_BACKEND;
+    }
+  }
+
+  return 0;
+
+error:
+  reactor_destroy(r);
+  return -1;
+}
+
+/*! \brief Identifica o backend a partir de seu nome
+ *
+ * \param[in] backend_str O nome do backend
+ * \param[out] backend O backend correspondente
+ *
+ * \return -1 Caso o backend nao seja suportado
+ * \return 0 Caso ok
+ */
+int reactor_parse_backend(const char *backend_str, reactor_backend *backend)
+{
+  int cont;
+
+  for (cont = 0; cont < NUM_BACKEND; cont++)
+    if (!strcmp(backend_str, supported_backends[cont]))
+    {
+      *backend = cont;
+      return 0;
+    }
+
+  return -1;
+}
+
+/*! \brief Verifica se um descritor pode ser monitorado pelo backend
+ *
+ * \param[in] fd O descritor
+ * \param[in] r O reactor
+ *
+ * \return 1 Caso possa ser monitorado
+ * \return 0 Caso contrario (pselect nao monitora alem de FD_SETSIZE)
+ */
+int reactor_fd_allowed(int fd, reactor *r)
+{
+  if (SELECT_BACKEND == r->backend)
+    return fd < FD_SETSIZE;
+
+  return 1;
+}
+
+/*! \brief Registra interesse em eventos de um descritor
+ *
+ * \param[in] fd O descritor
+ * \param[in] events Os eventos de interesse
+ * \param[in] data Dado devolvido junto aos eventos
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int reactor_add(int fd, unsigned int events, void *data, reactor *r)
+{
+  struct epoll_event ep_event;
+
+  if (SELECT_BACKEND == r->backend)
+  {
+    if (!reactor_fd_allowed(fd, r))
+      return -1;
+
+    reactor_select_set(fd, events, data, r);
+    return 0;
+  }
+
+  memset(&ep_event, 0, sizeof(ep_event));
+  ep_event.events = reactor_to_epoll(events);
+  ep_event.data.ptr = data;
+
+  return epoll_ctl(r->epollfd, EPOLL_CTL_ADD, fd, &ep_event);
+}
+
+/*! \brief Altera os eventos de interesse de um descritor ja registrado
+ *
+ * \param[in] fd O descritor
+ * \param[in] events Os novos eventos de interesse
+ * \param[in] data Dado devolvido junto aos eventos
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int reactor_mod(int fd, unsigned int events, void *data, reactor *r)
+{
+  struct epoll_event ep_event;
+
+  if (SELECT_BACKEND == r->backend)
+  {
+    reactor_select_set(fd, events, data, r);
+    return 0;
+  }
+
+  memset(&ep_event, 0, sizeof(ep_event));
+  ep_event.events = reactor_to_epoll(events);
+  ep_event.data.ptr = data;
+
+  return epoll_ctl(r->epollfd, EPOLL_CTL_MOD, fd, &ep_event);
+}
+
+/*! \brief Remove um descritor do reactor
+ *
+ * \param[in] fd O descritor
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int reactor_del(int fd, reactor *r)
+{
+  if (SELECT_BACKEND == r->backend)
+  {
+    if (reactor_fd_allowed(fd, r))
+      reactor_select_set(fd, 0, NULL, r);
+    return 0;
+  }
+
+  return epoll_ctl(r->epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*! \brief Espera por eventos nos descritores registrados. Os eventos prontos
+ * ficam em r->events
+ *
+ * \param[in] timeout O timeout da espera, NULL para espera indefinida
+ * \param[in] sigmask Mascara de sinais aplicada durante a espera
+ * \param[out] r O reactor
+ *
+ * \return -1 Caso erro (errno preservado)
+ * \return nevents Numero de eventos prontos
+ */
+int reactor_wait(const struct timespec *timeout, const sigset_t *sigmask,
+                 reactor *r)
+{
+  int nready;
+  int cont;
+
+  if (SELECT_BACKEND == r->backend)
+    return reactor_select_wait(timeout, sigmask, r);
+
+  nready = epoll_pwait(r->epollfd, r->ep_events, REACTOR_MAX_EVENTS,
+                       reactor_timeout_ms(timeout), sigmask);
+
+  for (cont = 0; cont < nready; cont++)
+  {
+    r->events[cont].data = r->ep_events[cont].data.ptr;
+    r->events[cont].events = reactor_from_epoll(r->ep_events[cont].events);
+  }
+
+  return nready;
+}
+
+/*! \brief Libera os recursos do reactor
+ *
+ * \param[out] r O reactor
+ */
+void reactor_destroy(reactor *r)
+{
+  if (0 <= r->epollfd)
+    close(r->epollfd);
+  r->epollfd = -1;
+
+  if (r->ep_events)
+    free(r->ep_events);
+  r->ep_events = NULL;
+
+  if (r->events)
+    free(r->events);
+  r->events = NULL;
+}
@@ -5,59 +5,177 @@
 
 #include "server.h"
 
-const char *supported_methods[] = {"GET", "PUT"};
-const char *supported_protocols[] = {"HTTP/1.0", "HTTP/1.1"};
+const char *supported_engines[] = {"threads", "uring", "sendfile"};
 
-/*! \brief Funcao verifica uma linha dupla em um buffer que e' uma string
+/*! \brief Arquivos em uso pelos GETs e PUTs de todos os reactors: um PUT
+ * nao concorre com outro acesso ao mesmo recurso, ainda que os clientes
+ * estejam em reactors diferentes. So' e' consultada na abertura e no fim
+ * de cada requisicao */
+static file_list used_files;
+static pthread_mutex_t used_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! \brief Limite do servidor, comum aos reactors: um reactor ocupado usa o
+ * saldo que os demais nao usam */
+static rate_bucket global_bucket;
+
+/*! \brief Enderecos de origem com conexoes em algum reactor: o limite por
+ * endereco vale para todas as conexoes do endereco, em qualquer reactor */
+static ip_bucket *ip_buckets[IP_HASH_SIZE];
+static pthread_mutex_t ip_buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! \brief Caminho do arquivo temporario de um PUT: um nome oculto, no
+ * diretorio do recurso, que server_verify_cli_resource recusa
  *
- * \param[in] buffer Uma string contendo a mensagem
+ * \param[in] client O cliente, com o caminho do recurso
+ * \param[out] tmp_path Recebe o caminho
+ * \param[in] len Tamanho de tmp_path
  *
- * \return end_header Posicao onde encontrou o fim dos headers
- * \return NULL Caso nao encontre o fim dos headers
+ * \return -1 Caso o caminho nao caiba
+ * \return 0 Caso ok
  */
-static char *server_verify_double_line(const char *buffer)
+static int server_put_tmp_path(const client_node *client, char *tmp_path,
+                               size_t len)
 {
-  char *end_header = NULL;
-  char pattern1[] = {"\r\n\r\n"};
-  char pattern2[] = {"\n\n"};
+  const char *name = strrchr(client->put_path, '/') + 1;
+  int printf_return = snprintf(tmp_path, len, "%.*s" PUT_TMP_NAME,
+                               (int) (name - client->put_path),
+                               client->put_path, name, client->sockfd);
 
-  if ((end_header = strstr(buffer, pattern1)))
-    return end_header + strlen(pattern1);
-    
-  if ((end_header = strstr(buffer, pattern2)))
-    return end_header + strlen(pattern2);
+  return 0 > printf_return || (size_t) printf_return >= len ? -1 : 0;
+}
+
+/*! \brief Verifica se o ultimo componente de um caminho tem a forma do
+ * nome de um temporario de PUT
+ *
+ * \param[in] path O caminho
+ *
+ * \return 1 Caso tenha
+ * \return 0 Caso contrario
+ */
+static int server_put_is_tmp(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  const char *suffix;
+
+  name = name ? name + 1 : path;
+  if ('.' != *name || !(suffix = strrchr(name, '.')) || suffix == name ||
+      strncmp(suffix, PUT_TMP_SUFFIX, strlen(PUT_TMP_SUFFIX)))
+    return 0;
+
+  suffix += strlen(PUT_TMP_SUFFIX);
+  if (!*suffix)
+    return 0;
+
+  while (*suffix >= '0' && *suffix <= '9')
+    suffix++;
 
-  return end_header;
+  return !*suffix;
 }
 
-/*! \brief Verifica o metodo passado na requisicao do Cliente
+/*! \brief Remove da arvore os temporarios de PUTs deixados por uma
+ * execucao interrompida
  *
- * \param[in] method_str O metodo extraido a partir da requisicao do cliente
- * \param[out] cur_client O cliente em questao 
+ * \param[in] path O diretorio
  */
-static void server_verify_cli_method(const char *method_str, 
-                                     client_node *cur_client)
+static void server_remove_put_tmp(const char *path)
 {
-  int cont = 0;
-  int cmp_return = 0;
+  char sub_path[PATH_MAX];
+  struct dirent *entry;
+  DIR *dir;
 
-  do
+  if (!(dir = opendir(path)))
+    return;
+
+  while ((entry = readdir(dir)))
   {
-    cmp_return = strncmp(method_str, supported_methods[cont],
-                         strlen(supported_methods[cont]));
-    cont++;
-  } while (cont < NUM_METHOD && cmp_return);
+    struct stat sub_stat;
 
-  if (cmp_return)
-    cur_client->resp_status = NOT_IMPLEMENTED;
-  else
-    cur_client->method = cont - 1;
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+        0 > fs_watch_join(path, entry->d_name, sub_path, sizeof(sub_path)) ||
+        0 > lstat(sub_path, &sub_stat))
+      continue;
+
+    if (S_ISDIR(sub_stat.st_mode))
+      server_remove_put_tmp(sub_path);
+    else if (S_ISREG(sub_stat.st_mode) && server_put_is_tmp(entry->d_name))
+      unlink(sub_path);
+  }
+
+  closedir(dir);
 }
 
-/* \brief Faz analises sobre o arquivo solicitado: se o arquivo ja existe e se
- * ja esta em uso ou nao
+/*! \brief Cria o arquivo temporario de um PUT. Com suporte a O_TMPFILE, o
+ * arquivo nao tem nome ate o fim do PUT; caso contrario, usa o nome oculto
+ *
+ * \param[in] tmp_path Nome oculto do temporario
+ * \param[out] client O cliente
+ *
+ * \return -1 Caso erro
+ * \return fd O descritor do temporario
+ */
+static int server_put_open_tmp(const char *tmp_path, client_node *client)
+{
+  int fd;
+#ifdef O_TMPFILE
+  char dir_path[PATH_MAX];
+  const char *name = strrchr(client->put_path, '/');
+
+  snprintf(dir_path, sizeof(dir_path), "%.*s",
+           (int) MAX(name - client->put_path, 1), client->put_path);
+  if (0 <= (fd = open(dir_path, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666)))
+  {
+    client->put_anon = 1;
+    return fd;
+  }
+#endif
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  return fd;
+}
+
+/*! \brief Conclui o PUT, com o temporario ainda aberto: com o corpo
+ * recebido por completo, o temporario recebe o nome oculto, se nao tiver, e
+ * substitui o recurso com rename; caso contrario, e' descartado. GETs em
+ * andamento continuam com o arquivo antigo, inclusive mapeado, e o recurso
+ * e' invalidado no cache
+ *
+ * \param[in] client O cliente
+ * \param[out] r_server O servidor
+ */
+static void server_put_finish(const client_node *client, server *r_server)
+{
+  char tmp_path[PATH_MAX + PUT_TMP_LEN];
+  char fd_path[PUT_FD_PATH_LEN];
+  int fd = client->file ? fileno(client->file) : client->file_fd;
+
+  if (0 > server_put_tmp_path(client, tmp_path, sizeof(tmp_path)))
+    return;
+
+  if (OK == client->resp_status && client->status & FINISHED)
+  {
+    if (client->file)
+      fflush(client->file);
+
+    /* Liga o temporario ao diretorio pelo descritor */
+    if (client->put_anon)
+    {
+      snprintf(fd_path, sizeof(fd_path), PUT_FD_PATH, fd);
+      unlink(tmp_path);
+      linkat(AT_FDCWD, fd_path, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW);
+    }
+
+    rename(tmp_path, client->put_path);
+  }
+  else if (!client->put_anon)
+    unlink(tmp_path);
+
+  file_cache_invalidate(client->put_path, &r_server->f_cache);
+}
+
+/*! \brief Abre o arquivo do recurso. O GET usa o descritor compartilhado do
+ * cache de arquivos. O PUT escreve em um arquivo temporario, com um FILE*
+ * ou, com o motor sendfile, um descritor proprio e o pipe usado pelo splice
  *
- * \param[in] resource O recurso solicitado
  * \param[in] full_path Caminho completo para o recurso solicitado
  * \param[out] client O cliente
  * \param[out] r_server O servidor
@@ -65,41 +183,158 @@ static void server_verify_cli_method(const char *method_str,
  * \return -1 Caso erro
  * \return 0 Caso ok
  */
-static int process_file_req(const char *resource, const char *full_path,
-                            client_node *client, server *r_server)
+static int server_open_file(const char *full_path, client_node *client,
+                            server *r_server)
 {
-  file_node *file_to_add;
+  char tmp_path[PATH_MAX + PUT_TMP_LEN];
+  int fd;
 
-  if (0 > verify_file_status(resource, client->method, &r_server->used_files,
-                             client->used_file))
+  if (client->method == GET)
   {
-    client->resp_status = FORBIDDEN;
-    return -1;
+    if (!(client->cached = file_cache_get(full_path, &r_server->f_cache)))
+      return -1;
+
+    client->file_fd = client->cached->fd;
+    client->file_size = client->cached->size;
+    client->file_offset = 0;
+    return 0;
   }
 
-  if (client->method == GET)
-    client->file = fopen(full_path, "r");
-  else
-    client->file = fopen(full_path, "w");
+  /* O corpo e' escrito em um arquivo temporario, que substitui o recurso
+   * ao fim do PUT */
+  if (!(client->put_path = strdup(full_path)) ||
+      0 > server_put_tmp_path(client, tmp_path, sizeof(tmp_path)))
+    return -1;
 
-  if (!client->file)
+  if (SENDFILE_ENGINE != r_server->engine)
   {
-    client->resp_status = NOT_FOUND;
+    if (0 > (fd = server_put_open_tmp(tmp_path, client)))
+      return -1;
+
+    if (!(client->file = fdopen(fd, "w")))
+    {
+      close(fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (0 > pipe2(client->pipe_fds, O_NONBLOCK | O_CLOEXEC))
+  {
+    client->pipe_fds[0] = -1;
+    client->pipe_fds[1] = -1;
     return -1;
   }
 
+  client->file_fd = server_put_open_tmp(tmp_path, client);
+  return 0 > client->file_fd ? -1 : 0;
+}
+
+static int server_upd_ufile_info(client_node *client);
+
+/*! \brief Registra o uso do recurso pelo cliente em used_files, se nao
+ * conflitar com os usos atuais
+ *
+ * \param[in] resource O recurso solicitado
+ * \param[out] client O cliente
+ *
+ * \return -1 Caso o uso nao seja permitido ou erro de alocacao
+ * \return 0 Caso ok
+ */
+static int server_use_file(const char *resource, client_node *client)
+{
+  file_node *file_to_add;
+  int ret = -1;
+
+  pthread_mutex_lock(&used_files_lock);
+
+  if (0 > verify_file_status(resource, client->method, &used_files,
+                             client->used_file))
+    goto exit;
+
   if (!client->used_file)
   {
-    file_to_add = file_node_allocate(resource, client->method);
-    if (!file_to_add)
-      return -1;
-    file_node_append(file_to_add, &r_server->used_files);
+    if (!(file_to_add = file_node_allocate(resource, client->method)))
+      goto exit;
+
+    file_node_append(file_to_add, &used_files);
     client->used_file = file_to_add;
   }
   else
     client->used_file->cont++;
 
-  return 0;
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&used_files_lock);
+  return ret;
+}
+
+/* \brief Faz analises sobre o arquivo solicitado: se o arquivo ja existe e se
+ * ja esta em uso ou nao. O uso e' registrado antes da abertura, para que
+ * outro reactor nao abra o mesmo recurso em paralelo, e desfeito se a
+ * abertura falhar
+ *
+ * \param[in] resource O recurso solicitado
+ * \param[in] full_path Caminho completo para o recurso solicitado
+ * \param[in] exists 0 se a resolucao do caminho falhou
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+static int process_file_req(const char *resource, const char *full_path,
+                            int exists, client_node *client,
+                            server *r_server)
+{
+  if (0 > server_use_file(resource, client))
+  {
+    client->resp_status = FORBIDDEN;
+    return -1;
+  }
+
+  /* Inexistente na resolucao: o GET nao precisa tentar abrir */
+  if (!exists && client->method == GET)
+    client->resp_status = NOT_FOUND;
+  else if (0 > server_open_file(full_path, client, r_server))
+    client->resp_status = NOT_FOUND;
+  else
+    return 0;
+
+  server_upd_ufile_info(client);
+  client->used_file = NULL;
+  return -1;
+}
+
+/*! \brief Verifica se a resolucao de um caminho e' o proprio caminho, sem
+ * links simbolicos, '.' ou '..', a menos de barras repetidas. Sem sucesso,
+ * a resolucao para no componente inexistente e basta ser um prefixo
+ *
+ * \param[in] rel_path O caminho montado a partir do recurso
+ * \param[in] full_path O caminho resolvido
+ * \param[in] exists 0 se a resolucao falhou
+ *
+ * \return 1 Caso seja
+ * \return 0 Caso contrario
+ */
+static int server_path_is_direct(const char *rel_path, const char *full_path,
+                                 int exists)
+{
+  if (!*full_path)
+    return 0;
+
+  while (*rel_path && *rel_path == *full_path)
+  {
+    if ('/' == *rel_path)
+      while ('/' == rel_path[1])
+        rel_path++;
+
+    rel_path++;
+    full_path++;
+  }
+
+  return !*full_path && (!*rel_path || (!exists && '/' == *rel_path));
 }
 
 /*! \brief Funcao que verifica o recurso que o cliente esta querendo acessar e
@@ -119,25 +354,48 @@ static int server_verify_cli_resource(const char *resource,
 {
   char full_path[PATH_MAX];
   char rel_path[PATH_MAX];
+  const path_entry *resolved = NULL;
+  int exists;
 
   /* Caso status de erro para a mensagem, nao analisa resource */
   if (client->resp_status)
     return -1;
 
   memset(full_path, 0, sizeof(full_path));
-  memset(rel_path, 0, sizeof(rel_path));
 
-  strncpy(rel_path, r_server->serv_root, ROOT_LEN - 1);
-  strncat(rel_path, "/", 1);
-  strncat(rel_path, resource, PATH_MAX - ROOT_LEN - 1);
-  realpath(rel_path, full_path);
-  if (strncmp(r_server->serv_root, full_path, strlen(r_server->serv_root)))
+  /* O cache de recursos so e' usado com a raiz observada, que o invalida */
+  if (0 <= r_server->watch.fd)
+    resolved = file_cache_path_get(resource, &r_server->f_cache);
+
+  if (resolved)
+  {
+    strcpy(full_path, resolved->path);
+    exists = resolved->exists;
+  }
+  else
+  {
+    memset(rel_path, 0, sizeof(rel_path));
+
+    strncpy(rel_path, r_server->serv_root, ROOT_LEN - 1);
+    strncat(rel_path, "/", 1);
+    strncat(rel_path, resource, PATH_MAX - ROOT_LEN - 1);
+    exists = NULL != realpath(rel_path, full_path);
+
+    if (0 <= r_server->watch.fd)
+      file_cache_path_add(resource, full_path, exists,
+                          server_path_is_direct(rel_path, full_path, exists),
+                          &r_server->f_cache);
+  }
+
+  /* Temporarios de PUTs em andamento nao sao recursos */
+  if (strncmp(r_server->serv_root, full_path, strlen(r_server->serv_root)) ||
+      server_put_is_tmp(resource) || (exists && server_put_is_tmp(full_path)))
   {
     client->resp_status = FORBIDDEN;
     return -1;
   }
 
-  if (0 > process_file_req(resource, full_path, client, r_server))
+  if (0 > process_file_req(resource, full_path, exists, client, r_server))
     return -1;
 
   client->resp_status = OK;
@@ -179,99 +437,105 @@ static char *server_http_code_char(const http_code http_code)
   return NULL;
 }
 
-/*! \brief Verifica qual o protocolo da request do cliente
+/*! \brief Verifica a linha de requisicao analisada: protocolo e metodo
+ * suportados e recurso dentro do limite, copiado para resource
  *
- * \param[in] protocol O protocolo extraido da request do cliente
+ * \param[out] resource Recebe o recurso solicitado
  * \param[out] cur_client O cliente em questao
  */
-static void server_verify_cli_protocol(const char *protocol, 
-                                       client_node *cur_client)
+static void server_verify_cli_request_line(char *resource,
+                                           client_node *cur_client)
 {
-  int cont = 0;
-  int cmp_return = 0;
+  const http_parser *parser = &cur_client->parser;
 
-  do
+  resource[0] = '\0';
+
+  if (parser->malformed || RESOURCE_LEN < parser->target.len)
   {
-    cmp_return = strncmp(protocol, supported_protocols[cont],
-                         strlen(supported_protocols[cont]));
-    cont++;
-  } while (cont < NUM_PROTOCOL && cmp_return);
+    cur_client->resp_status = BAD_REQUEST;
+    return;
+  }
+
+  memcpy(resource, cur_client->buffer + parser->target.start,
+         parser->target.len);
+  resource[parser->target.len] = '\0';
 
-  if (cmp_return)
+  if (0 > parser->protocol)
     cur_client->resp_status = BAD_REQUEST;
   else
-    cur_client->protocol = cont - 1;
+    cur_client->protocol = parser->protocol;
+
+  if (0 > parser->method)
+    cur_client->resp_status = NOT_IMPLEMENTED;
+  else
+    cur_client->method = parser->method;
 }
 
-/*! \brief Funcao que analisa a requisicao do cliente e separa em tres 
- * strings, o metodo, o recurso e o protocolo usados
+/*! \brief Identifica o motor de execucao de I/O a partir de seu nome
+ *
+ * \param[in] engine_str O nome do motor
+ * \param[out] r_server O servidor
  *
- * \param[out] cur_client O cliente com todas as informacoes
- * \param[out] method O metodo da requisicao
- * \param[out] resource O recurso solicitado
- * \param[out] protocol O protocolo usado na requisicao
+ * \return -1 Caso o motor nao seja suportado
+ * \return 0 Caso ok
  */
-static void server_extr_req_params(client_node *cur_client, char *method, 
-                                   char *resource, char *protocol)
+static int server_parse_engine(const char *engine_str, server *r_server)
 {
-  int num_read = 0;
+  int cont;
 
-  memset(method, 0, sizeof(*method));
-  memset(resource, 0, sizeof(*resource));
-  memset(protocol, 0, sizeof(*protocol));
+  for (cont = 0; cont < NUM_ENGINE; cont++)
+    if (!strcmp(engine_str, supported_engines[cont]))
+    {
+      r_server->engine = cont;
+      return 0;
+    }
 
-  num_read = sscanf(cur_client->buffer, "%" STR_METHOD_LEN "[^ ] "
-                    "%" STR_RESOURCE_LEN "[^ ] "
-                    "%" STR_PROTOCOL_LEN "[^\r\n]", 
-                    method, resource, protocol); 
-  
-  if (3 != num_read)
-    cur_client->resp_status = BAD_REQUEST;
+  return -1;
 }
 
-/*! \brief Inicializa os fd_sets e a referencia do maior descritor
+/*! \brief Interpreta a quantidade de threads do pool: "N" para um pool
+ * fixo ou "MIN:MAX" para ajuste automatico entre os limites. 0 usa uma
+ * thread por nucleo. Aceita o terminador de linha do arquivo de configuracao
+ *
+ * \param[in] value O valor
+ * \param[out] min_workers Recebe o minimo de threads
+ * \param[out] max_workers Recebe o maximo de threads
  *
- * \param[out] r_server Estrutura do servidor
+ * \return -1 Caso valor invalido (limites anteriores mantidos)
+ * \return 0 Caso ok
  */
-static int server_init_sets(server *r_server)
+static int server_parse_workers(const char *value, int *min_workers,
+                                int *max_workers)
 {
-  int cur_sockfd = 0;
-  int transmission = 0;
-  client_node *cur_client = NULL;
-
-  FD_ZERO(&r_server->sets.read_s);
-  FD_ZERO(&r_server->sets.write_s);
-  FD_ZERO(&r_server->sets.except_s);
-  FD_SET(r_server->listenfd, &r_server->sets.read_s);
-  r_server->maxfd_number = r_server->listenfd;
-  FD_SET(r_server->l_socket, &r_server->sets.read_s);
-  r_server->maxfd_number = MAX(r_server->maxfd_number,
-                               r_server->l_socket);
+  long limits[2];
+  char *endptr = NULL;
+  int num_limits = 0;
 
-  for(cur_client = r_server->l_clients.head; cur_client; 
-      cur_client = cur_client->next)
+  do
   {
-    if (!cur_client->bucket.transmission ||
-        cur_client->status & SIGNAL_WAIT)
-      continue;
-
-    cur_sockfd = cur_client->sockfd;
-    r_server->maxfd_number = MAX(cur_sockfd, r_server->maxfd_number);
-   
-    if (cur_client->status & WRITE_DATA)
-      FD_SET(cur_sockfd, &r_server->sets.write_s);
-    else
-      FD_SET(cur_sockfd, &r_server->sets.read_s);
+    limits[num_limits] = strtol(value, &endptr, NUMBER_BASE);
+    if (endptr == value || 0 > limits[num_limits])
+      return -1;
 
-    FD_SET(cur_sockfd, &r_server->sets.except_s);
+    if (!limits[num_limits])
+      limits[num_limits] = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_WORKERS);
+    num_limits++;
+    value = endptr + 1;
+  } while (':' == *endptr && 2 > num_limits);
 
-    transmission = 1;
-  }
+  if ((*endptr && '\n' != *endptr) || 1 > limits[0] ||
+      limits[0] > limits[num_limits - 1] ||
+      MAX_WORKERS < limits[num_limits - 1])
+    return -1;
 
-  return transmission;
+  *min_workers = limits[0];
+  *max_workers = limits[num_limits - 1];
+  return 0;
 }
 
-/*! \brief Verifica os argumentos passados para o servidor
+/*! \brief Verifica os argumentos passados para o servidor. As opcoes
+ * (SERVER_OPTIONS) podem aparecer antes dos parametros posicionais root, porta
+ * e velocidade
  *
  * \param[in] argc Numero de argumentos
  * \param[in] argv Argumentos recebidos com informacoes de porta e root
@@ -280,33 +544,133 @@ static int server_init_sets(server *r_server)
  *
  * \return -1 caso algum erro tenha sido detectado
  * \return 0 caso OK
+ *
+ * \note A estrutura preenchida serve de modelo para server_init
  */
-static int server_parse_arguments(int argc, const char *argv[],
-                                  server *r_server)
+int server_parse_arguments(int argc, const char *argv[], server *r_server)
 {
   char *endptr = NULL;
+  const char **params = NULL;
   int arg_len = 0;
+  long rate;
+  int opt;
+
+  memset(r_server, 0, sizeof(*r_server));
+  r_server->backend = EPOLL_BACKEND;
+  r_server->num_reactors = 1;
+  r_server->content_max = FILE_CACHE_CONTENT;
+  r_server->keepalive_max = KEEPALIVE_MAX;
+  r_server->keepalive_timeout = KEEPALIVE_TIMEOUT;
+  r_server->min_workers = THREAD_NUM;
+  r_server->max_workers = THREAD_NUM;
+
+  while (-1 != (opt = getopt(argc, (char * const *) argv, SERVER_OPTIONS)))
+  {
+    switch (opt)
+    {
+      case 'b':
+        if (0 > reactor_parse_backend(optarg, &r_server->backend))
+          return -1;
+        break;
+
+      case 'c':
+        r_server->content_max = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > r_server->content_max)
+          return -1;
+        break;
+
+      case 'd':
+        r_server->bucket_depth = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 >= r_server->bucket_depth)
+          return -1;
+        break;
+
+      case 'e':
+        if (0 > server_parse_engine(optarg, r_server))
+          return -1;
+        break;
+
+      case 'g':
+        rate = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > rate || INT_MAX < rate)
+          return -1;
+        r_server->global_rate = rate;
+        break;
+
+      case 'i':
+        rate = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > rate || INT_MAX < rate)
+          return -1;
+        r_server->ip_rate = rate;
+        break;
+
+      case 'k':
+        r_server->keepalive_max = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > r_server->keepalive_max)
+          return -1;
+        break;
+
+      case 'K':
+        r_server->keepalive_timeout = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 >= r_server->keepalive_timeout)
+          return -1;
+        break;
+
+      case 'm':
+        if (0 > bucket_parse_mode(optarg, &r_server->b_mode))
+          return -1;
+        break;
+
+      case 'M':
+        r_server->map_min = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > r_server->map_min)
+          return -1;
+        break;
+
+      case 'r':
+        r_server->num_reactors = strtol(optarg, &endptr, NUMBER_BASE);
+        if (*endptr || 0 > r_server->num_reactors)
+          return -1;
+
+        /* 0 usa um reactor por nucleo */
+        if (!r_server->num_reactors)
+          r_server->num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+        if (0 >= r_server->num_reactors || MAX_REACTORS < r_server->num_reactors)
+          return -1;
+        break;
+
+      case 'w':
+        if (0 > server_parse_workers(optarg, &r_server->min_workers,
+                                     &r_server->max_workers))
+          return -1;
+        break;
+
+      default:
+        return -1;
+    }
+  }
 
-  if (argc != 4)
+  if (CONFIG_PARAM_NUM != argc - optind)
     return -1;
+  params = argv + optind;
 
-  if (ROOT_LEN <= (arg_len = strlen(argv[1])))
+  if (ROOT_LEN <= (arg_len = strlen(params[ROOT_CONFIG])))
     return -1;
 
-  if (access(argv[1], F_OK))
+  /* Canonica, como os caminhos resolvidos e as chaves do cache */
+  if (!realpath(params[ROOT_CONFIG], r_server->serv_root))
     return -1;
-  strncpy(r_server->serv_root, argv[1], ROOT_LEN - 1);
 
-  if (PORT_LEN <= (arg_len = strlen(argv[2])))
+  if (PORT_LEN <= (arg_len = strlen(params[PORT_CONFIG])))
     return -1;
-  r_server->listen_port = strtol(argv[2], &endptr, NUMBER_BASE);
-  if (endptr - argv[2] < arg_len)
+  r_server->listen_port = strtol(params[PORT_CONFIG], &endptr, NUMBER_BASE);
+  if (endptr - params[PORT_CONFIG] < arg_len)
     return -1;
 
-  if (VEL_LEN <= (arg_len = strlen(argv[3])))
+  if (VEL_LEN <= (arg_len = strlen(params[VEL_CONFIG])))
     return -1;
-  r_server->velocity = strtol(argv[3], &endptr, NUMBER_BASE);
-  if (endptr - argv[3] < arg_len)
+  r_server->velocity = strtol(params[VEL_CONFIG], &endptr, NUMBER_BASE);
+  if (endptr - params[VEL_CONFIG] < arg_len)
     return -1;
 
   return 0;
@@ -315,23 +679,38 @@ static int server_parse_arguments(int argc, const char *argv[],
 /*! \brief Cria o socket para escuta em porta passada como parametro
  *
  * \param[in] listen_port A porta de escuta
+ * \param[in] reuse_port Habilita SO_REUSEPORT, para que cada reactor tenha
+ * seu proprio socket de escuta na mesma porta
  *
  * \return -1 Caso ocorra algum erro
  * \return listen_socket Caso esteja ok
  */
-static int server_create_listenfd(int listen_port)
+static int server_create_listenfd(int listen_port, int reuse_port)
 {
   struct sockaddr_in servaddr;
   int listen_socket;
   int enabled = 1;
 
-  if (0 > (listen_socket = socket(AF_INET, SOCK_STREAM, 0)))
+  /* Nao bloqueante para que o accept em lote pare no backlog vazio */
+  if (0 > (listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                                  SOCK_CLOEXEC, 0)))
     return -1;
 
   if (0 > setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enabled,
                      sizeof(int)))
     goto error;
 
+  if (reuse_port &&
+      0 > setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enabled,
+                     sizeof(int)))
+    goto error;
+
+  /* Herdado pelas conexoes aceitas: respostas seguidas (pipelining) nao
+   * esperam o ACK da anterior */
+  if (0 > setsockopt(listen_socket, IPPROTO_TCP, TCP_NODELAY, &enabled,
+                     sizeof(int)))
+    goto error;
+
   memset(&servaddr, 0, sizeof(servaddr));
   servaddr.sin_family = AF_INET;
   servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -353,63 +732,36 @@ error:
   return -1;
 }
 
-/*! \brief Cria o socket local com base no nome guardado em um define
- *
- * \return -1 Caso ocorra algum erro
- * \return local_listen_socket Caso esteja ok
- */
-static int server_create_local_socket()
-{
-  struct sockaddr_un servaddr;
-  int l_socket;
-
-  if (0 > (l_socket = socket(AF_UNIX, SOCK_DGRAM, 0)))
-    return -1;
-
-  bzero(&servaddr, sizeof(servaddr));
-  servaddr.sun_family = AF_UNIX;
-  strcpy(servaddr.sun_path, LSOCK_NAME);
-
-  unlink(LSOCK_NAME);
-  if (0 > bind(l_socket, (struct sockaddr *)&servaddr,
-               sizeof(servaddr)))
-    goto error;
-
-  return l_socket;
-
-error:
-  if (0 > l_socket)
-    close(l_socket);
-
-  return -1;
-}
-
 /* \brief Funcao que analisa o status do arquivo em uso pelo cliente
  *
  * \param[out] client O cliente em questao
- * \param[out] r_server O servidor
  *
  * \return -1 Caso erro
  * \return 0 Caso OK
  */
-static int server_upd_ufile_info(client_node *client, server *r_server)
+static int server_upd_ufile_info(client_node *client)
 {
-  if (client->used_file)
-  {
-    if (client->used_file->cont > 1)
-      client->used_file->cont--;
-    else
-    {
-      file_node *used_file;
-      used_file = file_node_pop(client->used_file, &r_server->used_files);
-      if (!used_file)
-        return -1;
+  int ret = 0;
+
+  if (!client->used_file)
+    return 0;
 
+  pthread_mutex_lock(&used_files_lock);
+
+  if (client->used_file->cont > 1)
+    client->used_file->cont--;
+  else
+  {
+    file_node *used_file;
+    used_file = file_node_pop(client->used_file, &used_files);
+    if (used_file)
       file_node_free(used_file);
-    }
+    else
+      ret = -1;
   }
 
-  return 0;
+  pthread_mutex_unlock(&used_files_lock);
+  return ret;
 }
 
 /* \brief Funcao que atualiza o status do cliente apos enviar dados e elimina
@@ -434,6 +786,10 @@ void server_process_cli_status(client_node *client)
       client->status = 0;
       client->status |= FINISHED;
     }
+    /* GET de arquivo vazio: nada a enviar apos o header */
+    else if (GET == client->method &&
+             client->file_offset >= client->file_size)
+      client->status = FINISHED;
   }
 
   if (client->task_st == (task_status) FINISHED)
@@ -455,6 +811,8 @@ int server_build_header(client_node *cur_client)
 {
   int resp_status = 0;
   int printf_return = 0;
+  long long body_len = 0;
+  const char *connection = "";
 
   /* Nao e necessario gerar o header */
   if (!(cur_client->status & WRITE_HEADER))
@@ -462,11 +820,21 @@ int server_build_header(client_node *cur_client)
 
   resp_status = cur_client->resp_status;
 
+  /* O corpo e' delimitado pelo tamanho, para a conexao poder continuar */
+  if (OK == resp_status && GET == cur_client->method)
+    body_len = cur_client->file_size;
+
+  if (HTTP11 == cur_client->protocol && !cur_client->keep_alive)
+    connection = HTTP_CONNECTION ": close\r\n";
+  else if (HTTP10 == cur_client->protocol && cur_client->keep_alive)
+    connection = HTTP_CONNECTION ": keep-alive\r\n";
+
   printf_return = snprintf(cur_client->buffer, BUFFER_LEN - 1,
-                       "%s %d %s\r\n\r\n", 
+                       "%s %d %s\r\n%s: %lld\r\n%s\r\n", 
                        supported_protocols[cur_client->protocol], 
                        resp_status, 
-                       server_http_code_char(cur_client->resp_status));
+                       server_http_code_char(cur_client->resp_status),
+                       HTTP_CONTENT_LENGTH, body_len, connection);
   if (printf_return >= BUFFER_LEN || printf_return < 0)
     return -1;
 
@@ -475,6 +843,44 @@ int server_build_header(client_node *cur_client)
   return 0;
 }
 
+/*! \brief Aloca, em um unico bloco, os elementos da estrutura de clientes
+ * para um lote de conexoes aceitas
+ *
+ * \param[in] sockfds Os sockets dos clientes
+ * \param[in] num_clients Numero de clientes do lote
+ * \param[out] clients Vetor que recebe os clientes alocados
+ *
+ * \return -1 caso haja erro de alocacao
+ * \return 0 caso os clientes sejam alocados
+ *
+ * \note O bloco e' liberado quando o ultimo de seus clientes for liberado
+ */
+int client_node_allocate_batch(const int *sockfds, int num_clients,
+                               client_node **clients)
+{
+  client_slab *slab = NULL;
+  int cont;
+
+  slab = (client_slab *) calloc(1, sizeof(client_slab) +
+                                   num_clients * sizeof(client_node));
+  if (!slab)
+    return -1;
+
+  slab->refs = num_clients;
+  for (cont = 0; cont < num_clients; cont++)
+  {
+    clients[cont] = &slab->clients[cont];
+    clients[cont]->sockfd = sockfds[cont];
+    clients[cont]->file_fd = -1;
+    clients[cont]->pipe_fds[0] = -1;
+    clients[cont]->pipe_fds[1] = -1;
+    http_parser_init(&clients[cont]->parser);
+    clients[cont]->slab = slab;
+  }
+
+  return 0;
+}
+
 /*! \brief Aloca um novo elemento da estrutura de clientes
  * 
  * \param[in] sockfd O socket para o cliente
@@ -486,11 +892,9 @@ client_node *client_node_allocate(int sockfd)
 {
   client_node *new_client = NULL;
 
-  new_client = (client_node *) calloc(1, sizeof(client_node));
-  if (!new_client)
+  if (0 > client_node_allocate_batch(&sockfd, 1, &new_client))
     return NULL;
 
-  new_client->sockfd = sockfd;
   return new_client;
 }
 
@@ -500,12 +904,24 @@ client_node *client_node_allocate(int sockfd)
  */
 void client_node_free(client_node *client)
 {
+  client_slab *slab = client->slab;
+
   close(client->sockfd);
   if (client->buffer)
     free(client->buffer);
   if (client->file)
     fclose(client->file);
-  free(client);
+  if (0 <= client->file_fd)
+    close(client->file_fd);
+  if (client->put_path)
+    free(client->put_path);
+  if (0 <= client->pipe_fds[0])
+    close(client->pipe_fds[0]);
+  if (0 <= client->pipe_fds[1])
+    close(client->pipe_fds[1]);
+
+  if (!--slab->refs)
+    free(slab);
 }
 
 /*! \brief Adiciona um cliente no final da lista de clientes
@@ -515,22 +931,16 @@ void client_node_free(client_node *client)
  */
 void client_node_append(client_node *client, client_list *l_clients)
 {
-  client_node *last_client = NULL;
+  client->next = NULL;
+  client->prev = l_clients->tail;
 
   if (!l_clients->head)
-  {
     l_clients->head = client;
-    l_clients->size++;
-  }
   else
-  {
-    for (last_client = l_clients->head; last_client->next; 
-         last_client = last_client->next)
-      ;
-    last_client->next = client;
-    client->prev = last_client;
-    l_clients->size++;
-  }
+    l_clients->tail->next = client;
+
+  l_clients->tail = client;
+  l_clients->size++;
 }
 
 /*! \brief Elimina referencia de um elemento dentro da lsita
@@ -546,56 +956,1207 @@ int client_node_pop(client_node *client, client_list *l_clients)
   if (!client || !l_clients->size)
     return -1;
 
-  if (client == l_clients->head)
-    l_clients->head = client->next;
+  if (client->prev)
+    client->prev->next = client->next;
   else
-  {
-    if (client->next)
-      client->next->prev = client->prev;
+    l_clients->head = client->next;
 
-    if (client->prev)
-      client->prev->next = client->next;
-  }
+  if (client->next)
+    client->next->prev = client->prev;
+  else
+    l_clients->tail = client->prev;
  
   l_clients->size--;
   return 0;
 }
 
-/*! \brief Aceita novas conexoes e aloca no vetor de clientes
+/*! \brief Coloca um cliente no final de uma fila, retirando-o da fila em que
+ * estiver
  *
- * \param[in] r_server A estrutura servidor para a conexao de um cliente
- * \param[in] velocity A velocidade de transmissao em kb/s
- *
- * \return -1 caso aconteça algum erro
- * \return 0 caso OK
+ * \param[out] client O cliente
+ * \param[out] queue A fila
  */
-int server_make_connection(server *r_server)
+void client_queue_push(client_node *client, client_queue *queue)
 {
-  int connfd = -1;
-  struct sockaddr_in cliaddr;
-  socklen_t cli_length = sizeof(cliaddr);
-  client_node *new_client = NULL;
- 
-  /* Select nao pode monitoras sockets alem de FD_SETSIZE */
-  if (FD_SETSIZE == r_server->l_clients.size)
+  if (client->queue == queue)
+    return;
+
+  if (client->queue)
+    client_queue_remove(client);
+
+  client->q_next = NULL;
+  client->q_prev = queue->tail;
+
+  if (!queue->head)
+    queue->head = client;
+  else
+    queue->tail->q_next = client;
+
+  queue->tail = client;
+  queue->size++;
+  client->queue = queue;
+}
+
+/*! \brief Coloca um cliente no inicio de uma fila, retirando-o da fila em
+ * que estiver
+ *
+ * \param[out] client O cliente
+ * \param[out] queue A fila
+ */
+void client_queue_push_head(client_node *client, client_queue *queue)
+{
+  if (client->queue)
+    client_queue_remove(client);
+
+  client->q_prev = NULL;
+  client->q_next = queue->head;
+
+  if (!queue->tail)
+    queue->tail = client;
+  else
+    queue->head->q_prev = client;
+
+  queue->head = client;
+  queue->size++;
+  client->queue = queue;
+}
+
+/*! \brief Retira o primeiro cliente de uma fila
+ *
+ * \param[out] queue A fila
+ *
+ * \return NULL Caso a fila esteja vazia
+ * \return client O cliente retirado
+ */
+client_node *client_queue_pop(client_queue *queue)
+{
+  client_node *client = queue->head;
+
+  if (client)
+    client_queue_remove(client);
+
+  return client;
+}
+
+/*! \brief Retira um cliente da fila em que estiver, se estiver em alguma
+ *
+ * \param[out] client O cliente
+ */
+void client_queue_remove(client_node *client)
+{
+  client_queue *queue = client->queue;
+
+  if (!queue)
+    return;
+
+  if (client->q_prev)
+    client->q_prev->q_next = client->q_next;
+  else
+    queue->head = client->q_next;
+
+  if (client->q_next)
+    client->q_next->q_prev = client->q_prev;
+  else
+    queue->tail = client->q_prev;
+
+  client->q_next = NULL;
+  client->q_prev = NULL;
+  client->queue = NULL;
+  queue->size--;
+}
+
+/*! \brief Eventos que o estado do cliente exige para avancar
+ *
+ * \param[in] client O cliente
+ *
+ * \return EV_WRITE ou EV_READ
+ */
+static unsigned int server_client_interest(const client_node *client)
+{
+  return (client->status & WRITE_DATA) ? EV_WRITE : EV_READ;
+}
+
+/*! \brief Capacidade de um bucket continuo com a taxa dada
+ *
+ * \param[in] rate A taxa em B/s
+ *
+ * \return depth A capacidade
+ */
+static int server_rate_depth(unsigned int rate)
+{
+  return MAX((int) (rate / BUCKET_DEPTH_DIV), 1);
+}
+
+/*! \brief Capacidade do bucket continuo de um cliente: a configurada ou uma
+ * fracao da velocidade
+ *
+ * \param[in] r_server O servidor
+ *
+ * \return depth A capacidade
+ */
+static int server_bucket_depth(const server *r_server)
+{
+  if (r_server->bucket_depth)
+    return r_server->bucket_depth;
+
+  return server_rate_depth(r_server->velocity);
+}
+
+/*! \brief Inicializa um bucket conforme o modo. No modo continuo, o bucket
+ * so transmite com tokens para um buffer, ou cheio se a capacidade for menor
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[in] depth A capacidade, no modo continuo
+ * \param[out] bucket O bucket
+ * \param[out] burst_start Inicio da burst, no modo burst
+ * \param[in] r_server O servidor
+ */
+static void server_bucket_init(unsigned int rate, int depth,
+                               token_bucket *bucket, long long *burst_start,
+                               const server *r_server)
+{
+  *burst_start = r_server->now_ms;
+
+  if (CONTINUOUS_BUCKET == r_server->b_mode)
+    bucket_init_continuous(depth, BUFFER_LEN, r_server->now_ns, bucket);
+  else
+    bucket_init(rate, bucket);
+}
+
+/*! \brief Instante, em milissegundos, em que um bucket sem tokens volta a
+ * transmitir
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[in] bucket O bucket
+ * \param[in] burst_start Inicio da burst, no modo burst
+ * \param[in] r_server O servidor
+ *
+ * \return ms O instante
+ */
+static long long server_bucket_refill_time(unsigned int rate,
+                                           const token_bucket *bucket,
+                                           long long burst_start,
+                                           const server *r_server)
+{
+  long long ready_ns;
+
+  if (CONTINUOUS_BUCKET != r_server->b_mode)
+    return burst_start + BURST_TIME * 1000;
+
+  /* Taxa nula: tenta novamente na proxima burst */
+  if (0 > (ready_ns = bucket_ready_time(rate, bucket)))
+    return r_server->now_ms + BURST_TIME * 1000;
+
+  return (ready_ns + 999999) / 1000000;
+}
+
+/*! \brief Recarrega um bucket. No modo burst, somente caso sua burst tenha
+ * terminado desde o ultimo uso (cada bucket tem sua propria burst, iniciada
+ * na recarga anterior). No modo continuo, credita os tokens do tempo
+ * decorrido
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[in] depth A capacidade, no modo continuo
+ * \param[out] bucket O bucket
+ * \param[out] burst_start Inicio da burst, no modo burst
+ * \param[in] r_server O servidor
+ */
+static void server_bucket_sync(unsigned int rate, int depth,
+                               token_bucket *bucket, long long *burst_start,
+                               const server *r_server)
+{
+  if (CONTINUOUS_BUCKET == r_server->b_mode)
+  {
+    bucket_refill(rate, depth, r_server->now_ns, bucket);
+    return;
+  }
+
+  if (r_server->now_ms - *burst_start < BURST_TIME * 1000)
+    return;
+
+  bucket_fill(rate, bucket);
+  *burst_start = r_server->now_ms;
+}
+
+/*! \brief Inicializa o bucket comum de um nivel da hierarquia
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[out] shared O bucket
+ * \param[in] r_server O servidor
+ */
+static void server_rate_init(unsigned int rate, rate_bucket *shared,
+                             const server *r_server)
+{
+  pthread_mutex_init(&shared->lock, NULL);
+  shared->rate = rate;
+  server_bucket_init(rate, server_rate_depth(rate), &shared->bucket,
+                     &shared->burst_start, r_server);
+}
+
+/*! \brief Recarrega o bucket comum de um nivel
+ *
+ * \param[out] shared O bucket
+ * \param[in] r_server O servidor
+ */
+static void server_rate_sync(rate_bucket *shared, const server *r_server)
+{
+  pthread_mutex_lock(&shared->lock);
+  server_bucket_sync(shared->rate, server_rate_depth(shared->rate),
+                     &shared->bucket, &shared->burst_start, r_server);
+  pthread_mutex_unlock(&shared->lock);
+}
+
+/*! \brief Saldo do bucket comum de um nivel
+ *
+ * \param[in] shared O bucket
+ *
+ * \return 0 Caso o nivel esteja esgotado
+ * \return tokens O saldo
+ */
+static int server_rate_tokens(rate_bucket *shared)
+{
+  int tokens;
+
+  pthread_mutex_lock(&shared->lock);
+  tokens = shared->bucket.transmission ? shared->bucket.remain_tokens : 0;
+  pthread_mutex_unlock(&shared->lock);
+
+  return tokens;
+}
+
+/*! \brief Retira do bucket comum de um nivel ate a quantidade pedida, no
+ * limite do saldo atual
+ *
+ * \param[in] tokens Tokens pedidos
+ * \param[out] shared O bucket
+ *
+ * \return taken Tokens retirados, 0 caso o nivel esteja esgotado
+ */
+static int server_rate_take(int tokens, rate_bucket *shared)
+{
+  int taken = 0;
+
+  pthread_mutex_lock(&shared->lock);
+  if (shared->bucket.transmission)
+  {
+    taken = MIN(tokens, shared->bucket.remain_tokens);
+    bucket_withdraw(taken, &shared->bucket);
+  }
+  pthread_mutex_unlock(&shared->lock);
+
+  return taken;
+}
+
+/*! \brief Retira do bucket comum de um nivel bytes ja transferidos
+ *
+ * \param[in] tokens Bytes transferidos
+ * \param[out] shared O bucket
+ */
+static void server_rate_withdraw(int tokens, rate_bucket *shared)
+{
+  pthread_mutex_lock(&shared->lock);
+  bucket_withdraw(tokens, &shared->bucket);
+  pthread_mutex_unlock(&shared->lock);
+}
+
+/*! \brief Devolve ao bucket comum de um nivel tokens nao usados
+ *
+ * \param[in] tokens Tokens devolvidos
+ * \param[out] shared O bucket
+ */
+static void server_rate_deposit(int tokens, rate_bucket *shared)
+{
+  pthread_mutex_lock(&shared->lock);
+  bucket_deposit(tokens, &shared->bucket);
+  pthread_mutex_unlock(&shared->lock);
+}
+
+/*! \brief Instante, em milissegundos, em que o bucket comum de um nivel
+ * esgotado volta a transmitir
+ *
+ * \param[in] shared O bucket
+ * \param[in] r_server O servidor
+ *
+ * \return ms O instante
+ */
+static long long server_rate_refill_time(rate_bucket *shared,
+                                         const server *r_server)
+{
+  long long refill_ms;
+
+  pthread_mutex_lock(&shared->lock);
+  refill_ms = server_bucket_refill_time(shared->rate, &shared->bucket,
+                                        shared->burst_start, r_server);
+  pthread_mutex_unlock(&shared->lock);
+
+  return refill_ms;
+}
+
+static void server_level_schedule(rate_level *level, server *r_server);
+
+/*! \brief Temporizador de recarga de um nivel da hierarquia: os tokens sao
+ * repartidos entre os clientes do reactor que aguardavam o nivel
+ *
+ * \param[in] entry O temporizador de recarga do nivel
+ * \param[out] arg O servidor
+ */
+static void server_level_refill(timer_entry *entry, void *arg)
+{
+  rate_level *level = (rate_level *) entry->data;
+  server *r_server = (server *) arg;
+
+  server_rate_sync(level->shared, r_server);
+  server_level_schedule(level, r_server);
+}
+
+/*! \brief Inicializa a espera de um reactor por um nivel da hierarquia de
+ * limitacao de banda
+ *
+ * \param[in] shared O bucket comum do nivel, NULL para nivel sem limite
+ * \param[out] level O nivel
+ */
+static void server_level_init(rate_bucket *shared, rate_level *level)
+{
+  memset(level, 0, sizeof(*level));
+  level->shared = shared;
+  timer_entry_init(server_level_refill, level, &level->refill_timer);
+}
+
+/*! \brief Obtem os niveis com limite acima da conexao de um cliente: o do
+ * endereco de origem e o do servidor
+ *
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ * \param[out] levels Os niveis
+ *
+ * \return num_levels Numero de niveis
+ */
+static int server_client_levels(const client_node *client, server *r_server,
+                                rate_level *levels[])
+{
+  int num_levels = 0;
+
+  if (client->ip)
+    levels[num_levels++] = &client->ip->level;
+  if (r_server->global_level.shared)
+    levels[num_levels++] = &r_server->global_level;
+
+  return num_levels;
+}
+
+/*! \brief Obtem o limite comum de um endereco de origem, criando-o no
+ * primeiro reactor com conexoes do endereco
+ *
+ * \param[in] addr O endereco
+ * \param[in] hash Posicao do endereco na tabela
+ * \param[in] r_server O servidor
+ *
+ * \return NULL Caso erro de alocacao
+ * \return ip_bucket O limite do endereco
+ */
+static ip_bucket *server_ip_bucket_get(in_addr_t addr, unsigned int hash,
+                                       const server *r_server)
+{
+  ip_bucket *bucket;
+
+  pthread_mutex_lock(&ip_buckets_lock);
+
+  for (bucket = ip_buckets[hash]; bucket; bucket = bucket->next)
+    if (bucket->addr == addr)
+    {
+      bucket->refs++;
+      goto exit;
+    }
+
+  if (!(bucket = (ip_bucket *) calloc(1, sizeof(ip_bucket))))
+    goto exit;
+
+  bucket->addr = addr;
+  bucket->refs = 1;
+  bucket->hash = hash;
+  server_rate_init(r_server->ip_rate, &bucket->limit, r_server);
+  bucket->next = ip_buckets[hash];
+  ip_buckets[hash] = bucket;
+
+exit:
+  pthread_mutex_unlock(&ip_buckets_lock);
+  return bucket;
+}
+
+/*! \brief Libera a referencia de um reactor ao limite comum de um
+ * endereco, removendo-o com o ultimo reactor
+ *
+ * \param[out] bucket O limite do endereco
+ */
+static void server_ip_bucket_put(ip_bucket *bucket)
+{
+  ip_bucket **cur_bucket;
+
+  pthread_mutex_lock(&ip_buckets_lock);
+
+  if (--bucket->refs)
+  {
+    pthread_mutex_unlock(&ip_buckets_lock);
+    return;
+  }
+
+  for (cur_bucket = &ip_buckets[bucket->hash]; *cur_bucket;
+       cur_bucket = &(*cur_bucket)->next)
+    if (*cur_bucket == bucket)
+    {
+      *cur_bucket = bucket->next;
+      break;
+    }
+
+  pthread_mutex_unlock(&ip_buckets_lock);
+
+  pthread_mutex_destroy(&bucket->limit.lock);
+  free(bucket);
+}
+
+/*! \brief Obtem o no' de um endereco de origem, criando-o na primeira
+ * conexao do endereco no reactor
+ *
+ * \param[in] addr O endereco
+ * \param[out] r_server O servidor
+ *
+ * \return NULL Caso erro de alocacao
+ * \return ip_node O no' do endereco
+ */
+static ip_node *server_ip_get(in_addr_t addr, server *r_server)
+{
+  unsigned int hash = (ntohl(addr) * 2654435761u) >> (32 - IP_HASH_BITS);
+  ip_node *node;
+
+  for (node = r_server->ip_table[hash]; node; node = node->next)
+    if (node->addr == addr)
+    {
+      node->refs++;
+      return node;
+    }
+
+  if (!(node = (ip_node *) calloc(1, sizeof(ip_node))))
+    return NULL;
+
+  if (!(node->bucket = server_ip_bucket_get(addr, hash, r_server)))
+  {
+    free(node);
+    return NULL;
+  }
+
+  node->addr = addr;
+  node->refs = 1;
+  node->hash = hash;
+  server_level_init(&node->bucket->limit, &node->level);
+  node->next = r_server->ip_table[hash];
+  r_server->ip_table[hash] = node;
+
+  return node;
+}
+
+/*! \brief Libera a referencia de um cliente ao no' de seu endereco,
+ * removendo-o com a ultima conexao do endereco
+ *
+ * \param[out] node O no' do endereco
+ * \param[out] r_server O servidor
+ */
+static void server_ip_put(ip_node *node, server *r_server)
+{
+  ip_node **cur_node;
+
+  if (--node->refs)
+    return;
+
+  for (cur_node = &r_server->ip_table[node->hash]; *cur_node;
+       cur_node = &(*cur_node)->next)
+    if (*cur_node == node)
+    {
+      *cur_node = node->next;
+      break;
+    }
+
+  timer_wheel_del(&node->level.refill_timer, &r_server->timers);
+  server_ip_bucket_put(node->bucket);
+  free(node);
+}
+
+/*! \brief Verifica se o bucket da conexao pode ser ignorado: envios de um
+ * cliente cujo socket e' cadenciado pelo kernel. Recebimentos (PUT)
+ * continuam limitados pelo bucket
+ *
+ * \param[in] client O cliente
+ *
+ * \return 1 Caso o kernel controle o ritmo
+ * \return 0 Caso contrario
+ */
+static int server_client_paced(const client_node *client)
+{
+  return client->paced && PUT != client->method;
+}
+
+/*! \brief Configura o socket do cliente para envio cadenciado pelo kernel,
+ * na velocidade do servidor
+ *
+ * \param[out] client O cliente
+ * \param[in] r_server O servidor
+ */
+static void server_client_set_pacing(client_node *client,
+                                     const server *r_server)
+{
+#ifdef SO_MAX_PACING_RATE
+  unsigned int rate = r_server->velocity;
+
+  client->paced = !setsockopt(client->sockfd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                              &rate, sizeof(rate));
+#else
+  (void) r_server;
+  client->paced = 0;
+#endif
+}
+
+/*! \brief Recarrega os buckets de todos os niveis do cliente
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_sync_bucket(client_node *client, server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int cont;
+
+  server_bucket_sync(r_server->velocity, server_bucket_depth(r_server),
+                     &client->bucket, &client->burst_start, r_server);
+
+  for (cont = 0; cont < num_levels; cont++)
+    server_rate_sync(levels[cont]->shared, r_server);
+}
+
+/*! \brief Verifica se todos os niveis do cliente permitem transmitir
+ *
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ *
+ * \return 1 Caso permitam
+ * \return 0 Caso contrario
+ */
+int server_client_transmission(const client_node *client, server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int cont;
+
+  if (!server_client_paced(client) && !client->bucket.transmission)
+    return 0;
+
+  if (client->reserved)
+    return 1;
+
+  for (cont = 0; cont < num_levels; cont++)
+    if (!server_rate_tokens(levels[cont]->shared))
+      return 0;
+
+  return 1;
+}
+
+/*! \brief Menor saldo entre os niveis acima da conexao do cliente
+ *
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ *
+ * \return 0 Caso algum nivel esteja esgotado
+ * \return tokens O saldo (INT_MAX sem niveis)
+ */
+static int server_client_level_tokens(const client_node *client,
+                                      server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int tokens = INT_MAX;
+  int cont;
+
+  for (cont = 0; cont < num_levels; cont++)
+  {
+    int level_tokens = server_rate_tokens(levels[cont]->shared);
+
+    if (!level_tokens)
+      return 0;
+
+    tokens = MIN(tokens, level_tokens);
+  }
+
+  return tokens;
+}
+
+/*! \brief Quantidade de bytes admitida em uma transferencia do cliente: o
+ * saldo da conexao, limitado a um maximo e ao que o cliente tem reservado ou
+ * disponivel nos niveis acima
+ *
+ * \param[in] limit Maximo da transferencia
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ *
+ * \return tokens A quantidade
+ */
+static int server_client_budget(int limit, const client_node *client,
+                                server *r_server)
+{
+  int tokens = server_client_paced(client) ? limit :
+               MIN(client->bucket.remain_tokens, limit);
+  int level_tokens = server_client_level_tokens(client, r_server);
+
+  if (INT_MAX == level_tokens)
+    return tokens;
+
+  return MIN(tokens, client->reserved + level_tokens);
+}
+
+/*! \brief Quantidade de bytes admitida na proxima transferencia do cliente
+ * pelo buffer
+ *
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ *
+ * \return tokens A quantidade, limitada a um buffer
+ */
+int server_client_tokens(const client_node *client, server *r_server)
+{
+  return server_client_budget(BUFFER_LEN, client, r_server);
+}
+
+/*! \brief Concede ao cliente tokens dos niveis acima da conexao, no
+ * limite do saldo de cada nivel. Outro reactor pode ter consumido o saldo
+ * desde a consulta: o excedente retirado de um nivel e' devolvido
+ *
+ * \param[in] tokens Tokens pedidos
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return granted Tokens concedidos
+ */
+static int server_client_grant(int tokens, client_node *client,
+                               server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int cont;
+
+  for (cont = 0; cont < num_levels && tokens; cont++)
+  {
+    int taken = server_rate_take(tokens, levels[cont]->shared);
+    int prev;
+
+    for (prev = 0; taken < tokens && prev < cont; prev++)
+      server_rate_deposit(tokens - taken, levels[prev]->shared);
+    tokens = taken;
+  }
+
+  if (num_levels)
+    client->reserved += tokens;
+
+  return tokens;
+}
+
+/*! \brief Reserva nos niveis acima da conexao os tokens de uma
+ * transferencia entregue as threads ou ao io_uring, descontando o que o
+ * cliente ja tem reservado. Sem a reserva, clientes com transferencias
+ * simultaneas usariam o mesmo saldo do nivel
+ *
+ * \param[in] tokens Tokens admitidos na transferencia
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_reserve(int tokens, client_node *client, server *r_server)
+{
+  if (tokens > client->reserved)
+    server_client_grant(tokens - client->reserved, client, r_server);
+}
+
+/*! \brief Retira os bytes transferidos de todos os niveis do cliente. Nos
+ * niveis acima da conexao, consome primeiro a reserva
+ *
+ * \param[in] bytes Bytes transferidos
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_withdraw(int bytes, client_node *client, server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int covered = MIN(bytes, client->reserved);
+  int cont;
+
+  if (!server_client_paced(client))
+    bucket_withdraw(bytes, &client->bucket);
+  client->reserved -= covered;
+
+  if (bytes == covered)
+    return;
+
+  for (cont = 0; cont < num_levels; cont++)
+    server_rate_withdraw(bytes - covered, levels[cont]->shared);
+}
+
+/*! \brief Devolve aos niveis a reserva nao usada pelo cliente
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_release(client_node *client, server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels;
+  int cont;
+
+  if (!client->reserved)
+    return;
+
+  num_levels = server_client_levels(client, r_server, levels);
+  for (cont = 0; cont < num_levels; cont++)
+    server_rate_deposit(client->reserved, levels[cont]->shared);
+
+  client->reserved = 0;
+}
+
+/*! \brief Agenda a espera do cliente sem tokens: pelo proprio bucket ou, em
+ * fila, pelo primeiro nivel esgotado
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+static void server_client_wait_tokens(client_node *client, server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int cont;
+
+  if (!server_client_paced(client) && !client->bucket.transmission)
+  {
+    if (!timer_wheel_pending(&client->refill_timer))
+      timer_wheel_add(server_bucket_refill_time(r_server->velocity,
+                                                &client->bucket,
+                                                client->burst_start,
+                                                r_server),
+                      &client->refill_timer, &r_server->timers);
+    return;
+  }
+
+  for (cont = 0; cont < num_levels; cont++)
+  {
+    rate_level *level = levels[cont];
+
+    if (server_rate_tokens(level->shared))
+      continue;
+
+    /* Com deficit restante, o cliente continua sua vez no escalonador */
+    if (BUFFER_LEN <= client->deficit)
+      client_queue_push_head(client, &level->waiting);
+    else
+      client_queue_push(client, &level->waiting);
+    if (!timer_wheel_pending(&level->refill_timer))
+      timer_wheel_add(server_rate_refill_time(level->shared, r_server),
+                      &level->refill_timer, &r_server->timers);
+    return;
+  }
+}
+
+/*! \brief Verifica se o cliente esta bloqueado por um nivel diferente do
+ * informado
+ *
+ * \param[in] client O cliente
+ * \param[in] level O nivel
+ * \param[in] r_server O servidor
+ *
+ * \return 1 Caso bloqueado por outro nivel
+ * \return 0 Caso contrario
+ */
+static int server_client_blocked_elsewhere(const client_node *client,
+                                           const rate_level *level,
+                                           server *r_server)
+{
+  rate_level *levels[RATE_LEVELS];
+  int num_levels = server_client_levels(client, r_server, levels);
+  int cont;
+
+  for (cont = 0; cont < num_levels; cont++)
+    if (levels[cont] != level && !server_rate_tokens(levels[cont]->shared))
+      return 1;
+
+  return 0;
+}
+
+/*! \brief Reparte os tokens de um nivel entre os clientes que o aguardam,
+ * por deficit round robin. A cada passagem, o cliente que iniciou sua vez
+ * recebe um quantum proporcional a seu peso, e as passagens se repetem ate
+ * esgotar o nivel. Quem termina a reserva com deficit restante volta ao
+ * inicio da fila (server_client_wait_tokens), continuando sua vez.
+ * Transferencias pequenas terminam em uma vez, e as grandes dividem o
+ * restante conforme os pesos
+ *
+ * \param[out] level O nivel
+ * \param[out] r_server O servidor
+ */
+static void server_level_schedule(rate_level *level, server *r_server)
+{
+  client_node *client;
+  client_node *next;
+  int granted = 1;
+
+  while (granted && server_rate_tokens(level->shared))
+  {
+    granted = 0;
+
+    for (client = level->waiting.head;
+         client && server_rate_tokens(level->shared); client = client->q_next)
+    {
+      int budget = server_client_level_tokens(client, r_server);
+      int grant;
+
+      if (!budget)
+        continue;
+
+      if (BUFFER_LEN > client->deficit)
+        client->deficit += client->weight * BUFFER_LEN;
+
+      grant = server_client_grant(MIN(client->deficit, budget), client,
+                                  r_server);
+      client->deficit -= grant;
+      granted |= 0 < grant;
+    }
+  }
+
+  for (client = level->waiting.head; client; client = next)
+  {
+    next = client->q_next;
+
+    /* Enquanto este nivel estiver esgotado, o cliente permanece aqui */
+    if (client->reserved)
+      server_client_set_ready(client, r_server);
+    else if (server_rate_tokens(level->shared) &&
+             server_client_blocked_elsewhere(client, level, r_server))
+    {
+      client_queue_remove(client);
+      server_client_wait_tokens(client, r_server);
+    }
+  }
+
+  if (level->waiting.size && !server_rate_tokens(level->shared) &&
+      !timer_wheel_pending(&level->refill_timer))
+    timer_wheel_add(server_rate_refill_time(level->shared, r_server),
+                    &level->refill_timer, &r_server->timers);
+}
+
+/*! \brief Temporizador de recarga: o cliente sem tokens chegou ao fim de sua
+ * burst e volta a ser processado
+ *
+ * \param[in] entry O temporizador de recarga do cliente
+ * \param[out] arg O servidor
+ */
+static void server_client_refill(timer_entry *entry, void *arg)
+{
+  client_node *client = (client_node *) entry->data;
+  server *r_server = (server *) arg;
+
+  server_client_sync_bucket(client, r_server);
+  server_client_set_ready(client, r_server);
+}
+
+/*! \brief Temporizador de inatividade: fecha a conexao do cliente sem
+ * progresso por CLIENT_TIMEOUT segundos. Clientes aguardando as threads ou o
+ * io_uring tem o prazo renovado, pois nao podem ser liberados ainda
+ *
+ * \param[in] entry O temporizador de inatividade do cliente
+ * \param[out] arg O servidor
+ */
+static void server_client_expire(timer_entry *entry, void *arg)
+{
+  client_node *client = (client_node *) entry->data;
+  server *r_server = (server *) arg;
+
+  if (client->status & SIGNAL_WAIT)
+  {
+    server_client_touch(client, r_server);
+    return;
+  }
+
+  server_client_remove(&client, r_server);
+}
+
+/*! \brief Renova o prazo de inatividade do cliente
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_touch(client_node *client, server *r_server)
+{
+  int timeout = CLIENT_TIMEOUT;
+
+  /* Conexao persistente aguardando a proxima requisicao */
+  if (client->requests && READ_REQUEST == client->status && !client->pos_buf)
+    timeout = r_server->keepalive_timeout;
+
+  timer_wheel_add(r_server->now_ms + timeout * 1000LL,
+                  &client->idle_timer, &r_server->timers);
+}
+
+/*! \brief Coloca o cliente na fila de prontos, para ser processado na
+ * iteracao atual sem esperar uma nova notificacao do reactor
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+void server_client_set_ready(client_node *client, server *r_server)
+{
+  client->ready_events = server_client_interest(client);
+  client_queue_push(client, &r_server->ready_q);
+}
+
+/*! \brief Calcula os eventos de interesse do cliente a partir de seu estado e
+ * atualiza o registro no reactor somente quando houver mudanca. Clientes
+ * aguardando as threads ficam fora do reactor e clientes sem tokens aguardam
+ * o temporizador de recarga
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+int server_client_update_events(client_node *client, server *r_server)
+{
+  unsigned int events = 0;
+  int ret = 0;
+
+  if (!(client->status & SIGNAL_WAIT))
+  {
+    if (server_client_transmission(client, r_server))
+      events = server_client_interest(client);
+    else
+      server_client_wait_tokens(client, r_server);
+  }
+
+  if (events == client->ev_mask)
+    return 0;
+
+  if (!client->ev_mask)
+    ret = reactor_add(client->sockfd, events, client, &r_server->ev_loop);
+  else if (!events)
+    ret = reactor_del(client->sockfd, &r_server->ev_loop);
+  else
+    ret = reactor_mod(client->sockfd, events, client, &r_server->ev_loop);
+
+  if (0 > ret)
     return -1;
 
-  connfd = accept(r_server->listenfd, (struct sockaddr *) &cliaddr, 
-                  &cli_length); 
-  if (0 > connfd)
-    return -1;
+  client->ev_mask = events;
+  return 0;
+}
+
+/*! \brief Atualiza as estatisticas de accept com o lote da acordada atual
+ *
+ * \param[in] num_accepted Conexoes aceitas na acordada
+ * \param[out] stats As estatisticas
+ */
+static void server_upd_accept_stats(int num_accepted, server_stats *stats)
+{
+  int hist_pos = 0;
+
+  stats->accept_wakeups++;
+  stats->accepted += num_accepted;
+  stats->accept_last = num_accepted;
+  stats->accept_max = MAX(stats->accept_max, num_accepted);
+
+  while (num_accepted >>= 1)
+    hist_pos++;
+  stats->accept_hist[hist_pos]++;
+}
+
+/*! \brief Aceita, em lote limitado por ACCEPT_BATCH, as conexoes pendentes
+ * no backlog e aloca os clientes de uma so vez
+ *
+ * \param[in] r_server A estrutura servidor para a conexao de um cliente
+ *
+ * \return -1 caso aconteça algum erro
+ * \return num_accepted Numero de conexoes aceitas
+ */
+int server_make_connection(server *r_server)
+{
+  int connfds[ACCEPT_BATCH];
+  struct sockaddr_in addrs[ACCEPT_BATCH];
+  client_node *new_clients[ACCEPT_BATCH];
+  int num_accepted = 0;
+  int cont;
+
+  while (num_accepted < ACCEPT_BATCH)
+  {
+    socklen_t addr_len = sizeof(addrs[num_accepted]);
+    int connfd = accept4(r_server->listenfd,
+                         (struct sockaddr *) &addrs[num_accepted], &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (0 > connfd)
+    {
+      if (EINTR == errno)
+        continue;
+
+      break;
+    }
+
+    /* Select nao pode monitorar sockets alem de FD_SETSIZE */
+    if (!reactor_fd_allowed(connfd, &r_server->ev_loop))
+    {
+      close(connfd);
+      continue;
+    }
+
+    connfds[num_accepted++] = connfd;
+  }
+
+  if (!num_accepted)
+    return 0;
+
+  if (0 > client_node_allocate_batch(connfds, num_accepted, new_clients))
+  {
+    for (cont = 0; cont < num_accepted; cont++)
+      close(connfds[cont]);
+    return -1;
+  }
+
+  server_upd_accept_stats(num_accepted, &r_server->stats);
+
+  for (cont = 0; cont < num_accepted; cont++)
+  {
+    client_node *new_client = new_clients[cont];
+
+    client_node_append(new_client, &r_server->l_clients);
+    server_bucket_init(r_server->velocity, server_bucket_depth(r_server),
+                       &new_client->bucket, &new_client->burst_start,
+                       r_server);
+    new_client->status = READ_REQUEST;
+    new_client->weight = 1;
+    if (PACING_BUCKET == r_server->b_mode)
+      server_client_set_pacing(new_client, r_server);
+    timer_entry_init(server_client_refill, new_client,
+                     &new_client->refill_timer);
+    timer_entry_init(server_client_expire, new_client,
+                     &new_client->idle_timer);
+    server_client_touch(new_client, r_server);
+
+    if ((r_server->ip_rate &&
+         !(new_client->ip = server_ip_get(addrs[cont].sin_addr.s_addr,
+                                          r_server))) ||
+        0 > server_client_update_events(new_client, r_server))
+      server_client_remove(&new_client, r_server);
+  }
+
+  return num_accepted;
+}
+
+/*! \brief Libera os arquivos da requisicao atual do cliente: devolve o do
+ * GET ao cache, fecha os do PUT e conclui a substituicao do recurso
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro na lista de arquivos em uso
+ * \return 0 Caso ok
+ */
+static int server_client_close_files(client_node *client, server *r_server)
+{
+  int ret;
+
+  /* Com o temporario ainda aberto, para que o sem nome possa ser ligado */
+  if (client->put_path)
+  {
+    server_put_finish(client, r_server);
+    free(client->put_path);
+    client->put_path = NULL;
+    client->put_anon = 0;
+  }
 
-  if (!(new_client = client_node_allocate(connfd)))
+  if (client->cached)
   {
-    close(connfd);
-    return -1;
+    file_cache_put(client->cached, &r_server->f_cache);
+    client->cached = NULL;
+    client->file_fd = -1;
+  }
+  if (client->file)
+  {
+    fclose(client->file);
+    client->file = NULL;
+  }
+  if (0 <= client->file_fd)
+  {
+    close(client->file_fd);
+    client->file_fd = -1;
+  }
+  if (0 <= client->pipe_fds[0])
+  {
+    close(client->pipe_fds[0]);
+    close(client->pipe_fds[1]);
+    client->pipe_fds[0] = -1;
+    client->pipe_fds[1] = -1;
   }
 
-  client_node_append(new_client, &r_server->l_clients);
-  bucket_init(r_server->velocity, &new_client->bucket);
-  new_client->status = READ_REQUEST;
+  ret = server_upd_ufile_info(client);
+  client->used_file = NULL;
+  return ret;
+}
+
+/*! \brief Conclui a resposta ao cliente. Em uma conexao persistente, o
+ * cliente volta a aguardar uma requisicao, com o mesmo socket e buffer; caso
+ * contrario, ou se o corpo enviado ficou menor que o Content-Length, a
+ * conexao e' fechada
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso a conexao tenha sido fechada
+ * \return 0 Caso o cliente aguarde nova requisicao
+ */
+int server_client_finish(client_node *client, server *r_server)
+{
+  if (!client->keep_alive ||
+      (OK == client->resp_status && GET == client->method &&
+       client->file_offset < client->file_size) ||
+      0 > server_client_close_files(client, r_server))
+  {
+    server_client_remove(&client, r_server);
+    return -1;
+  }
 
-  r_server->maxfd_number = MAX(connfd, r_server->maxfd_number);
+  client_queue_remove(client);
+  timer_wheel_del(&client->refill_timer, &r_server->timers);
+  server_client_release(client, r_server);
+
+  /* A proxima requisicao pode ja ter chegado junto a atual */
+  memset(client->buffer, 0, REQUEST_SIZE);
+  memcpy(client->buffer, PIPELINE_BUF(client), client->pipelined);
+  client->pos_buf = client->pipelined;
+  client->pos_header = 0;
+  http_parser_init(&client->parser);
+  client->b_to_transfer = 0;
+  client->task_st = 0;
+  client->method = GET;
+  client->protocol = HTTP10;
+  client->resp_status = 0;
+  client->file_size = 0;
+  client->file_offset = 0;
+  client->content_len = 0;
+  client->body_len = 0;
+  client->keep_alive = 0;
+  client->uring_ops = 0;
+  client->weight = 1;
+  client->deficit = 0;
+  client->status = READ_REQUEST;
+  server_client_touch(client, r_server);
+
+  /* Sem esperar o socket, que pode nao receber mais nada */
+  if (client->pipelined)
+  {
+    r_server->stats.pipelined++;
+    client->pipelined = 0;
+    server_client_set_ready(client, r_server);
+  }
 
   return 0;
 }
@@ -618,7 +2179,16 @@ int server_client_remove(client_node **cur_client, server *r_server)
   client_remove = *cur_client;
   *cur_client = (*cur_client)->next;
 
-  if (0 > server_upd_ufile_info(client_remove, r_server) ||
+  client_queue_remove(client_remove);
+  timer_wheel_del(&client_remove->refill_timer, &r_server->timers);
+  timer_wheel_del(&client_remove->idle_timer, &r_server->timers);
+  server_client_release(client_remove, r_server);
+  if (client_remove->ip)
+    server_ip_put(client_remove->ip, r_server);
+  if (client_remove->ev_mask)
+    reactor_del(client_remove->sockfd, &r_server->ev_loop);
+
+  if (0 > server_client_close_files(client_remove, r_server) ||
       0 > client_node_pop(client_remove, &r_server->l_clients))
     return -1;
   
@@ -627,31 +2197,149 @@ int server_client_remove(client_node **cur_client, server *r_server)
   return 0;
 }
 
-/*! \brief Procedimentos para inicializacao do servidor: inicializa variaveis,
- * cria os sockets e inicia o pool de threads
+/*! \brief Passa a observar a raiz atual do servidor, descartando os
+ * arquivos e recursos resolvidos da raiz anterior. Alteracoes feitas fora do
+ * servidor invalidam somente as entradas afetadas do cache. Se a raiz nao puder ser
+ * observada, os recursos sao resolvidos a cada requisicao e os arquivos do
+ * cache conferidos no disco a cada uso
+ *
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro no reactor
+ * \return 0 Caso ok
+ */
+static int server_watch_root(server *r_server)
+{
+  if (0 <= r_server->watch.fd)
+  {
+    reactor_del(r_server->watch.fd, &r_server->ev_loop);
+    fs_watch_destroy(&r_server->watch);
+  }
+
+  file_cache_flush(&r_server->f_cache);
+  r_server->f_cache.validate = 1;
+
+  if (0 > fs_watch_init(r_server->serv_root, &r_server->watch))
+    return 0;
+
+  if (0 > reactor_add(r_server->watch.fd, EV_READ, &r_server->watch,
+                      &r_server->ev_loop))
+  {
+    fs_watch_destroy(&r_server->watch);
+    return -1;
+  }
+
+  /* As alteracoes na raiz passam a invalidar o cache */
+  r_server->f_cache.validate = 0;
+  return 0;
+}
+
+/*! \brief Temporizador do ajuste automatico do pool de threads
+ *
+ * \param[in] entry O temporizador do pool
+ * \param[out] arg O servidor
+ */
+static void server_pool_scale(timer_entry *entry, void *arg)
+{
+  server *r_server = (server *) arg;
+
+  threadpool_scale((threadpool *) entry->data);
+  timer_wheel_add(r_server->now_ms + POOL_SCALE_MS, entry,
+                  &r_server->timers);
+}
+
+/*! \brief Agenda o ajuste automatico do pool somente quando os limites o
+ * permitem
  *
- * \param[in] argc Numero de argumentos recebidos na funcao main
- * \param[in] argv Os argumentos recebidos na chamada da funcao main
+ * \param[out] r_server O servidor
+ */
+static void server_pool_schedule(server *r_server)
+{
+  if (r_server->min_workers == r_server->max_workers)
+    timer_wheel_del(&r_server->pool_timer, &r_server->timers);
+  else if (!timer_wheel_pending(&r_server->pool_timer))
+    timer_wheel_add(r_server->now_ms + POOL_SCALE_MS, &r_server->pool_timer,
+                    &r_server->timers);
+}
+
+/*! \brief Procedimentos para inicializacao de um reactor do servidor: copia
+ * a configuracao do modelo, cria os sockets e inicia o pool de threads. Cada
+ * reactor tem seu proprio socket de escuta, lista de clientes e canal de
+ * sinalizacao das threads
+ *
+ * \param[in] reactor_id O indice do reactor
+ * \param[in] model Configuracao extraida por server_parse_arguments
  * \param[out] r_server A estrutura a ser inicializada
  *
  * \return 0 Caso ok
  * \return -1 Caso haja algum erro
  */
-int server_init(int argc, const char **argv, server *r_server)
+int server_init(int reactor_id, const server *model, server *r_server)
 {
-  memset(r_server, 0, sizeof(*r_server));
-  r_server->maxfd_number = -1;
+  int reuse_port;
+
+  *r_server = *model;
+  r_server->reactor_id = reactor_id;
+  r_server->watch.fd = -1;
+  reuse_port = 1 < r_server->num_reactors;
 
-  if (0 > server_parse_arguments(argc, argv, r_server) ||
-      0 > (r_server->listenfd = server_create_listenfd(r_server->listen_port)) ||
-      0 > (r_server->l_socket = server_create_local_socket()) ||
-      0 > threadpool_init(LSOCK_NAME, &r_server->thread_pool) ||
-      0 > server_write_pid_file())
+  if (0 > server_update_clock(r_server))
     return -1;
-  
+  timer_wheel_init(r_server->now_ms, &r_server->timers);
+  file_cache_init(r_server->content_max, r_server->map_min,
+                  &r_server->f_cache);
+  server_load_config(r_server);
+
+  /* Estado comum aos reactors: o limite global, um bucket unico consumido
+   * por todos, e os temporarios de PUTs de uma execucao interrompida */
+  if (!reactor_id)
+  {
+    server_rate_init(r_server->global_rate, &global_bucket, r_server);
+    server_remove_put_tmp(r_server->serv_root);
+  }
+  server_level_init(r_server->global_rate ? &global_bucket : NULL,
+                    &r_server->global_level);
+
+  if (0 > reactor_init(r_server->backend, &r_server->ev_loop) ||
+      0 > (r_server->listenfd = server_create_listenfd(r_server->listen_port,
+                                                       reuse_port)) ||
+      0 > reactor_add(r_server->listenfd, EV_READ, &r_server->listenfd,
+                      &r_server->ev_loop) ||
+      0 > threadpool_init(r_server->min_workers, r_server->max_workers,
+                          &r_server->thread_pool) ||
+      0 > reactor_add(r_server->thread_pool.event_fd, EV_READ,
+                      &r_server->thread_pool, &r_server->ev_loop) ||
+      (!reactor_id && 0 > server_write_pid_file()) ||
+      0 > server_watch_root(r_server))
+    return -1;
+
+  timer_entry_init(server_pool_scale, &r_server->thread_pool,
+                   &r_server->pool_timer);
+  server_pool_schedule(r_server);
+
+  /* Sem suporte a io_uring no kernel, usa o pool de threads */
+  if (URING_ENGINE == r_server->engine)
+  {
+    if (0 > uring_init(URING_ENTRIES, &r_server->ring))
+      r_server->engine = THREAD_ENGINE;
+    else if (0 > reactor_add(r_server->ring.ring_fd, EV_READ, &r_server->ring,
+                             &r_server->ev_loop))
+      return -1;
+  }
+
   return 0;
 }
 
+/*! \brief Acorda o reactor que esteja bloqueado esperando eventos, pelo
+ * event_fd do seu pool de threads
+ *
+ * \param[out] r_server O reactor
+ */
+void server_wakeup(server *r_server)
+{
+  threadpool_wakeup(&r_server->thread_pool);
+}
+
 /*! \brief Funcao que recebe a mensagem e coloca em um buffer
  *
  * \param[in] bytes_to_read Quantidade de bytes a serem lidos
@@ -669,7 +2357,11 @@ int server_recv_client_request(int bytes_to_receive,
 
   if (!cur_client->buffer)
   {
-    cur_client->buffer = (char *) calloc(BUFFER_LEN, sizeof(char));
+    /* Alem do buffer de dados, espaco para a proxima requisicao. A
+     * requisicao ocupa no maximo REQUEST_SIZE bytes, entao a analise pode
+     * ler HTTP_PARSER_PAD bytes apos ela */
+    cur_client->buffer = (char *) calloc(BUFFER_LEN + REQUEST_SIZE,
+                                         sizeof(char));
     if (!cur_client->buffer)
       return -1;
   }
@@ -686,31 +2378,45 @@ int server_recv_client_request(int bytes_to_receive,
     
     return -1;
   }
+
+  /* Conexao fechada antes do fim da requisicao */
+  if (!bytes_received && bytes_to_receive)
+    return -1;
   
   cur_client->pos_buf += bytes_received;
   return 0; 
 }
 
 /*! \brief Verifica entrada de dados do client e determina quando a 
- *  mensagem chegou ao fim
+ *  mensagem chegou ao fim. Uma requisicao recebida junto a anterior
+ *  (pipelining) ja esta completa no buffer e dispensa o socket
  *
  * \param[out] client A estrutura de _client
  */
 int server_read_client_request(client_node *client)
 {
   int bytes_to_receive;
-  char *pos_header;
+  int complete;
 
   if (!(client->status & READ_REQUEST))
     return 0;
 
-  bytes_to_receive = REQUEST_SIZE - client->pos_buf - 1;
-  if (0 > server_recv_client_request(bytes_to_receive, client))
-    return -1;
+  complete = http_parser_execute(client->buffer, client->pos_buf,
+                                 &client->parser);
+
+  if (!complete)
+  {
+    bytes_to_receive = REQUEST_SIZE - client->pos_buf - 1;
+    if (0 > server_recv_client_request(bytes_to_receive, client))
+      return -1;
+
+    complete = http_parser_execute(client->buffer, client->pos_buf,
+                                   &client->parser);
+  }
 
-  if ((pos_header = server_verify_double_line(client->buffer)))
+  if (complete)
   {
-    client->pos_header = pos_header - client->buffer;
+    client->pos_header = client->parser.header_end;
     client->status &= (~READ_REQUEST);
     client->status |= REQUEST_RECEIVED;
   }
@@ -718,6 +2424,149 @@ int server_read_client_request(client_node *client)
   return 0; 
 }
 
+/*! \brief Peso do recurso no escalonador: o do maior prefixo configurado
+ * que o contem, ou 1
+ *
+ * \param[in] resource O recurso
+ * \param[in] r_server O servidor
+ *
+ * \return weight O peso
+ */
+static int server_resource_weight(const char *resource,
+                                  const server *r_server)
+{
+  size_t best_len = 0;
+  int weight = 1;
+  int cont;
+
+  for (cont = 0; cont < r_server->num_weights; cont++)
+  {
+    const path_weight *p_weight = &r_server->weights[cont];
+    size_t len = strlen(p_weight->prefix);
+
+    if (len >= best_len && !strncmp(resource, p_weight->prefix, len))
+    {
+      best_len = len;
+      weight = p_weight->weight;
+    }
+  }
+
+  return weight;
+}
+
+/*! \brief Inicia a contagem do corpo do PUT com os bytes que chegaram junto
+ * ao header, descartando o que exceder o Content-Length
+ *
+ * \param[out] client O cliente
+ */
+static void server_client_body_start(client_node *client)
+{
+  client->content_len = client->parser.content_length;
+  client->body_len = client->pos_buf - client->pos_header;
+
+  if (0 > client->content_len)
+    return;
+
+  if (client->body_len >= client->content_len)
+  {
+    client->pos_buf = client->pos_header + client->content_len;
+    client->body_len = client->content_len;
+    client->status |= (WRITE_DATA | WRITE_HEADER);
+  }
+}
+
+/*! \brief Contabiliza bytes recebidos do corpo do PUT e identifica o fim do
+ * upload: pelo Content-Length ou, sem ele, por uma leitura menor que a
+ * pedida. O fechamento da conexao tambem encerra o upload
+ *
+ * \param[in] bytes Bytes recebidos
+ * \param[in] requested Bytes pedidos na leitura
+ * \param[out] client O cliente
+ */
+static void server_client_body_received(int bytes, int requested,
+                                        client_node *client)
+{
+  client->body_len += bytes;
+
+  if (!bytes || (0 <= client->content_len ?
+                 client->body_len >= client->content_len : bytes < requested))
+    client->status |= (WRITE_DATA | WRITE_HEADER);
+}
+
+/*! \brief Quantidade de bytes do corpo do PUT admitida na proxima leitura:
+ * a dos tokens, sem passar do Content-Length
+ *
+ * \param[in] limit Maximo da leitura
+ * \param[in] client O cliente
+ * \param[in] r_server O servidor
+ *
+ * \return bytes A quantidade
+ */
+static int server_client_body_budget(int limit, const client_node *client,
+                                     server *r_server)
+{
+  int tokens = server_client_budget(limit, client, r_server);
+
+  if (0 > client->content_len)
+    return tokens;
+
+  return (int) MIN((long long) tokens,
+                   client->content_len - client->body_len);
+}
+
+/*! \brief Decide se a conexao continua apos a resposta: por padrao no
+ * HTTP/1.1 e com "Connection: keep-alive" no HTTP/1.0, ate o limite de
+ * requisicoes por conexao. Fecha se a requisicao for invalida ou se um corpo
+ * ficar sem ser lido ou sem fim conhecido
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+static void server_client_keep_alive(client_node *client, server *r_server)
+{
+  const http_span connection = client->parser.connection;
+
+  if (client->requests++)
+    r_server->stats.reused++;
+
+  if (HTTP11 == client->protocol)
+    client->keep_alive = !http_span_starts(client->buffer, connection,
+                                           "close");
+  else
+    client->keep_alive = http_span_starts(client->buffer, connection,
+                                          "keep-alive");
+
+  if (client->requests >= r_server->keepalive_max ||
+      (OK != client->resp_status && NOT_FOUND != client->resp_status &&
+       FORBIDDEN != client->resp_status) ||
+      (PUT == client->method &&
+       (OK != client->resp_status || 0 > client->content_len)))
+    client->keep_alive = 0;
+}
+
+/*! \brief Guarda os bytes recebidos apos a requisicao (e o corpo do PUT
+ * contido no buffer), inicio da proxima requisicao da conexao. Ficam em
+ * PIPELINE_BUF, fora da area usada pela resposta
+ *
+ * \param[in] received Bytes no buffer antes da analise da requisicao
+ * \param[out] client O cliente
+ */
+static void server_client_stash_next(int received, client_node *client)
+{
+  int req_end = client->pos_header;
+
+  if (PUT == client->method)
+    req_end += client->body_len;
+
+  if (!client->keep_alive || received <= req_end)
+    return;
+
+  client->pipelined = received - req_end;
+  memcpy(PIPELINE_BUF(client), client->buffer + req_end, client->pipelined);
+  if (GET == client->method)
+    client->pos_buf = req_end;
+}
+
 /* \brief Faz analise da mensagem para identificar o metodo,o procotolo e o
  * recurso solicitado, além de alocar uso do arquivo caso seja metodo PUT
  *
@@ -729,16 +2578,15 @@ int server_read_client_request(client_node *client)
  */
 int server_verify_request(server *r_server, client_node *client)
 {
-  char method[METHOD_LEN + 1];
   char resource[RESOURCE_LEN + 1];
-  char protocol[PROTOCOL_LEN + 1];
+  int received = client->pos_buf;
 
   if (!(client->status & REQUEST_RECEIVED))
     return 0;
 
-  server_extr_req_params(client, method, resource, protocol);
-  server_verify_cli_protocol(protocol, client);
-  server_verify_cli_method(method, client);
+  server_verify_cli_request_line(resource, client);
+  client->weight = server_resource_weight(resource, r_server);
+  client->deficit = 0;
   server_verify_cli_resource(resource, r_server, client);
 
   client->status &= (~REQUEST_RECEIVED);
@@ -746,13 +2594,18 @@ int server_verify_request(server *r_server, client_node *client)
   if (client->resp_status == OK)
   {
     if (client->method == PUT)
+    {
       client->status |= READ_DATA;
+      server_client_body_start(client);
+    }
     else
       client->status |= (WRITE_HEADER | WRITE_DATA);
   }
   else
     client->status |= (WRITE_HEADER | WRITE_DATA);
 
+  server_client_keep_alive(client, r_server);
+  server_client_stash_next(received, client);
   return 0;
 }
 
@@ -767,19 +2620,21 @@ void server_read_file(void *c_client)
   int bytes_read;
 
   char *buffer = client->buffer;
-  FILE *file = client->file;
   int *pos_buf = &client->pos_buf;
   int b_to_transfer = client->b_to_transfer;
   task_status *task_st = &client->task_st;
 
-  if (0 >= (bytes_read = fread(buffer, sizeof(char), 
-                               b_to_transfer, file)))
+  /* O descritor e' compartilhado: le na posicao do proprio cliente */
+  if (0 >= (bytes_read = pread(client->file_fd, buffer, b_to_transfer,
+                               client->file_offset)))
     *task_st = ERROR;
   else 
   {
     *pos_buf = bytes_read;
+    client->file_offset += bytes_read;
 
-    if (b_to_transfer > bytes_read) 
+    if (b_to_transfer > bytes_read ||
+        client->file_offset >= client->file_size)
       *task_st = FINISHED;
     else
       *task_st = MORE_DATA;
@@ -813,6 +2668,136 @@ void server_write_file(void *c_client)
   }
 }
 
+/*! \brief Coloca uma operacao de um cliente no anel de submissao do
+ * io_uring. A submissao efetiva ocorre em lote, em server_uring_flush
+ *
+ * \param[in] op A operacao (URING_READ, URING_SEND, URING_RECV ou URING_WRITE)
+ * \param[in] len Quantidade de bytes da operacao
+ * \param[in] link Liga a proxima operacao a esta (IOSQE_IO_LINK)
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+static void server_uring_queue(int op, unsigned int len, int link,
+                               client_node *client, server *r_server)
+{
+  static const int opcodes[] = {IORING_OP_READ, IORING_OP_SEND,
+                                IORING_OP_RECV, IORING_OP_WRITE};
+  struct io_uring_sqe *sqe = uring_get_sqe(&r_server->ring);
+  int fd = client->sockfd;
+  char *buf = client->buffer;
+  unsigned long long offset = 0;
+
+  if (URING_READ == op || URING_WRITE == op)
+  {
+    fd = URING_READ == op ? client->file_fd : fileno(client->file);
+    offset = client->file_offset;
+  }
+
+  if (URING_WRITE == op)
+    buf += client->pos_header;
+
+  uring_prep_rw(opcodes[op], fd, buf, len, offset,
+                (unsigned long long) (uintptr_t) client | op, sqe);
+
+  if (URING_SEND == op || URING_RECV == op)
+    sqe->msg_flags = MSG_NOSIGNAL;
+  if (link)
+    sqe->flags |= IOSQE_IO_LINK;
+
+  client->uring_inflight++;
+  client->uring_ops |= URING_BIT(op);
+}
+
+/*! \brief Inicia um lote de operacoes no io_uring para o cliente
+ *
+ * \param[in] num_ops Numero de operacoes do lote
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso nao haja espaco no anel de submissao
+ * \return 0 Caso ok
+ */
+static int server_uring_begin(unsigned num_ops, client_node *client,
+                              server *r_server)
+{
+  if (0 > uring_reserve(num_ops, &r_server->ring))
+    return -1;
+
+  client->uring_ops = 0;
+  client->task_st = MORE_DATA;
+  client->status |= SIGNAL_WAIT;
+  return 0;
+}
+
+/*! \brief Recebe o corpo do PUT com splice, do socket para o arquivo
+ * atraves do pipe do cliente, na quantidade admitida pelos tokens. O corpo
+ * que chegou junto ao header e' escrito antes. Executado no reactor, sem
+ * threads nem buffer
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+static int server_splice_data(client_node *client, server *r_server)
+{
+  int b_to_receive;
+  ssize_t b_moved;
+
+  while (client->pos_header < client->pos_buf)
+  {
+    if (0 > (b_moved = write(client->file_fd,
+                             client->buffer + client->pos_header,
+                             client->pos_buf - client->pos_header)))
+    {
+      if (EINTR == errno)
+        continue;
+
+      return -1;
+    }
+
+    client->pos_header += b_moved;
+  }
+  client->pos_buf = 0;
+  client->pos_header = 0;
+
+  if (client->status & WRITE_DATA ||
+      !server_client_transmission(client, r_server))
+    return 0;
+
+  b_to_receive = server_client_body_budget(PIPE_LEN, client, r_server);
+  if (0 > (b_moved = splice(client->sockfd, NULL, client->pipe_fds[1], NULL,
+                            b_to_receive, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)))
+  {
+    if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)
+      return 0;
+
+    return -1;
+  }
+
+  server_client_withdraw(b_moved, client, r_server);
+  server_client_body_received(b_moved, b_to_receive, client);
+
+  /* O pipe e' esvaziado a cada leitura, entao sempre cabe um PIPE_LEN */
+  while (0 < b_moved)
+  {
+    ssize_t b_written = splice(client->pipe_fds[0], NULL, client->file_fd,
+                               NULL, b_moved, SPLICE_F_MOVE);
+    if (0 > b_written)
+    {
+      if (EINTR == errno)
+        continue;
+
+      return -1;
+    }
+
+    b_moved -= b_written;
+  }
+
+  return 0;
+}
+
 /* \brief Realiza verificacoes para a escrita do arquivo e coloca a tarefa no
  * pool de threads
  *
@@ -834,6 +2819,43 @@ int server_process_write_file(client_node *client, server *r_server)
   if (client->status & WRITE_HEADER && !(client->status & READ_DATA))
     return 0;
 
+  if (URING_ENGINE == r_server->engine)
+  {
+    int b_to_receive;
+
+    /* Corpo que chegou junto ao header e' escrito antes de novos recv */
+    if (client->pos_header < client->pos_buf)
+    {
+      if (0 > server_uring_begin(1, client, r_server))
+        return -1;
+
+      server_uring_queue(URING_WRITE, client->pos_buf - client->pos_header, 0,
+                         client, r_server);
+      return 0;
+    }
+
+    if (client->status & WRITE_DATA ||
+        !server_client_transmission(client, r_server))
+      return 0;
+
+    b_to_receive = server_client_body_budget(BUFFER_LEN, client, r_server);
+    server_client_reserve(b_to_receive, client, r_server);
+    client->b_to_transfer = b_to_receive;
+    client->pos_buf = 0;
+    client->pos_header = 0;
+
+    /* Sem ligar a escrita: um recv curto nao cancela a cadeia e a escrita
+     * gravaria o buffer inteiro. O recebido e' escrito ao fim do lote */
+    if (0 > server_uring_begin(1, client, r_server))
+      return -1;
+
+    server_uring_queue(URING_RECV, b_to_receive, 0, client, r_server);
+    return 0;
+  }
+
+  if (0 <= client->file_fd)
+    return server_splice_data(client, r_server);
+
   if(0 != threadpool_add(server_write_file, client,
                          &r_server->thread_pool))
     return -1;
@@ -842,6 +2864,41 @@ int server_process_write_file(client_node *client, server *r_server)
   return 0;
 }
 
+/*! \brief Envia o arquivo do cliente com sendfile, do page cache direto ao
+ * socket, na quantidade admitida pelos tokens. Executado no reactor, sem
+ * threads nem buffer
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+static int server_sendfile_data(client_node *client, server *r_server)
+{
+  int b_to_send = (int) MIN((off_t) server_client_budget(SENDFILE_CHUNK,
+                                                         client, r_server),
+                            client->file_size - client->file_offset);
+  ssize_t b_sent;
+
+  if (0 > (b_sent = sendfile(client->sockfd, client->file_fd,
+                             &client->file_offset, b_to_send)))
+  {
+    if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)
+      return 0;
+
+    return -1;
+  }
+
+  server_client_withdraw(b_sent, client, r_server);
+
+  /* Envio vazio: o arquivo diminuiu desde a abertura */
+  if (!b_sent || client->file_offset >= client->file_size)
+    client->status = FINISHED;
+
+  return 0;
+}
+
 /* \brief Realiza verificacoes para a leitura do arquivo e coloca a tarefa no
  * pool de threads
  *
@@ -858,14 +2915,31 @@ int server_process_read_file(client_node *client, server *r_server)
 
   not_accept_flags = PENDING_DATA | FINISHED | SIGNAL_WAIT;
 
-  if (client->status & not_accept_flags || !client->bucket.transmission)
+  if (client->status & not_accept_flags ||
+      !server_client_transmission(client, r_server) ||
+      (client->cached && client->cached->data))
     return 0;
+
+  if (SENDFILE_ENGINE == r_server->engine)
+    return server_sendfile_data(client, r_server);
   
-  bytes_to_read = BUFFER_LEN;
-  if (client->bucket.remain_tokens < BUFFER_LEN)
-    bytes_to_read = client->bucket.remain_tokens;
+  /* Nao passa do tamanho anunciado, mesmo que o arquivo tenha crescido */
+  bytes_to_read = (int) MIN((off_t) server_client_tokens(client, r_server),
+                            client->file_size - client->file_offset);
+  server_client_reserve(bytes_to_read, client, r_server);
   client->b_to_transfer = bytes_to_read;
 
+  /* Leitura do arquivo ligada ao envio do mesmo buffer */
+  if (URING_ENGINE == r_server->engine)
+  {
+    if (0 > server_uring_begin(2, client, r_server))
+      return -1;
+
+    server_uring_queue(URING_READ, bytes_to_read, 1, client, r_server);
+    server_uring_queue(URING_SEND, bytes_to_read, 0, client, r_server);
+    return 0;
+  }
+
   if(0 != threadpool_add(server_read_file, client, 
                          &r_server->thread_pool))
     return -1;
@@ -877,11 +2951,14 @@ int server_process_read_file(client_node *client, server *r_server)
 /*! \brief Recebe uma mensagem e armazenada em um buffer
 *
  * \param[in] cur_client Variavel que armazena informacoes do cliente
+ * \param[in] r_server O servidor
  *
  * \return 0 Caso OK
  * \return -1 Caso haja erro
+ *
+ * \note Com io_uring, o recv e' submetido em server_process_write_file
  */
-int server_recv_response(client_node *client)
+int server_recv_response(client_node *client, server *r_server)
 {
   int b_received;
   int b_to_receive;
@@ -889,13 +2966,13 @@ int server_recv_response(client_node *client)
 
   not_accept_flags = FINISHED | SIGNAL_WAIT;
 
-  if (client->status & not_accept_flags || !client->bucket.transmission ||
-      client->pos_header || GET == client->method)
+  if (client->status & not_accept_flags ||
+      !server_client_transmission(client, r_server) ||
+      client->pos_header || GET == client->method ||
+      URING_ENGINE == r_server->engine || 0 <= client->file_fd)
     return 0;
 
-  b_to_receive = BUFFER_LEN;
-  if (client->bucket.remain_tokens < BUFFER_LEN)
-    b_to_receive = client->bucket.remain_tokens;
+  b_to_receive = server_client_body_budget(BUFFER_LEN, client, r_server);
   client->b_to_transfer = b_to_receive;
 
   if(0 > (b_received = recv(client->sockfd, client->buffer, b_to_receive,
@@ -910,26 +2987,89 @@ int server_recv_response(client_node *client)
     return -1;
   }
 
-  bucket_withdraw(b_received, &client->bucket);
+  server_client_withdraw(b_received, client, r_server);
   client->status &= (~PENDING_DATA);
   client->pos_buf = b_received;
+  server_client_body_received(b_received, b_to_receive, client);
+
+  return 0;
+}
+
+/*! \brief Envia a resposta de um arquivo com conteudo no cache: o header do
+ * cliente e o corpo em memoria (copia ou mapeamento), juntos em um sendmsg,
+ * direto do reactor
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso ok
+ */
+static int server_send_cached(client_node *client, server *r_server)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t b_sent;
+  int header_sent;
+  int body_len = 0;
+
+  if (server_client_transmission(client, r_server))
+    body_len = (int) MIN((off_t) server_client_budget(SENDFILE_CHUNK, client,
+                                                      r_server),
+                         client->file_size - client->file_offset);
+
+  if (!client->pos_buf && !body_len)
+    return 0;
 
-  if (b_received < b_to_receive)
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = client->buffer;
+  iov[0].iov_len = client->pos_buf;
+  iov[1].iov_base = client->cached->data + client->file_offset;
+  iov[1].iov_len = body_len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  if (0 > (b_sent = sendmsg(client->sockfd, &msg,
+                            MSG_NOSIGNAL | MSG_DONTWAIT)))
   {
-    client->status |= (WRITE_DATA | WRITE_HEADER);
+    if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)
+      return 0;
+
+    return -1;
+  }
+
+  server_client_withdraw(b_sent, client, r_server);
+
+  /* Header enviado em parte: o restante vai na proxima chamada */
+  header_sent = MIN(b_sent, client->pos_buf);
+  if (header_sent < client->pos_buf)
+  {
+    memmove(client->buffer, client->buffer + header_sent,
+            client->pos_buf - header_sent);
+    client->pos_buf -= header_sent;
+    return 0;
   }
 
+  client->pos_buf = 0;
+  file_entry_advise(client->cached, client->file_offset,
+                    client->file_offset + b_sent - header_sent);
+  client->file_offset += b_sent - header_sent;
+  server_process_cli_status(client);
+  if (client->file_offset >= client->file_size)
+    client->status = FINISHED;
+
   return 0;
 }
 
 /*! \brief Manda uma resposta armazenada em um buffer  para um cliente
  *
  * \param[in] cur_client Variavel que armazena informacoes do cliente
+ * \param[out] r_server O servidor
  *
  * \return 0 Caso OK
  * \return -1 Caso haja erro
  */
-int server_send_response(client_node *client)
+int server_send_response(client_node *client, server *r_server)
 {
   int b_sent;
 
@@ -937,6 +3077,21 @@ int server_send_response(client_node *client)
       client->status & FINISHED)
     return 0;
 
+  if (client->cached && client->cached->data)
+    return server_send_cached(client, r_server);
+
+  if (!client->pos_buf)
+    return 0;
+
+  if (URING_ENGINE == r_server->engine)
+  {
+    if (0 > server_uring_begin(1, client, r_server))
+      return -1;
+
+    server_uring_queue(URING_SEND, client->pos_buf, 0, client, r_server);
+    return 0;
+  }
+
   if(0 > (b_sent = send(client->sockfd, client->buffer, 
                         client->pos_buf, MSG_NOSIGNAL | 
                         MSG_DONTWAIT)))
@@ -950,106 +3105,339 @@ int server_send_response(client_node *client)
     return -1;
   }
 
-  bucket_withdraw(b_sent, &client->bucket);
+  server_client_withdraw(b_sent, client, r_server);
   client->pos_buf = 0;
   client->status &= (~PENDING_DATA);
   server_process_cli_status(client);
   return 0;
 }
 
-/*! \brief Recebe as mensagens de servico das threads
+/*! \brief Descarta os bytes ja transferidos do buffer do cliente
  *
- * \param[out] r_server A estrutura do servidor
+ * \param[in] op A operacao concluida (URING_SEND ou URING_WRITE)
+ * \param[in] bytes Quantidade de bytes transferidos
+ * \param[out] client O cliente
  */
-void server_recv_thread_signals(server *r_server)
+static void server_uring_consume(int op, int bytes, client_node *client)
 {
-  int cont;
-  int b_recv;
-  char signal_str[SIGNAL_LEN];
-  
-  memset(signal_str, 0, sizeof(signal_str));
-  memset(r_server->cli_signaled, 0, sizeof(r_server->cli_signaled));
+  if (URING_WRITE == op)
+  {
+    client->pos_header += bytes;
+    if (client->pos_header >= client->pos_buf)
+    {
+      client->pos_header = 0;
+      client->pos_buf = 0;
+    }
+    return;
+  }
+
+  if (bytes < client->pos_buf)
+    memmove(client->buffer, client->buffer + bytes, client->pos_buf - bytes);
+  client->pos_buf -= bytes;
+}
+
+/*! \brief Conclui o lote de operacoes do cliente: reenvia o que restou no
+ * buffer (envio parcial ou cadeia cancelada), atualiza o estado e encadeia o
+ * proximo lote sem passar pelo reactor
+ *
+ * \param[out] client O cliente
+ * \param[out] r_server O servidor
+ */
+static void server_uring_finish(client_node *client, server *r_server)
+{
+  int pending;
+
+  if (client->task_st == ERROR || 0 > uring_reserve(1, &r_server->ring))
+  {
+    server_client_remove(&client, r_server);
+    return;
+  }
 
-  cont = -1;
-  while (++cont < FD_SETSIZE)
+  if (client->uring_ops & (URING_BIT(URING_RECV) | URING_BIT(URING_WRITE)))
+  {
+    if (0 < (pending = client->pos_buf - client->pos_header)) 
+    {
+      server_uring_queue(URING_WRITE, pending, 0, client, r_server);
+      return;
+    }
+  }
+  else if (0 < client->pos_buf)
   {
-    b_recv = recv(r_server->l_socket, signal_str, SIGNAL_LEN,
-                  MSG_DONTWAIT);
+    server_uring_queue(URING_SEND, client->pos_buf, 0, client, r_server);
+    return;
+  }
 
-    if (b_recv <= 0)
-      break;
+  client->status &= (~SIGNAL_WAIT);
+  server_client_sync_bucket(client, r_server);
 
-    if(1 != (sscanf(signal_str, "%p", &r_server->cli_signaled[cont])))
+  if (client->uring_ops & URING_BIT(URING_SEND))
+  {
+    server_process_cli_status(client);
+    if (client->status & FINISHED)
     {
-      memset(r_server->cli_signaled[cont], 0,
-             sizeof(* r_server->cli_signaled[cont]));
-      cont--;
+      if (0 <= server_client_finish(client, r_server) &&
+          0 > server_client_update_events(client, r_server))
+        server_client_remove(&client, r_server);
+      return;
     }
   }
+
+  if ((GET == client->method &&
+       0 != server_process_read_file(client, r_server)) ||
+      0 != server_process_write_file(client, r_server) ||
+      0 > server_client_update_events(client, r_server))
+    server_client_remove(&client, r_server);
+}
+
+/*! \brief Trata a conclusao de uma operacao do io_uring
+ *
+ * \param[in] cqe A conclusao
+ * \param[out] r_server O servidor
+ */
+static void server_uring_complete(const uring_cqe *cqe,
+                                  server *r_server)
+{
+  int op = cqe->user_data & URING_OP_MASK;
+  int res = cqe->res;
+  client_node *client;
+
+  client = (client_node *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+  client->uring_inflight--;
+
+  switch (op)
+  {
+    case URING_READ:
+      if (0 >= res)
+        client->task_st = ERROR;
+      else
+      {
+        client->file_offset += res;
+        client->pos_buf = res;
+        if (client->b_to_transfer > res ||
+            client->file_offset >= client->file_size)
+          client->task_st = FINISHED;
+      }
+      break;
+
+    case URING_RECV:
+      if (0 > res)
+      {
+        client->task_st = ERROR;
+        break;
+      }
+
+      server_client_withdraw(res, client, r_server);
+      client->pos_buf = res;
+      server_client_body_received(res, client->b_to_transfer, client);
+      break;
+
+    case URING_SEND:
+    case URING_WRITE:
+      /* Cadeia cancelada por leitura curta: reenviada ao fim do lote */
+      if (-ECANCELED == res)
+        break;
+
+      if (0 > res)
+      {
+        client->task_st = ERROR;
+        break;
+      }
+
+      if (URING_SEND == op)
+        server_client_withdraw(res, client, r_server);
+      else
+        client->file_offset += res;
+
+      server_uring_consume(op, res, client);
+      break;
+  }
+
+  if (!client->uring_inflight)
+    server_uring_finish(client, r_server);
+}
+
+/*! \brief Processa em lote as conclusoes disponiveis no io_uring
+ *
+ * \param[out] r_server O servidor
+ */
+void server_uring_reap(server *r_server)
+{
+  uring_cqe cqes[URING_REAP_BATCH];
+  int num_cqes;
+  int cont;
+
+  do
+  {
+    num_cqes = uring_reap(cqes, URING_REAP_BATCH, &r_server->ring);
+    for (cont = 0; cont < num_cqes; cont++)
+      server_uring_complete(&cqes[cont], r_server);
+  } while (URING_REAP_BATCH == num_cqes);
+}
+
+/*! \brief Submete ao kernel, com uma unica chamada, as operacoes acumuladas
+ * durante a iteracao do laco de eventos. Em uma submissao parcial por
+ * conclusoes acumuladas, recolhe-as e submete o restante
+ *
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro ou entradas ainda pendentes apos
+ * URING_SUBMIT_RETRIES tentativas
+ * \return 0 Caso ok
+ */
+int server_uring_flush(server *r_server)
+{
+  int cont;
+
+  if (URING_ENGINE != r_server->engine)
+    return 0;
+
+  for (cont = 0; cont < URING_SUBMIT_RETRIES; cont++)
+  {
+    if (0 <= uring_submit(&r_server->ring))
+      return 0;
+
+    if (EAGAIN != errno && EBUSY != errno)
+      return -1;
+
+    server_uring_reap(r_server);
+  }
+
+  return -1;
 }
 
-/*! \brief Interpreta a resposta de servido das threads e, caso
+/*! \brief Recolhe, em lote, as tarefas concluidas pelas threads e, caso
  * necessario, fecha a conexao com o cliente
  *
  * \param[out] r_server A estrutura do servidor
  */
 void server_process_thread_signals(server *r_server)
 {
-  int cont;
+  void *signaled;
+
+  threadpool_ack(&r_server->thread_pool);
 
-  cont = 0;
-  while (r_server->cli_signaled[cont])
+  while (0 <= threadpool_done(&signaled, &r_server->thread_pool))
   {
-    client_node *cur_client = r_server->cli_signaled[cont];
+    client_node *cur_client = (client_node *) signaled;
+    cur_client->status &= (~SIGNAL_WAIT);
+
     if (cur_client->task_st == ERROR)
-    {
-      client_node_pop(cur_client, &r_server->l_clients);
-      client_node_free(cur_client);
-    }
+      server_client_remove(&cur_client, r_server);
     else
-      cur_client->status &= (~SIGNAL_WAIT);
+      server_client_set_ready(cur_client, r_server);
+  }
+}
+
+/*! \brief Trata uma alteracao na arvore da raiz, descartando do cache
+ * somente o que depende do caminho alterado. Com eventos perdidos, descarta
+ * todo o cache
+ *
+ * \param[in] dir Diretorio alterado, NULL se eventos foram perdidos
+ * \param[in] name Entrada alterada, NULL se o proprio diretorio
+ * \param[in] mask Eventos do inotify
+ * \param[out] arg O servidor
+ */
+static void server_fs_event(const char *dir, const char *name,
+                            unsigned int mask, void *arg)
+{
+  server *r_server = (server *) arg;
+  char path[PATH_MAX];
+
+  if (!dir)
+  {
+    file_cache_flush(&r_server->f_cache);
+    return;
+  }
 
-    cont++;
+  if (mask & IN_IGNORED)
+    return;
+
+  if (0 > fs_watch_join(dir, name, path, sizeof(path)))
+  {
+    file_cache_flush(&r_server->f_cache);
+    return;
   }
+
+  if (mask & FS_WATCH_TREE)
+    file_cache_drop(path, !name || mask & IN_ISDIR, &r_server->f_cache);
+  else
+    file_cache_drop_file(path, &r_server->f_cache);
 }
 
-/*! \brief Contem analises e tarefas necessarias ao select: inicio de burst e
- * inicializacao dos descritores. Ha' determinacao de timeout do select, se
- * necessario. Caso contrario, timeout permanece NULL
+/*! \brief Processa as alteracoes na arvore da raiz. Em caso de erro na
+ * leitura, a raiz deixa de ser observada, os recursos passam a ser
+ * resolvidos a cada requisicao e os arquivos do cache conferidos a cada uso
+ *
+ * \param[out] r_server O servidor
+ */
+void server_process_fs_events(server *r_server)
+{
+  if (0 <= fs_watch_process(server_fs_event, r_server, &r_server->watch))
+    return;
+
+  reactor_del(r_server->watch.fd, &r_server->ev_loop);
+  fs_watch_destroy(&r_server->watch);
+  file_cache_path_flush(&r_server->f_cache);
+  r_server->f_cache.validate = 1;
+}
+
+/*! \brief Contem analises e tarefas necessarias antes da espera por eventos:
+ * atualizacao do relogio e execucao dos temporizadores expirados (recarga de
+ * tokens e inatividade). Ha determinacao de timeout da espera se houver
+ * cliente pronto ou temporizador pendente. Caso contrario, timeout permanece
+ * NULL
  *
  * \param[out] r_server A estrutura do servidor
- * \param[out] timeout O timeout a ser aplicado ao select
+ * \param[out] timeout O timeout a ser aplicado a espera
+ * \param[out] rem_time Armazena o tempo ate o proximo temporizador
  *
  * \return -1 Caso erro na extracao do tempo atual
  * \return 0 Caso ok
  */
 int server_select_analysis(server *r_server, struct timespec **timeout,
-                            struct timespec *burst_rem_time)
+                            struct timespec *rem_time)
 {
-  int transmission_flag = 0;
-  struct timespec burst_cur_time;
+  long long next_ms;
 
-  if (0 > bucket_burst_init(&r_server->last_burst, &burst_cur_time))
+  if (0 > server_update_clock(r_server))
     return -1;
 
-  if (!timespecisset(&burst_cur_time))
-  {
-    client_node *cur_client;
-    for(cur_client = r_server->l_clients.head; cur_client; 
-        cur_client = cur_client->next)  
-      bucket_fill(r_server->velocity, &cur_client->bucket);
-  }
+  timer_wheel_advance(r_server->now_ms, r_server, &r_server->timers);
 
-  transmission_flag = server_init_sets(r_server);   
-  if (r_server->l_clients.size && !transmission_flag)
+  memset(rem_time, 0, sizeof(*rem_time));
+  if (r_server->ready_q.size)
+    *timeout = rem_time;
+  else if (0 <= (next_ms = timer_wheel_next_ms(r_server->now_ms,
+                                                &r_server->timers)))
   {
-    bucket_burst_remain_time(&burst_cur_time, burst_rem_time); 
-    *timeout = burst_rem_time;
+    rem_time->tv_sec = next_ms / 1000;
+    rem_time->tv_nsec = (next_ms % 1000) * 1000000;
+    *timeout = rem_time;
   }
 
   return 0;
 }
 
+/*! \brief Atualiza o instante atual usado pelos buckets e temporizadores
+ *
+ * \param[out] r_server O servidor
+ *
+ * \return -1 Caso erro no relogio
+ * \return 0 Caso ok
+ */
+int server_update_clock(server *r_server)
+{
+  struct timespec cur_time;
+
+  if (0 > clock_gettime(CLOCK_MONOTONIC, &cur_time))
+    return -1;
+
+  r_server->now_ns = (long long) cur_time.tv_sec * NSEC_PER_SEC +
+                     cur_time.tv_nsec;
+  r_server->now_ms = r_server->now_ns / 1000000;
+  return 0;
+}
+
 /* \brief Adiciona um arquivo no final da lista de arquivos
  *
  * \param[in] file O arquivo a ser acrescentado
@@ -1189,30 +3577,25 @@ int verify_file_status(const char *file_name, http_methods cli_method,
 void clean_up_server(server *r_server)
 {
   client_node *client;
-  file_node *file;
-  file_node *next_file;
 
-  unlink(LSOCK_NAME);
   if (r_server->listenfd)
     close(r_server->listenfd);
-  if (r_server->l_socket)
-    close(r_server->l_socket);
   
-  if (r_server->thread_pool.threads)
+  if (r_server->thread_pool.workers)
     threadpool_destroy(&r_server->thread_pool);
 
+  if (URING_ENGINE == r_server->engine)
+    uring_destroy(&r_server->ring);
+
   client = r_server->l_clients.head;
   while (client)
     server_client_remove(&client, r_server);
+  file_cache_destroy(&r_server->f_cache);
+  fs_watch_destroy(&r_server->watch);
 
-  file = r_server->used_files.head;
-  while (file)
-  {
-    next_file = file->next;
-    file_node_pop(file, &r_server->used_files);
-    file_node_free(file);
-    file = next_file;
-  }
+  /* Os arquivos em uso deste reactor foram liberados com seus clientes; os
+   * demais pertencem a outros reactors */
+  reactor_destroy(&r_server->ev_loop);
 }
 
 /* \brief Funcao que troca o socket de escuta do servidor.
@@ -1230,10 +3613,21 @@ static int server_change_listenfd(int new_port, server *r_server)
 
   if (new_port != r_server->listen_port)
   {
-    if (0 > (new_listenfd = server_create_listenfd(new_port)))
+    if (0 > (new_listenfd = server_create_listenfd(new_port,
+                                                   1 < r_server->num_reactors)))
       return -1;
 
     old_listenfd = r_server->listenfd;
+    reactor_del(old_listenfd, &r_server->ev_loop);
+    if (0 > reactor_add(new_listenfd, EV_READ, &r_server->listenfd,
+                        &r_server->ev_loop))
+    {
+      close(new_listenfd);
+      reactor_add(old_listenfd, EV_READ, &r_server->listenfd,
+                  &r_server->ev_loop);
+      return -1;
+    }
+
     r_server->listenfd = new_listenfd;
     close(old_listenfd);
     r_server->listen_port = new_port;
@@ -1273,24 +3667,155 @@ int server_write_pid_file()
   return 0;
 }
 
+/* \brief Escreve as estatisticas do reactor em um arquivo na pasta do PID,
+ * com uma estatistica por linha no formato "nome valor"
+ *
+ * \param[in] r_server O servidor
+ *
+ * \return 0 Caso ok
+ * \return -1 Caso haja erro
+ */
+int server_write_stats_file(server *r_server)
+{
+  FILE *stats_file;
+  server_stats *stats = &r_server->stats;
+  char stats_file_str[strlen(CONFIG_PATH) + strlen(STATS_FILE) + PID_LEN];
+  int cont;
+
+  memset(stats_file_str, 0, sizeof(stats_file_str));
+  snprintf(stats_file_str, sizeof(stats_file_str), "%s%s.%d", CONFIG_PATH,
+           STATS_FILE, r_server->reactor_id);
+
+  if (!(stats_file = fopen(stats_file_str, "w")))
+    return -1;
+
+  fprintf(stats_file, "clients %d\n", r_server->l_clients.size);
+  fprintf(stats_file, "accept_wakeups %lu\n", stats->accept_wakeups);
+  fprintf(stats_file, "accepted %lu\n", stats->accepted);
+  fprintf(stats_file, "accept_last %d\n", stats->accept_last);
+  fprintf(stats_file, "accept_max %d\n", stats->accept_max);
+  for (cont = 0; cont < ACCEPT_HIST_LEN; cont++)
+    fprintf(stats_file, "accept_batch_%d %lu\n", 1 << cont,
+            stats->accept_hist[cont]);
+  fprintf(stats_file, "cache_files %d\n", r_server->f_cache.count);
+  fprintf(stats_file, "cache_bytes %zu\n", r_server->f_cache.mem_used);
+  fprintf(stats_file, "cache_mapped %lld\n",
+          (long long) r_server->f_cache.map_used);
+  fprintf(stats_file, "cache_hits %lu\n", r_server->f_cache.hits);
+  fprintf(stats_file, "cache_misses %lu\n", r_server->f_cache.misses);
+  fprintf(stats_file, "cache_evictions %lu\n", r_server->f_cache.evictions);
+  fprintf(stats_file, "keepalive_reused %lu\n", r_server->stats.reused);
+  fprintf(stats_file, "pipelined %lu\n", r_server->stats.pipelined);
+  fprintf(stats_file, "path_entries %d\n", r_server->f_cache.path_count);
+  fprintf(stats_file, "path_hits %lu\n", r_server->f_cache.path_hits);
+  fprintf(stats_file, "path_misses %lu\n", r_server->f_cache.path_misses);
+  fprintf(stats_file, "pool_depth %d\n",
+          threadpool_depth(&r_server->thread_pool));
+  fprintf(stats_file, "pool_depth_max %d\n",
+          r_server->thread_pool.depth_max);
+  fprintf(stats_file, "pool_full %lu\n", r_server->thread_pool.full);
+  fprintf(stats_file, "pool_stolen %lu\n",
+          threadpool_stolen(&r_server->thread_pool));
+  fprintf(stats_file, "pool_workers %d\n",
+          r_server->thread_pool.num_workers);
+
+  fclose(stats_file);
+  return 0;
+}
+
+/*! \brief Interpreta a linha de pesos do arquivo de configuracao: pares
+ * prefixo=peso separados por espacos, como "/videos/=1 /img/=8". Uma linha
+ * vazia nao tem pesos
+ *
+ * \param[in] line A linha
+ * \param[out] weights Recebe os pesos
+ * \param[out] num_weights Recebe o numero de pesos
+ *
+ * \return -1 Caso algum par seja invalido (pesos anteriores mantidos)
+ * \return 0 Caso ok
+ */
+static int server_parse_weights(char *line, path_weight *weights,
+                                int *num_weights)
+{
+  path_weight new_weights[MAX_WEIGHTS];
+  int new_num = 0;
+  char *saveptr = NULL;
+  char *token;
+
+  for (token = strtok_r(line, " \t\n", &saveptr); token;
+       token = strtok_r(NULL, " \t\n", &saveptr))
+  {
+    char *sep = strrchr(token, '=');
+    char *endptr = NULL;
+    long weight;
+
+    if (!sep || sep == token || RESOURCE_LEN < sep - token ||
+        MAX_WEIGHTS == new_num)
+      return -1;
+
+    weight = strtol(sep + 1, &endptr, NUMBER_BASE);
+    if (*endptr || 1 > weight || MAX_WEIGHT < weight)
+      return -1;
+
+    memset(&new_weights[new_num], 0, sizeof(path_weight));
+    memcpy(new_weights[new_num].prefix, token, sep - token);
+    new_weights[new_num].weight = weight;
+    new_num++;
+  }
+
+  memcpy(weights, new_weights, new_num * sizeof(path_weight));
+  *num_weights = new_num;
+  return 0;
+}
+
+/*! \brief Interpreta uma linha numerica do arquivo de configuracao
+ *
+ * \param[in] line A linha, sem o terminador
+ * \param[in] max Maior valor aceito
+ * \param[out] value Recebe o valor
+ *
+ * \return -1 Caso valor invalido
+ * \return 0 Caso ok
+ */
+static int server_parse_config_number(const char *line, long max,
+                                      long *value)
+{
+  char *endptr = NULL;
+
+  *value = strtol(line, &endptr, NUMBER_BASE);
+  if (endptr == line || *endptr || 0 > *value || max < *value)
+    return -1;
+
+  return 0;
+}
+
 /* \brief Funcao que le o arquivo de configuracao e determina os parametros na
- * estrutura do servidor
+ * estrutura do servidor. Todas as linhas sao validadas antes que alguma seja
+ * aplicada: com uma linha invalida, nada muda. Linhas vazias mantem o valor
+ * atual, exceto a de pesos, que vazia remove os pesos
  *
  * \param[in] config_file_path Caminho do arquivo de configuracao
+ * \param[in] startup Aplica somente as linhas de pesos e de threads, antes
+ * da criacao do pool
  * \param[out] r_server O servidor
  *
  * \return 0 Caso ok
  * \return -1 Caso haja algum erro
  */
 static int server_read_config_file(const char *config_file_path,
-                                   server *r_server)
+                                   int startup, server *r_server)
 {
   FILE *config_file;
-  char *config[CONFIG_PARAM_NUM];
+  char *config[CONFIG_LINES];
+  char new_root[PATH_MAX];
+  path_weight new_weights[MAX_WEIGHTS];
   size_t len = ROOT_LEN;
   int cont;
-  int new_vel;
-  int new_port;
+  int num_weights = 0;
+  int min_workers = 0;
+  int max_workers = 0;
+  long new_vel = 0;
+  long new_port = 0;
   const int error = -1, success = 0;
   int ret = error;
 
@@ -1299,42 +3824,83 @@ static int server_read_config_file(const char *config_file_path,
   if (!(config_file = fopen(config_file_path, "r")))
     return error;
 
-  for (cont = 0; cont < CONFIG_PARAM_NUM; cont++)
+  for (cont = 0; cont < CONFIG_LINES; cont++)
     if (!(config[cont] = (char *) calloc(ROOT_LEN, sizeof(char))))
       goto exit;
 
   /* A funcao getline armazena o terminador tambem */
-  for (cont = 0; -1 != getline(&config[cont], &len, config_file); cont++)
-    ;
+  for (cont = 0; cont < CONFIG_LINES &&
+       -1 != getline(&config[cont], &len, config_file); cont++)
+  {
+    config[cont][strcspn(config[cont], "\n")] = '\0';
+    len = ROOT_LEN;
+  }
+
+  if (0 > server_parse_weights(config[WEIGHT_CONFIG], new_weights,
+                               &num_weights) ||
+      (*config[WORKERS_CONFIG] &&
+       0 > server_parse_workers(config[WORKERS_CONFIG], &min_workers,
+                                &max_workers)))
+    goto exit;
 
-  if (1 < strlen(config[PORT_CONFIG]))
+  if (!startup)
   {
-    new_port = strtol(config[PORT_CONFIG], NULL, NUMBER_BASE);
+    if ((*config[PORT_CONFIG] &&
+         0 > server_parse_config_number(config[PORT_CONFIG], USHRT_MAX,
+                                        &new_port)) ||
+        (*config[VEL_CONFIG] &&
+         0 > server_parse_config_number(config[VEL_CONFIG], INT_MAX,
+                                        &new_vel)))
+      goto exit;
+
+    if (ROOT_LEN <= strlen(config[ROOT_CONFIG]) ||
+        (*config[ROOT_CONFIG] && !realpath(config[ROOT_CONFIG], new_root)))
+      goto exit;
 
-    if (0 > server_change_listenfd(new_port, r_server))
+    /* Troca a porta primeiro: se falhar, nenhuma alteracao foi aplicada */
+    if (*config[PORT_CONFIG] &&
+        0 > server_change_listenfd(new_port, r_server))
       goto exit;
   }
 
-  if (ROOT_LEN < strlen(config[ROOT_CONFIG]))
-    goto exit;
-  
-  if (1 < strlen(config[ROOT_CONFIG]))
+  ret = success;
+
+  memcpy(r_server->weights, new_weights, num_weights * sizeof(path_weight));
+  r_server->num_weights = num_weights;
+
+  if (*config[WORKERS_CONFIG])
   {
-    memset(r_server->serv_root, 0, sizeof(r_server->serv_root));
-    strncpy(r_server->serv_root, config[ROOT_CONFIG],
-            strlen(config[ROOT_CONFIG]) - 1);
+    r_server->min_workers = min_workers;
+    r_server->max_workers = max_workers;
   }
 
-  if (1 < strlen(config[VEL_CONFIG]))
+  /* Na inicializacao, threadpool_init cria o pool com os limites lidos */
+  if (startup)
+    goto exit;
+
+  if (*config[ROOT_CONFIG] && strcmp(r_server->serv_root, new_root))
   {
-    new_vel = strtol(config[VEL_CONFIG], NULL, NUMBER_BASE);
-    r_server->velocity = new_vel;
+    strcpy(r_server->serv_root, new_root);
+
+    if (0 > server_watch_root(r_server))
+      ret = error;
   }
 
-  ret = success;
+  if (*config[VEL_CONFIG])
+    r_server->velocity = new_vel;
+
+  /* As threads retiradas concluem as tarefas ja' enfileiradas */
+  if (*config[WORKERS_CONFIG])
+  {
+    if (0 > threadpool_set_limits(min_workers, max_workers,
+                                  &r_server->thread_pool))
+      ret = error;
+
+    server_pool_schedule(r_server);
+  }
 
 exit:
-  for (cont = 0; cont < CONFIG_PARAM_NUM; cont++)
+  for (cont = 0; cont < CONFIG_LINES; cont++)
     if (config[cont])
       free(config[cont]);
 
@@ -1374,9 +3940,24 @@ void alter_config(server *r_server)
   memset(config_file_path, 0, sizeof(config_file_path));
 
   sprintf(config_file_path, "%s%s", CONFIG_PATH, CONFIG_FILE);
-  if (0 > server_read_config_file(config_file_path, r_server))
+  if (0 > server_read_config_file(config_file_path, 0, r_server))
   {
     sprintf(log_file_path, "%s%s", CONFIG_PATH, LOG_FILE);
     server_write_log_file(log_file_path);
   }
 }
+
+/*! \brief Carrega os pesos e as threads do pool do arquivo de
+ * configuracao, na inicializacao, antes da criacao do pool. A linha de
+ * threads, quando presente, prevalece sobre -w, como no SIGHUP. Os demais
+ * parametros vem da linha de comando
+ *
+ * \param[out] r_server O servidor
+ */
+void server_load_config(server *r_server)
+{
+  char config_file_path[strlen(CONFIG_PATH) + strlen(CONFIG_FILE) + 1];
+
+  sprintf(config_file_path, "%s%s", CONFIG_PATH, CONFIG_FILE);
+  server_read_config_file(config_file_path, 1, r_server);
+}
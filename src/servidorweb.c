@@ -1,18 +1,27 @@
 /*!
  *  \file servidorweb.c
  *  \brief Servidor com I/O nao bloqueante que utiliza estrategia 
- *  simplificada de token-bucket para controle de velocidade
+ *  simplificada de token-bucket para controle de velocidade. O laco de
+ *  eventos usa epoll por padrao, com pselect como alternativa (-b select).
+ *  Com -r N, executa N reactors independentes, cada um em sua thread. Com
+ *  -w N, cada reactor tem N threads no pool; com -w MIN:MAX, o pool se
+ *  ajusta entre os limites conforme a fila e a espera das tarefas. A linha
+ *  de threads do arquivo de configuracao, quando presente, prevalece sobre
+ *  -w desde a inicializacao
  */
 
 #include "server.h"
 
-static volatile int shut_down = 0;
-static volatile int alter_config_var = 0;
+static volatile sig_atomic_t shut_down = 0;
+static volatile sig_atomic_t config_gen = 0;
+static volatile sig_atomic_t stats_gen = 0;
 
 static void sig_handler (int sig)
 {
   if (SIGHUP == sig)
-    alter_config_var = 1;
+    config_gen++;
+  else if (SIGUSR1 == sig)
+    stats_gen++;
   else
     shut_down = 1;
 }
@@ -32,10 +41,21 @@ int prepare_signal_handler(struct sigaction *act, sigset_t *mask,
   if (sigaction(SIGHUP, act, 0))
     return -1;
 
+  if (sigaction(SIGUSR1, act, 0))
+    return -1;
+
+  /* sendfile nao aceita MSG_NOSIGNAL: sem isso, um cliente que fecha a
+   * conexao durante o envio encerraria o servidor */
+  act->sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, act, 0))
+    return -1;
+  act->sa_handler = sig_handler;
+
   sigemptyset(mask);
   sigaddset(mask, SIGTERM);
   sigaddset(mask, SIGINT);
   sigaddset(mask, SIGHUP);
+  sigaddset(mask, SIGUSR1);
 
   if (0 > sigprocmask(SIG_BLOCK, mask, orig_mask))
     return -1;
@@ -43,125 +63,236 @@ int prepare_signal_handler(struct sigaction *act, sigset_t *mask,
   return 0;
 }
 
-int main(int argc, const char **argv)
+/*! \brief Trata os eventos prontos de um cliente e atualiza seu registro no
+ * reactor conforme o novo estado
+ *
+ * \param[out] cur_client O cliente
+ * \param[in] events Os eventos prontos
+ * \param[out] r_server O servidor
+ */
+static void process_client_events(client_node *cur_client,
+                                  unsigned int events, server *r_server)
 {
-  server r_server;
-  sigset_t mask;
-  sigset_t orig_mask;
-  struct sigaction act;
+  server_client_sync_bucket(cur_client, r_server);
+  server_client_touch(cur_client, r_server);
 
-  if (0 > prepare_signal_handler(&act, &mask, &orig_mask) ||
-      0 > server_init(argc, argv, &r_server))
+  if (events & EV_READ)
   {
-    fprintf(stderr, "init_error\n");
-    goto finish_server;
+    if (0 != server_read_client_request(cur_client) ||
+        0 != server_verify_request(r_server, cur_client))
+    {
+      server_client_remove(&cur_client, r_server);
+      return;
+    }
+
+    if (0 != server_recv_response(cur_client, r_server) ||
+        0 != server_process_write_file(cur_client, r_server))
+    {
+      server_client_remove(&cur_client, r_server);
+      return;
+    }
+  }
+
+  if (events & EV_WRITE)
+  {
+    if (0 != server_build_header(cur_client) ||
+        0 != server_send_response(cur_client, r_server) ||
+        0 != server_process_read_file(cur_client, r_server))
+    {
+      server_client_remove(&cur_client, r_server);
+      return;
+    }
+
+    if (cur_client->status & FINISHED &&
+        0 > server_client_finish(cur_client, r_server))
+      return;
   }
 
+  if (events & EV_ERROR ||
+      0 > server_client_update_events(cur_client, r_server))
+    server_client_remove(&cur_client, r_server);
+}
+
+/*! \brief Processa os clientes que estavam na fila de prontos no inicio da
+ * chamada. Clientes recolocados na fila ficam para a proxima iteracao
+ *
+ * \param[out] r_server O reactor
+ */
+static void process_ready_clients(server *r_server)
+{
+  int num_ready = r_server->ready_q.size;
+  client_node *cur_client;
+
+  while (num_ready-- && (cur_client = client_queue_pop(&r_server->ready_q)))
+  {
+    if (cur_client->status & SIGNAL_WAIT)
+      continue;
+
+    process_client_events(cur_client, cur_client->ready_events, r_server);
+  }
+}
+
+/*! \brief Laco de eventos de um reactor. Executa ate o encerramento do
+ * servidor ou um erro fatal
+ *
+ * \param[out] r_server O reactor
+ * \param[in] wait_mask Mascara de sinais durante a espera. NULL mantem a
+ * mascara atual (sinais bloqueados nas threads de reactor)
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso encerramento
+ */
+static int server_run(server *r_server, const sigset_t *wait_mask)
+{
+  sig_atomic_t seen_config_gen = config_gen;
+  sig_atomic_t seen_stats_gen = stats_gen;
+
   while (1)
   {
-    client_node *cur_client = NULL;
+    int cont;
     int nready = 0;
     struct timespec *timeout = NULL;
-    struct timespec burst_rem_time;
+    struct timespec rem_time;
 
-    if (0 > server_select_analysis(&r_server, &timeout,
-                                   &burst_rem_time))
-      goto finish_server;
+    if (0 > server_select_analysis(r_server, &timeout, &rem_time) ||
+        0 > server_uring_flush(r_server))
+      return -1;
 
-    nready = pselect(r_server.maxfd_number + 1,
-                     &r_server.sets.read_s, &r_server.sets.write_s,
-                     &r_server.sets.except_s, timeout, &orig_mask);
+    nready = reactor_wait(timeout, wait_mask, &r_server->ev_loop);
+    server_update_clock(r_server);
     if (shut_down)
-      goto finish_server;
-    else if (alter_config_var)
+      return 0;
+    else if (seen_config_gen != config_gen)
     {
-      alter_config_var = 0;
-      alter_config(&r_server);
+      seen_config_gen = config_gen;
+      alter_config(r_server);
+    }
+    else if (seen_stats_gen != stats_gen)
+    {
+      seen_stats_gen = stats_gen;
+      server_write_stats_file(r_server);
     }
     else if (0 > nready)
     {
       if (EINTR == errno)
         continue;
 
-      goto finish_server;
+      return -1;
     }
 
-    if (FD_ISSET(r_server.l_socket, &r_server.sets.read_s))
+    for (cont = 0; cont < nready; cont++)
     {
-      server_recv_thread_signals(&r_server);
-      server_process_thread_signals(&r_server);
-      
-      if (0 >= --nready)
-        continue;
+      reactor_event *event = &r_server->ev_loop.events[cont];
+
+      if (event->data == &r_server->thread_pool)
+        server_process_thread_signals(r_server);
+      else if (event->data == &r_server->listenfd)
+        server_make_connection(r_server);
+      else if (event->data == &r_server->ring)
+        server_uring_reap(r_server);
+      else if (event->data == &r_server->watch)
+        server_process_fs_events(r_server);
+      else
+        process_client_events((client_node *) event->data, event->events,
+                              r_server);
     }
 
-    if (FD_ISSET(r_server.listenfd, &r_server.sets.read_s))
-    {
-      if (0 > server_make_connection(&r_server))
-        continue;
+    process_ready_clients(r_server);
+  }
 
-      if (0 >= --nready)
-        continue;
-    }
+  return 0;
+}
 
-    cur_client = r_server.l_clients.head;
-    while(cur_client)
+/*! \brief Thread de um reactor. Em caso de erro fatal, pede o encerramento
+ * de todo o servidor
+ *
+ * \param[out] r_server O reactor
+ */
+static void *reactor_thread(void *r_server)
+{
+  if (0 > server_run((server *) r_server, NULL))
+    kill(getpid(), SIGTERM);
+
+  return NULL;
+}
+
+/*! \brief Executa os reactors em threads, com os sinais bloqueados, e trata
+ * os sinais na thread principal, acordando os reactors a cada sinal
+ *
+ * \param[out] reactors Os reactors
+ * \param[in] num_reactors Numero de reactors
+ * \param[in] orig_mask Mascara de sinais original
+ *
+ * \return -1 Caso erro
+ * \return 0 Caso encerramento
+ */
+static int run_reactors(server *reactors, int num_reactors,
+                        const sigset_t *orig_mask)
+{
+  pthread_t threads[MAX_REACTORS];
+  int cont;
+  int started;
+
+  for (started = 0; started < num_reactors; started++)
+    if (pthread_create(&threads[started], NULL, reactor_thread,
+                       &reactors[started]))
     {
-      int sockfd = cur_client->sockfd;
-
-      if (FD_ISSET(sockfd, &r_server.sets.read_s))
-      {
-        if (0 != server_read_client_request(cur_client) ||
-            0 != server_verify_request(&r_server, cur_client))
-        {
-          server_client_remove(&cur_client, &r_server);
-          continue;
-        }
-
-        if (0 != server_recv_response(cur_client) ||
-            0 != server_process_write_file(cur_client, &r_server))
-        {
-          server_client_remove(&cur_client, &r_server);
-          continue;
-        }
-
-        if (0 >= --nready)
-          break;
-      }
-     
-      if (FD_ISSET(sockfd, &r_server.sets.write_s))
-      {
-        if (0 != server_build_header(cur_client) ||
-            0 != server_send_response(cur_client) ||
-            0 != server_process_read_file(cur_client, &r_server))
-        {
-          server_client_remove(&cur_client, &r_server);
-          continue;
-        }
-
-        if (cur_client->status & FINISHED)
-        {
-          server_client_remove(&cur_client, &r_server);
-          continue;
-        }
-
-        if (0 >= --nready)
-          break;
-      }
-
-      if (FD_ISSET(sockfd, &r_server.sets.except_s))
-      {
-          server_client_remove(&cur_client, &r_server);
-          continue;
-      }
-
-      cur_client = cur_client->next;
+      shut_down = 1;
+      break;
     }
+
+  while (!shut_down)
+  {
+    sigsuspend(orig_mask);
+    for (cont = 0; cont < started; cont++)
+      server_wakeup(&reactors[cont]);
   }
 
-  return 0;
+  for (cont = 0; cont < started; cont++)
+    server_wakeup(&reactors[cont]);
+  for (cont = 0; cont < started; cont++)
+    pthread_join(threads[cont], NULL);
+
+  return started == num_reactors ? 0 : -1;
+}
+
+int main(int argc, const char **argv)
+{
+  server model;
+  server *reactors = NULL;
+  sigset_t mask;
+  sigset_t orig_mask;
+  struct sigaction act;
+  int num_init = 0;
+  int ret = -1;
+  int cont;
+
+  if (0 > prepare_signal_handler(&act, &mask, &orig_mask) ||
+      0 > server_parse_arguments(argc, argv, &model) ||
+      !(reactors = (server *) calloc(model.num_reactors, sizeof(server))))
+  {
+    fprintf(stderr, "init_error\n");
+    goto finish_server;
+  }
+
+  for (num_init = 0; num_init < model.num_reactors; num_init++)
+    if (0 > server_init(num_init, &model, &reactors[num_init]))
+    {
+      fprintf(stderr, "init_error\n");
+      num_init++;
+      goto finish_server;
+    }
+
+  if (1 == model.num_reactors)
+    ret = server_run(&reactors[0], &orig_mask);
+  else
+    ret = run_reactors(reactors, model.num_reactors, &orig_mask);
 
 finish_server:
-  clean_up_server(&r_server);
-  return -1;
+  for (cont = 0; cont < num_init; cont++)
+    clean_up_server(&reactors[cont]);
+  if (reactors)
+    free(reactors);
+
+  return ret;
 }
@@ -0,0 +1,234 @@
+/*!
+ * \file timer_wheel.c
+ * \brief Implementacao da roda de temporizadores hierarquica
+ */
+
+#include "timer_wheel.h"
+
+/*! \brief Inicializa uma roda vazia
+ *
+ * \param[in] now_ms O instante atual
+ * \param[out] wheel A roda
+ */
+void timer_wheel_init(long long now_ms, timer_wheel *wheel)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->base_ms = now_ms;
+}
+
+/*! \brief Inicializa um temporizador inativo
+ *
+ * \param[in] callback Funcao chamada na expiracao
+ * \param[in] data Dado do dono do temporizador
+ * \param[out] entry O temporizador
+ */
+void timer_entry_init(timer_cb callback, void *data, timer_entry *entry)
+{
+  memset(entry, 0, sizeof(*entry));
+  entry->callback = callback;
+  entry->data = data;
+}
+
+/*! \brief Coloca um temporizador no slot correspondente a seu tick
+ *
+ * \param[out] entry O temporizador
+ * \param[out] wheel A roda
+ */
+static void timer_wheel_place(timer_entry *entry, timer_wheel *wheel)
+{
+  unsigned long long delta;
+  timer_entry **slot;
+
+  if (entry->expire <= wheel->cur_tick)
+    entry->expire = wheel->cur_tick + 1;
+
+  delta = entry->expire - wheel->cur_tick;
+
+  if (delta < TIMER_L0_SIZE)
+    slot = &wheel->l0[entry->expire & TIMER_L0_MASK];
+  else if (delta < (unsigned long long) TIMER_L0_SIZE * TIMER_L1_SIZE)
+    slot = &wheel->l1[(entry->expire >> TIMER_L0_BITS) & TIMER_L1_MASK];
+  else /* Alem do alcance: reavaliado na ultima volta possivel do nivel 1 */
+    slot = &wheel->l1[((wheel->cur_tick >> TIMER_L0_BITS) + TIMER_L1_MASK) &
+                      TIMER_L1_MASK];
+
+  entry->prev = NULL;
+  entry->next = *slot;
+  if (*slot)
+    (*slot)->prev = entry;
+  *slot = entry;
+  entry->slot = slot;
+}
+
+/*! \brief Retira um temporizador de seu slot
+ *
+ * \param[out] entry O temporizador
+ */
+static void timer_wheel_unlink(timer_entry *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    *entry->slot = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+
+  entry->next = NULL;
+  entry->prev = NULL;
+  entry->slot = NULL;
+}
+
+/*! \brief Agenda (ou reagenda) um temporizador
+ *
+ * \param[in] expire_ms Instante de expiracao, em milissegundos
+ * \param[out] entry O temporizador
+ * \param[out] wheel A roda
+ */
+void timer_wheel_add(long long expire_ms, timer_entry *entry,
+                     timer_wheel *wheel)
+{
+  long long rel_ms = expire_ms - wheel->base_ms;
+
+  if (entry->slot)
+    timer_wheel_del(entry, wheel);
+
+  /* Arredonda para cima para nunca expirar antes do prazo */
+  entry->expire = 0 < rel_ms ?
+                  (unsigned long long) (rel_ms + TIMER_TICK_MS - 1) /
+                  TIMER_TICK_MS : 0;
+
+  timer_wheel_place(entry, wheel);
+  wheel->count++;
+}
+
+/*! \brief Cancela um temporizador, se estiver ativo
+ *
+ * \param[out] entry O temporizador
+ * \param[out] wheel A roda
+ */
+void timer_wheel_del(timer_entry *entry, timer_wheel *wheel)
+{
+  if (!entry->slot)
+    return;
+
+  timer_wheel_unlink(entry);
+  wheel->count--;
+}
+
+/*! \brief Verifica se um temporizador esta ativo
+ *
+ * \param[in] entry O temporizador
+ *
+ * \return 1 Caso ativo
+ * \return 0 Caso contrario
+ */
+int timer_wheel_pending(const timer_entry *entry)
+{
+  return NULL != entry->slot;
+}
+
+/*! \brief Redistribui no nivel 0 os temporizadores do slot do nivel 1 que
+ * corresponde a volta iniciada no tick atual
+ *
+ * \param[out] wheel A roda
+ */
+static void timer_wheel_cascade(timer_wheel *wheel)
+{
+  timer_entry **slot = &wheel->l1[(wheel->cur_tick >> TIMER_L0_BITS) &
+                                  TIMER_L1_MASK];
+  timer_entry *entry = *slot;
+
+  *slot = NULL;
+  while (entry)
+  {
+    timer_entry *next = entry->next;
+
+    timer_wheel_place(entry, wheel);
+    entry = next;
+  }
+}
+
+/*! \brief Avanca a roda ate o instante atual, chamando os temporizadores
+ * expirados. As funcoes chamadas podem agendar ou cancelar temporizadores
+ *
+ * \param[in] now_ms O instante atual
+ * \param[in] arg Argumento repassado as funcoes
+ * \param[out] wheel A roda
+ */
+void timer_wheel_advance(long long now_ms, void *arg, timer_wheel *wheel)
+{
+  long long rel_ms = now_ms - wheel->base_ms;
+  unsigned long long now_tick;
+
+  if (0 > rel_ms)
+    return;
+
+  now_tick = (unsigned long long) rel_ms / TIMER_TICK_MS;
+
+  while (wheel->cur_tick < now_tick)
+  {
+    timer_entry **slot;
+    timer_entry *entry;
+
+    if (!wheel->count)
+    {
+      wheel->cur_tick = now_tick;
+      break;
+    }
+
+    wheel->cur_tick++;
+    if (!(wheel->cur_tick & TIMER_L0_MASK))
+      timer_wheel_cascade(wheel);
+
+    slot = &wheel->l0[wheel->cur_tick & TIMER_L0_MASK];
+    while ((entry = *slot))
+    {
+      timer_wheel_unlink(entry);
+      wheel->count--;
+      entry->callback(entry, arg);
+    }
+  }
+}
+
+/*! \brief Calcula o tempo ate o proximo temporizador. No nivel 1 considera o
+ * inicio da volta em que ele sera redistribuido. Um slot ocupado do nivel 0
+ * pode estar alem dessa volta, entao vale o menor dos dois niveis
+ *
+ * \param[in] now_ms O instante atual
+ * \param[in] wheel A roda
+ *
+ * \return -1 Caso nao haja temporizadores
+ * \return ms O tempo ate a proxima expiracao
+ */
+long long timer_wheel_next_ms(long long now_ms, const timer_wheel *wheel)
+{
+  unsigned long long tick = 0;
+  unsigned long long cont;
+  long long wait_ms;
+
+  if (!wheel->count)
+    return -1;
+
+  for (cont = 1; cont < TIMER_L0_SIZE && !tick; cont++)
+    if (wheel->l0[(wheel->cur_tick + cont) & TIMER_L0_MASK])
+      tick = wheel->cur_tick + cont;
+
+  for (cont = 1; cont <= TIMER_L1_SIZE; cont++)
+  {
+    unsigned long long block = (wheel->cur_tick >> TIMER_L0_BITS) + cont;
+
+    if (wheel->l1[block & TIMER_L1_MASK])
+    {
+      if (!tick || block << TIMER_L0_BITS < tick)
+        tick = block << TIMER_L0_BITS;
+      break;
+    }
+  }
+
+  if (!tick)
+    return -1;
+
+  wait_ms = wheel->base_ms + (long long) tick * TIMER_TICK_MS - now_ms;
+  return 0 > wait_ms ? 0 : wait_ms;
+}
@@ -6,6 +6,8 @@
 
 #include "token_bucket.h"
 
+const char *supported_bucket_modes[] = {"burst", "continuous", "pacing"};
+
 /*! \brief Inicializa um bucket com limite de tokens
  *
  * \param[in] rate A taxa em B/s
@@ -13,6 +15,7 @@
  */
 void bucket_init(const int rate, token_bucket *bucket)
 {
+  memset(bucket, 0, sizeof(*bucket));
   bucket->remain_tokens = rate;
   bucket->transmission = 1;
 }
@@ -29,6 +32,9 @@ int bucket_withdraw(const int remove_tokens,
                           token_bucket *bucket)
 {
   bucket->remain_tokens -= remove_tokens;
+  if (bucket->remain_tokens < bucket->resume)
+    bucket->transmission = 0;
+
   if(0 >= bucket->remain_tokens)
   {
     bucket->transmission = 0;
@@ -50,6 +56,117 @@ void bucket_fill(const int rate, token_bucket *bucket)
   bucket->transmission = 1;
 }
 
+/*! \brief Devolve ao bucket tokens retirados e nao usados
+ *
+ * \param[in] tokens Quantidade de tokens devolvida
+ * \param[out] bucket O bucket em questao
+ */
+void bucket_deposit(const int tokens, token_bucket *bucket)
+{
+  bucket->remain_tokens += tokens;
+  if (bucket->remain_tokens >= MAX(bucket->resume, 1))
+    bucket->transmission = 1;
+}
+
+/*! \brief Identifica o modo do bucket a partir de seu nome
+ *
+ * \param[in] mode_str O nome do modo
+ * \param[out] mode O modo correspondente
+ *
+ * \return -1 Caso o modo nao seja suportado
+ * \return 0 Caso ok
+ */
+int bucket_parse_mode(const char *mode_str, bucket_mode *mode)
+{
+  int cont;
+
+  for (cont = 0; cont < NUM_BUCKET_MODE; cont++)
+    if (!strcmp(mode_str, supported_bucket_modes[cont]))
+    {
+      *mode = cont;
+      return 0;
+    }
+
+  return -1;
+}
+
+/*! \brief Inicializa um bucket continuo cheio. Abaixo de resume tokens a
+ * transmissao e' suspensa ate nova recarga, evitando envios minusculos
+ * enquanto os tokens sao creditados aos poucos
+ *
+ * \param[in] depth A capacidade do bucket
+ * \param[in] resume Minimo de tokens para transmitir (ate depth)
+ * \param[in] now_ns O instante atual, em nanossegundos
+ * \param[out] bucket Bucket em questao
+ */
+void bucket_init_continuous(const int depth, const int resume,
+                            const long long now_ns, token_bucket *bucket)
+{
+  bucket->remain_tokens = depth;
+  bucket->resume = resume < depth ? resume : depth;
+  bucket->transmission = 0 < depth;
+  bucket->last_ns = now_ns;
+}
+
+/*! \brief Credita no bucket continuo os tokens correspondentes ao tempo
+ * decorrido desde o ultimo credito, limitados pela capacidade. A fracao de
+ * token nao creditada permanece em last_ns
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[in] depth A capacidade do bucket
+ * \param[in] now_ns O instante atual, em nanossegundos
+ * \param[out] bucket Bucket em questao
+ */
+void bucket_refill(const int rate, const int depth, const long long now_ns,
+                   token_bucket *bucket)
+{
+  long long elapsed = now_ns - bucket->last_ns;
+  long long tokens;
+
+  if (0 >= rate || 0 >= elapsed)
+    return;
+
+  /* Separa segundos e fracao para nao estourar o produto */
+  tokens = (elapsed / NSEC_PER_SEC) * rate +
+           (elapsed % NSEC_PER_SEC) * rate / NSEC_PER_SEC;
+
+  if (bucket->remain_tokens + tokens >= depth)
+  {
+    bucket->remain_tokens = depth;
+    bucket->last_ns = now_ns;
+  }
+  else
+  {
+    bucket->remain_tokens += tokens;
+    bucket->last_ns += tokens * NSEC_PER_SEC / rate;
+  }
+
+  if (bucket->remain_tokens >= MIN(bucket->resume, depth))
+    bucket->transmission = 0 < bucket->remain_tokens;
+}
+
+/*! \brief Calcula o instante em que o bucket continuo tera tokens para
+ * voltar a transmitir
+ *
+ * \param[in] rate A taxa em B/s
+ * \param[in] bucket Bucket em questao
+ *
+ * \return -1 Caso a taxa seja nula
+ * \return ns O instante, em nanossegundos
+ */
+long long bucket_ready_time(const int rate, const token_bucket *bucket)
+{
+  long long missing = MAX(bucket->resume, 1) - bucket->remain_tokens;
+
+  if (0 >= missing)
+    return bucket->last_ns;
+
+  if (0 >= rate)
+    return -1;
+
+  return bucket->last_ns + (missing * NSEC_PER_SEC + rate - 1) / rate;
+}
+
 /*! \brief Retorna tempo restante para o fim da burst atual
  *
  * \param[in] burst_cur_time O tempo atual da burst
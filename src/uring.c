@@ -0,0 +1,282 @@
+/*!
+ * \file uring.c
+ * \brief Implementacao da interface minima para o io_uring
+ */
+
+#include "uring.h"
+
+/*! \brief Chamada de sistema io_uring_setup
+ *
+ * \param[in] entries Numero de entradas de submissao
+ * \param[out] params Parametros preenchidos pelo kernel
+ *
+ * \return -1 Caso erro
+ * \return fd Descritor do io_uring
+ */
+static int uring_sys_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+/*! \brief Chamada de sistema io_uring_enter
+ *
+ * \param[in] ring_fd Descritor do io_uring
+ * \param[in] to_submit Numero de entradas a submeter
+ * \param[in] min_complete Numero minimo de conclusoes a esperar
+ * \param[in] flags Flags da chamada
+ *
+ * \return -1 Caso erro
+ * \return submitted Numero de entradas consumidas pelo kernel
+ */
+static int uring_sys_enter(int ring_fd, unsigned to_submit,
+                           unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+/*! \brief Cria um io_uring e mapeia seus aneis
+ *
+ * \param[in] entries Numero de entradas do anel de submissao
+ * \param[out] ring O io_uring
+ *
+ * \return -1 Caso erro (io_uring indisponivel, por exemplo)
+ * \return 0 Caso ok
+ */
+int uring_init(unsigned entries, uring *ring)
+{
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->sq_ring = MAP_FAILED;
+  ring->cq_ring = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+
+  if (0 > (ring->ring_fd = uring_sys_setup(entries, &params)))
+    return -1;
+
+  ring->sq_ring_len = params.sq_off.array +
+                      params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                       IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                       IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                    IORING_OFF_SQES);
+  if (MAP_FAILED == ring->sq_ring || MAP_FAILED == ring->cq_ring ||
+      MAP_FAILED == ring->sqes)
+    goto error;
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_ring +
+                                params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ring +
+                                 params.sq_off.array);
+  ring->sq_flags = (unsigned *) ((char *) ring->sq_ring +
+                                 params.sq_off.flags);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ring +
+                                params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring +
+                                        params.cq_off.cqes);
+
+  return 0;
+
+error:
+  uring_destroy(ring);
+  return -1;
+}
+
+/*! \brief Garante espaco para um numero de entradas no anel de submissao,
+ * submetendo as pendentes se necessario. Usado antes de montar uma cadeia
+ * de entradas ligadas, que nao pode ser interrompida. Uma submissao parcial
+ * basta se liberar o espaco necessario
+ *
+ * \param[in] count Numero de entradas necessarias
+ * \param[out] ring O io_uring
+ *
+ * \return -1 Caso nao haja espaco
+ * \return 0 Caso ok
+ */
+int uring_reserve(unsigned count, uring *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sq_entries - (ring->sqe_tail - head) >= count)
+    return 0;
+
+  uring_submit(ring);
+
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_entries - (ring->sqe_tail - head) < count)
+    return -1;
+
+  return 0;
+}
+
+/*! \brief Obtem uma entrada de submissao livre, zerada
+ *
+ * \param[out] ring O io_uring
+ *
+ * \return NULL Caso o anel esteja cheio
+ * \return sqe A entrada de submissao
+ */
+struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  if (0 > uring_reserve(1, ring))
+    return NULL;
+
+  index = ring->sqe_tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sqe_tail++;
+
+  return sqe;
+}
+
+/*! \brief Preenche uma entrada de leitura / escrita
+ *
+ * \param[in] opcode A operacao (IORING_OP_*)
+ * \param[in] fd O descritor alvo
+ * \param[in] buf O buffer da operacao
+ * \param[in] len Quantidade de bytes
+ * \param[in] offset Posicao no arquivo (ignorado para sockets)
+ * \param[in] user_data Dado devolvido na conclusao
+ * \param[out] sqe A entrada de submissao
+ */
+void uring_prep_rw(int opcode, int fd, void *buf, unsigned len,
+                   unsigned long long offset, unsigned long long user_data,
+                   struct io_uring_sqe *sqe)
+{
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long long) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+/*! \brief Publica e submete ao kernel todas as entradas pendentes,
+ * normalmente com uma unica chamada de sistema. Se o kernel consumir menos
+ * entradas que as publicadas, submete o restante ate sq_head alcancar a
+ * cauda. As entradas publicadas e nao consumidas por uma submissao parcial
+ * anterior tambem sao submetidas
+ *
+ * \param[out] ring O io_uring
+ *
+ * \return -1 Caso erro ou submissao parcial. Com errno EAGAIN ou EBUSY
+ * (conclusoes acumuladas), as restantes ficam pendentes para a proxima
+ * chamada
+ * \return submitted Numero de entradas submetidas
+ */
+int uring_submit(uring *ring)
+{
+  unsigned head;
+  int total = 0;
+  int submitted;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  while ((head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) !=
+         ring->sqe_tail)
+  {
+    submitted = uring_sys_enter(ring->ring_fd, ring->sqe_tail - head, 0, 0);
+    if (0 > submitted && EINTR == errno)
+      continue;
+
+    /* Nenhum progresso: repetir nao adianta sem recolher conclusoes */
+    if (0 >= submitted)
+    {
+      if (!submitted)
+        errno = EAGAIN;
+      return -1;
+    }
+
+    total += submitted;
+  }
+
+  return total;
+}
+
+/*! \brief Copia um lote de conclusoes e as libera no anel. Conclusoes que
+ * nao couberam no anel ficam retidas no kernel (IORING_SQ_CQ_OVERFLOW) ate
+ * uma chamada de io_uring_enter, feita aqui com o anel esvaziado
+ *
+ * \param[out] cqes Vetor que recebe as conclusoes
+ * \param[in] max Tamanho do vetor
+ * \param[out] ring O io_uring
+ *
+ * \return count Numero de conclusoes copiadas
+ */
+int uring_reap(uring_cqe *cqes, unsigned max, uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned count = 0;
+
+  while (count < max)
+  {
+    struct io_uring_cqe *cqe;
+
+    if (head == tail)
+    {
+      if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+            IORING_SQ_CQ_OVERFLOW))
+        break;
+
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+      uring_sys_enter(ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+      if (head == (tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)))
+        break;
+    }
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    cqes[count].user_data = cqe->user_data;
+    cqes[count].res = cqe->res;
+    head++;
+    count++;
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return (int) count;
+}
+
+/*! \brief Desfaz os mapeamentos e fecha o io_uring
+ *
+ * \param[out] ring O io_uring
+ */
+void uring_destroy(uring *ring)
+{
+  if (MAP_FAILED != ring->sqes && ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (MAP_FAILED != ring->cq_ring && ring->cq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  if (MAP_FAILED != ring->sq_ring && ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_len);
+
+  ring->sqes = MAP_FAILED;
+  ring->cq_ring = MAP_FAILED;
+  ring->sq_ring = MAP_FAILED;
+
+  if (0 < ring->ring_fd)
+    close(ring->ring_fd);
+  ring->ring_fd = -1;
+}
@@ -0,0 +1,210 @@
+/*!
+ * \file http_parser_test.c
+ * \brief Testes do analisador de requisicoes: as varreduras com memchr, SSE2
+ * e AVX2 devem produzir o mesmo resultado
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "http_parser.h"
+
+#define TEST_BUF_LEN 1024
+#define TEST_LINE_MAX 70
+
+static const char *scan_names[] = {"auto", "memchr", "sse2", "avx2"};
+
+/*! \brief Tamanhos dos pedacos em que as requisicoes sao recebidas: byte a
+ * byte, em torno dos blocos de 16 e 32 bytes e de uma vez (0) */
+static const int chunks[] = {1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 0};
+
+/*! \brief Analisa uma requisicao recebida em pedacos. Os bytes apos os
+ * validos sao '\n', que a varredura nao pode considerar
+ *
+ * \param[in] request A requisicao
+ * \param[in] len Tamanho da requisicao
+ * \param[in] chunk Tamanho dos pedacos, 0 para uma unica vez
+ * \param[out] parser O analisador
+ *
+ * \return 1 Caso a requisicao esteja completa
+ * \return 0 Caso faltem bytes
+ */
+static int parse_chunks(const char *request, int len, int chunk,
+                        http_parser *parser)
+{
+  char buffer[TEST_BUF_LEN + HTTP_PARSER_PAD];
+  int received = 0;
+  int done = 0;
+
+  memset(buffer, '\n', sizeof(buffer));
+  http_parser_init(parser);
+
+  while (!done && received < len)
+  {
+    int bytes = chunk && chunk < len - received ? chunk : len - received;
+
+    memcpy(buffer + received, request + received, bytes);
+    received += bytes;
+    done = http_parser_execute(buffer, received, parser);
+  }
+
+  return done;
+}
+
+/*! \brief Compara o resultado de cada varredura suportada, em cada tamanho
+ * de pedaco, com o do memchr de uma vez
+ *
+ * \param[in] request A requisicao
+ * \param[in] len Tamanho da requisicao
+ * \param[in] header_end Fim esperado dos headers, 0 se incompleta
+ *
+ * \return -1 Caso falha
+ * \return 0 Caso ok
+ */
+static int check_request(const char *request, int len, int header_end)
+{
+  http_parser expected;
+  http_parser parser;
+  int mode;
+  int cont;
+
+  http_scan_select(HTTP_SCAN_MEMCHR);
+  if (!header_end != !parse_chunks(request, len, 0, &expected) ||
+      header_end != expected.header_end)
+  {
+    fprintf(stderr, "memchr: fim dos headers %d, esperado %d\n",
+            expected.header_end, header_end);
+    return -1;
+  }
+
+  for (mode = HTTP_SCAN_MEMCHR; mode < NUM_HTTP_SCAN; mode++)
+  {
+    if (0 > http_scan_select(mode))
+      continue;
+
+    for (cont = 0; cont < (int) (sizeof(chunks) / sizeof(chunks[0])); cont++)
+    {
+      parse_chunks(request, len, chunks[cont], &parser);
+      if (memcmp(&parser, &expected, sizeof(parser)))
+      {
+        fprintf(stderr, "%s em pedacos de %d: resultado diferente do "
+                "memchr (len %d)\n", scan_names[mode], chunks[cont], len);
+        return -1;
+      }
+    }
+  }
+
+  http_scan_select(HTTP_SCAN_AUTO);
+  return 0;
+}
+
+/*! \brief Requisicoes fixas: CRLF, somente LF, linhas vazias antes da
+ * requisicao e corpo com '\n' apos o fim dos headers
+ *
+ * \return -1 Caso falha
+ * \return 0 Caso ok
+ */
+static int test_fixed_requests(void)
+{
+  static const char *requests[] =
+  {
+    "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+    "GET /a.txt HTTP/1.0\n\n",
+    "\r\n\nGET /x HTTP/1.1\r\nConnection: close\r\n\r\n",
+    "PUT /up.bin HTTP/1.1\r\nContent-Length: 6\r\n\r\nab\ncd\n",
+    "GET /r HTTP/1.1\r\nRange: bytes=0-9\r\nIf-None-Match: \"x\"\r\n\r\n",
+    "GET /pipelined HTTP/1.1\r\n\r\nGET /next HTTP/1.1\r\n\r\n"
+  };
+  int cont;
+
+  for (cont = 0; cont < (int) (sizeof(requests) / sizeof(requests[0]));
+       cont++)
+  {
+    const char *request = requests[cont];
+    const char *crlf = strstr(request + 2, "\r\n\r\n");
+    const char *lf = strstr(request + 2, "\n\n");
+    int header_end;
+
+    if (crlf && (!lf || crlf < lf - 2))
+      header_end = crlf + 4 - request;
+    else
+      header_end = lf + 2 - request;
+
+    if (0 > check_request(request, strlen(request), header_end))
+      return -1;
+  }
+
+  return 0;
+}
+
+/*! \brief Requisicoes com linhas de 1 a TEST_LINE_MAX bytes, que cruzam os
+ * limites dos blocos em todas as posicoes. O fim dos headers e' o ultimo
+ * byte valido ou e' seguido de um corpo com '\n'. Sem o ultimo '\n', a
+ * requisicao nao pode ser dada como completa pelos '\n' apos os bytes
+ * validos
+ *
+ * \return -1 Caso falha
+ * \return 0 Caso ok
+ */
+static int test_block_boundaries(void)
+{
+  char request[TEST_BUF_LEN];
+  char pad[TEST_LINE_MAX + 1];
+  int line_len;
+  int crlf;
+
+  for (line_len = 1; line_len <= TEST_LINE_MAX; line_len++)
+    for (crlf = 0; crlf < 2; crlf++)
+    {
+      const char *eol = crlf ? "\r\n" : "\n";
+      int header_end;
+      int len;
+
+      memset(pad, 'a' + line_len % 26, line_len);
+      pad[line_len] = '\0';
+
+      header_end = snprintf(request, sizeof(request),
+                            "GET /%s HTTP/1.1%sHost: h%sX-Pad: %s%s"
+                            "Content-Length: 4%s%s", pad, eol, eol, pad,
+                            eol, eol, eol);
+      len = header_end + snprintf(request + header_end,
+                                  sizeof(request) - header_end, "a\nb\n");
+
+      if (0 > check_request(request, header_end, header_end) ||
+          0 > check_request(request, len, header_end) ||
+          0 > check_request(request, header_end - 1, 0))
+      {
+        fprintf(stderr, "linhas de %d bytes, %s\n", line_len,
+                crlf ? "CRLF" : "LF");
+        return -1;
+      }
+    }
+
+  return 0;
+}
+
+int main(void)
+{
+  int ret = 0;
+  int mode;
+
+  for (mode = HTTP_SCAN_MEMCHR; mode < NUM_HTTP_SCAN; mode++)
+    if (0 > http_scan_select(mode))
+      fprintf(stderr, "varredura %s nao suportada, ignorada\n",
+              scan_names[mode]);
+  http_scan_select(HTTP_SCAN_AUTO);
+
+  if (0 > test_fixed_requests())
+  {
+    fprintf(stderr, "FALHA test_fixed_requests\n");
+    ret = 1;
+  }
+
+  if (0 > test_block_boundaries())
+  {
+    fprintf(stderr, "FALHA test_block_boundaries\n");
+    ret = 1;
+  }
+
+  return ret;
+}
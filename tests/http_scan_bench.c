@@ -0,0 +1,144 @@
+/*!
+ * \file http_scan_bench.c
+ * \brief Medicao da deteccao do fim dos headers: as duas buscas com strstr
+ * usadas antes do analisador incremental e o analisador com memchr, SSE2 e
+ * AVX2
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_BUF_LEN 4096
+
+static const char *scan_names[] = {"auto", "memchr", "sse2", "avx2"};
+
+/*! \brief Requisicoes medidas: curl, navegador e navegador com cookies */
+static const char *requests[] =
+{
+  "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: curl/8.5.0\r\n"
+  "Accept: */*\r\n\r\n",
+
+  "GET /docs/index.html HTTP/1.1\r\nHost: localhost:8080\r\n"
+  "Connection: keep-alive\r\nCache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+  "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+  "image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: pt-BR,pt;q=0.9,en-US;q=0.8,en;q=0.7\r\n\r\n",
+
+  "GET /app/dashboard HTTP/1.1\r\nHost: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+  "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+  "image/avif,image/webp,*/*;q=0.8\r\n"
+  "Referer: http://localhost:8080/app/login?next=%2Fapp%2Fdashboard\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: pt-BR,pt;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+  "If-None-Match: \"5f3a9c1e-2b7d-4e11-9a0c-7d2e8b6f4a13\"\r\n"
+  "Cookie: session=9b1e6f0c2d4a7e3b8c5f1a6d0e9b2c7f4a8d3e6b1c5f9a2d7e0b4c8f3a6d"
+  "1e5b; theme=dark; lang=pt-BR; _ga=GA1.1.1234567890.1700000000; "
+  "_gid=GA1.1.987654321.1700000000; csrftoken=Zx8Qw3Er7Ty1Ui5Op9As2Df6Gh0Jk"
+  "4Lz8Xc3Vb7Nm1Qw5Er9Ty2Ui6Op0As4Df8Gh3Jk7Lz1Xc5Vb9Nm\r\n\r\n"
+};
+
+/*! \brief Evita que as buscas sejam descartadas pela otimizacao */
+static volatile int bench_sink;
+
+/*! \brief Tempo monotonico em nanossegundos
+ *
+ * \return O tempo
+ */
+static long long bench_now_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*! \brief Busca anterior: "\r\n\r\n" e, se ausente, "\n\n" no buffer
+ * terminado em '\0'
+ *
+ * \param[in] buffer O buffer
+ *
+ * \return Nanossegundos por requisicao
+ */
+static double bench_strstr(const char *buffer)
+{
+  long long start = bench_now_ns();
+  int cont;
+
+  for (cont = 0; cont < BENCH_ITERATIONS; cont++)
+  {
+    const char *end = strstr(buffer, "\r\n\r\n");
+
+    if (!end)
+      end = strstr(buffer, "\n\n");
+    bench_sink = end - buffer;
+  }
+
+  return (double) (bench_now_ns() - start) / BENCH_ITERATIONS;
+}
+
+/*! \brief Analise completa da requisicao com a varredura escolhida
+ *
+ * \param[in] buffer O buffer, com HTTP_PARSER_PAD bytes apos os validos
+ * \param[in] len Tamanho da requisicao
+ *
+ * \return Nanossegundos por requisicao
+ */
+static double bench_parser(const char *buffer, int len)
+{
+  http_parser parser;
+  long long start = bench_now_ns();
+  int cont;
+
+  for (cont = 0; cont < BENCH_ITERATIONS; cont++)
+  {
+    http_parser_init(&parser);
+    http_parser_execute(buffer, len, &parser);
+    bench_sink = parser.header_end;
+  }
+
+  return (double) (bench_now_ns() - start) / BENCH_ITERATIONS;
+}
+
+int main(void)
+{
+  static char buffer[BENCH_BUF_LEN + HTTP_PARSER_PAD];
+  int req;
+  int mode;
+
+  printf("%-8s %10s", "bytes", "strstr");
+  for (mode = HTTP_SCAN_MEMCHR; mode < NUM_HTTP_SCAN; mode++)
+    printf(" %10s", scan_names[mode]);
+  printf("   (ns por requisicao)\n");
+
+  for (req = 0; req < (int) (sizeof(requests) / sizeof(requests[0])); req++)
+  {
+    int len = strlen(requests[req]);
+
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, requests[req], len);
+
+    printf("%-8d %10.1f", len, bench_strstr(buffer));
+    for (mode = HTTP_SCAN_MEMCHR; mode < NUM_HTTP_SCAN; mode++)
+    {
+      if (0 > http_scan_select(mode))
+        printf(" %10s", "-");
+      else
+        printf(" %10.1f", bench_parser(buffer, len));
+    }
+    printf("\n");
+  }
+
+  http_scan_select(HTTP_SCAN_AUTO);
+  return 0;
+}
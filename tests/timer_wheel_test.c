@@ -0,0 +1,126 @@
+/*!
+ * \file timer_wheel_test.c
+ * \brief Testes da roda de temporizadores
+ */
+
+#include <stdio.h>
+
+#include "timer_wheel.h"
+
+/*! \brief Conta as expiracoes de um temporizador
+ *
+ * \param[in] entry O temporizador
+ * \param[in] arg Nao usado
+ */
+static void count_expire(timer_entry *entry, void *arg)
+{
+  (void) arg;
+  (*(int *) entry->data)++;
+}
+
+/*! \brief Um temporizador no nivel 1 cuja volta comeca antes de um slot
+ * ocupado do nivel 0: o proximo prazo e' o inicio da volta, nao o slot.
+ * A (tick 270) fica no bloco 1 do nivel 1, agendado no tick 0; C (tick 400)
+ * fica no slot 144 do nivel 0, agendado no tick 201
+ *
+ * \return -1 Caso falha
+ * \return 0 Caso ok
+ */
+static int test_next_l1_before_l0(void)
+{
+  timer_wheel wheel;
+  timer_entry entry_a;
+  timer_entry entry_c;
+  int fired_a = 0;
+  int fired_c = 0;
+  long long next_ms;
+
+  timer_wheel_init(0, &wheel);
+  timer_entry_init(count_expire, &fired_a, &entry_a);
+  timer_entry_init(count_expire, &fired_c, &entry_c);
+
+  timer_wheel_add(270 * TIMER_TICK_MS, &entry_a, &wheel);
+  timer_wheel_advance(201 * TIMER_TICK_MS, NULL, &wheel);
+  timer_wheel_add(400 * TIMER_TICK_MS, &entry_c, &wheel);
+
+  next_ms = timer_wheel_next_ms(201 * TIMER_TICK_MS, &wheel);
+  if (0 > next_ms || (256 - 201) * TIMER_TICK_MS < next_ms)
+  {
+    fprintf(stderr, "next_ms %lld, esperado ate %d\n", next_ms,
+            (256 - 201) * TIMER_TICK_MS);
+    return -1;
+  }
+
+  timer_wheel_advance(270 * TIMER_TICK_MS, NULL, &wheel);
+  if (1 != fired_a || fired_c)
+  {
+    fprintf(stderr, "expiracoes a=%d c=%d no tick 270\n", fired_a, fired_c);
+    return -1;
+  }
+
+  next_ms = timer_wheel_next_ms(270 * TIMER_TICK_MS, &wheel);
+  if ((400 - 270) * TIMER_TICK_MS != next_ms)
+  {
+    fprintf(stderr, "next_ms %lld, esperado %d\n", next_ms,
+            (400 - 270) * TIMER_TICK_MS);
+    return -1;
+  }
+
+  timer_wheel_advance(400 * TIMER_TICK_MS, NULL, &wheel);
+  if (1 != fired_c || -1 != timer_wheel_next_ms(400 * TIMER_TICK_MS, &wheel))
+  {
+    fprintf(stderr, "expiracao de c=%d no tick 400\n", fired_c);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! \brief Somente o nivel 0 ocupado: o proximo prazo e' o do slot
+ *
+ * \return -1 Caso falha
+ * \return 0 Caso ok
+ */
+static int test_next_l0_only(void)
+{
+  timer_wheel wheel;
+  timer_entry entry;
+  int fired = 0;
+  long long next_ms;
+
+  timer_wheel_init(1000, &wheel);
+  timer_entry_init(count_expire, &fired, &entry);
+
+  if (-1 != timer_wheel_next_ms(1000, &wheel))
+    return -1;
+
+  timer_wheel_add(1000 + 50 * TIMER_TICK_MS, &entry, &wheel);
+  next_ms = timer_wheel_next_ms(1000, &wheel);
+  if (50 * TIMER_TICK_MS != next_ms)
+  {
+    fprintf(stderr, "next_ms %lld, esperado %d\n", next_ms,
+            50 * TIMER_TICK_MS);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  int ret = 0;
+
+  if (0 > test_next_l1_before_l0())
+  {
+    fprintf(stderr, "FALHA test_next_l1_before_l0\n");
+    ret = 1;
+  }
+
+  if (0 > test_next_l0_only())
+  {
+    fprintf(stderr, "FALHA test_next_l0_only\n");
+    ret = 1;
+  }
+
+  return ret;
+}